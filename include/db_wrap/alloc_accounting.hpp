@@ -0,0 +1,235 @@
+/*
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2024 Vladislav Nepogodin <vnepogodin@cachyos.org>
+ */
+#pragma once
+
+#include <db_wrap/details/sql_impl.hpp>
+
+#include <algorithm>    // for ranges::sort
+#include <atomic>       // for atomic
+#include <cstddef>      // for size_t
+#include <cstdint>      // for uint64_t
+#include <memory>       // for unique_ptr, make_unique
+#include <mutex>        // for mutex, lock_guard
+#include <string>       // for string
+#include <string_view>  // for string_view
+#include <vector>       // for vector
+
+#include <pqxx/pqxx>
+
+namespace db {
+
+/// @brief Allocations made for a single Scheme by the row mapping layer.
+///
+/// Only collected when the library is built with `DB_WRAP_ALLOC_ACCOUNTING`
+/// defined and the allocation hooks of `<db_wrap/alloc_hooks.hpp>` are
+/// linked in.
+struct alloc_stats {
+    /// The table name of the Scheme, or its type name.
+    std::string scheme;
+    /// API calls returning this Scheme (`one_row_as`, `as_set_of`, ...).
+    std::uint64_t calls{};
+    /// Allocations made by these calls, including running the query.
+    std::uint64_t call_allocations{};
+    /// Bytes requested by these allocations.
+    std::uint64_t call_bytes{};
+    /// Rows decoded into this Scheme.
+    std::uint64_t rows{};
+    /// Allocations made while decoding these rows.
+    std::uint64_t row_allocations{};
+    /// Bytes requested by these allocations.
+    std::uint64_t row_bytes{};
+
+    /// @brief Average allocations per API call.
+    [[nodiscard]] constexpr auto allocations_per_call() const noexcept -> double {
+        return calls == 0 ? 0.0 : static_cast<double>(call_allocations) / static_cast<double>(calls);
+    }
+    /// @brief Average allocations per decoded row.
+    [[nodiscard]] constexpr auto allocations_per_row() const noexcept -> double {
+        return rows == 0 ? 0.0 : static_cast<double>(row_allocations) / static_cast<double>(rows);
+    }
+};
+
+namespace details {
+
+/// @brief Allocations made on one thread, counted by the allocation hooks.
+struct alloc_counters {
+    std::uint64_t allocations;
+    std::uint64_t bytes;
+};
+
+inline thread_local alloc_counters t_alloc_counters{};
+
+/// @brief Called by the allocation hooks for every allocation.
+inline void count_allocation(std::size_t size) noexcept {
+    ++t_alloc_counters.allocations;
+    t_alloc_counters.bytes += size;
+}
+
+/// @brief What a `alloc_scope` measures.
+enum class alloc_phase : std::uint8_t {
+    /// A whole API call.
+    call,
+    /// Decoding of rows.
+    rows,
+};
+
+/// @brief Process-wide allocation totals of every Scheme.
+class alloc_ledger {
+ public:
+    struct totals {
+        std::string scheme;
+        std::atomic<std::uint64_t> calls{};
+        std::atomic<std::uint64_t> call_allocations{};
+        std::atomic<std::uint64_t> call_bytes{};
+        std::atomic<std::uint64_t> rows{};
+        std::atomic<std::uint64_t> row_allocations{};
+        std::atomic<std::uint64_t> row_bytes{};
+    };
+
+    /// @brief The process-wide ledger.
+    static auto instance() -> alloc_ledger& {
+        static alloc_ledger ledger{};
+        return ledger;
+    }
+
+    /// @brief The totals of `T`, registered on first use.
+    template <typename T>
+    static auto of() -> totals& {
+        static totals& result = instance().add(alloc_ledger::scheme_name<T>());
+        return result;
+    }
+
+    /// @brief A snapshot of the totals of every Scheme seen so far.
+    [[nodiscard]] auto snapshot() const -> std::vector<alloc_stats> {
+        std::lock_guard lock{m_mutex};
+        std::vector<alloc_stats> result{};
+        result.reserve(m_totals.size());
+        for (auto&& entry : m_totals) {
+            result.emplace_back(alloc_ledger::load(*entry));
+        }
+        std::ranges::sort(result, {}, &alloc_stats::scheme);
+        return result;
+    }
+
+    /// @brief Sets every total back to zero.
+    void reset() {
+        std::lock_guard lock{m_mutex};
+        for (auto&& entry : m_totals) {
+            for (auto* counter : {&entry->calls, &entry->call_allocations, &entry->call_bytes, &entry->rows,
+                     &entry->row_allocations, &entry->row_bytes}) {
+                counter->store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    static auto load(const totals& entry) -> alloc_stats {
+        return alloc_stats{
+            .scheme           = entry.scheme,
+            .calls            = entry.calls.load(std::memory_order_relaxed),
+            .call_allocations = entry.call_allocations.load(std::memory_order_relaxed),
+            .call_bytes       = entry.call_bytes.load(std::memory_order_relaxed),
+            .rows             = entry.rows.load(std::memory_order_relaxed),
+            .row_allocations  = entry.row_allocations.load(std::memory_order_relaxed),
+            .row_bytes        = entry.row_bytes.load(std::memory_order_relaxed),
+        };
+    }
+
+ private:
+    alloc_ledger() = default;
+
+    template <typename T>
+    static auto scheme_name() -> std::string {
+        if constexpr (sql::details::HasName<T>) {
+            return std::string{T::kName};
+        } else {
+            return std::string{pqxx::type_name<T>};
+        }
+    }
+
+    auto add(std::string scheme) -> totals& {
+        std::lock_guard lock{m_mutex};
+        auto& entry  = m_totals.emplace_back(std::make_unique<totals>());
+        entry->scheme = std::move(scheme);
+        return *entry;
+    }
+
+    mutable std::mutex m_mutex{};
+    std::vector<std::unique_ptr<totals>> m_totals{};
+};
+
+#if defined(DB_WRAP_ALLOC_ACCOUNTING)
+
+/// @brief Adds the allocations made on this thread during its lifetime to
+///        the totals of `T`.
+template <typename T>
+class alloc_scope {
+ public:
+    explicit alloc_scope(alloc_phase phase, std::size_t rows = 0) noexcept
+      : m_phase(phase), m_rows(rows), m_start(t_alloc_counters) { }
+
+    alloc_scope(const alloc_scope&)            = delete;
+    alloc_scope& operator=(const alloc_scope&) = delete;
+
+    ~alloc_scope() {
+        const auto allocations = t_alloc_counters.allocations - m_start.allocations;
+        const auto bytes       = t_alloc_counters.bytes - m_start.bytes;
+
+        auto& totals = alloc_ledger::of<T>();
+        if (m_phase == alloc_phase::call) {
+            totals.calls.fetch_add(1, std::memory_order_relaxed);
+            totals.call_allocations.fetch_add(allocations, std::memory_order_relaxed);
+            totals.call_bytes.fetch_add(bytes, std::memory_order_relaxed);
+        } else {
+            totals.rows.fetch_add(m_rows, std::memory_order_relaxed);
+            totals.row_allocations.fetch_add(allocations, std::memory_order_relaxed);
+            totals.row_bytes.fetch_add(bytes, std::memory_order_relaxed);
+        }
+    }
+
+ private:
+    alloc_phase m_phase;
+    std::size_t m_rows;
+    alloc_counters m_start;
+};
+
+#else
+
+template <typename T>
+class alloc_scope {
+ public:
+    constexpr explicit alloc_scope(alloc_phase /*unused*/, std::size_t /*unused*/ = 0) noexcept { }
+};
+
+#endif
+
+}  // namespace details
+
+/// @brief The allocations of the row mapping layer for `T` so far.
+template <typename T>
+auto alloc_stats_of() -> alloc_stats {
+    return details::alloc_ledger::load(details::alloc_ledger::of<T>());
+}
+
+/// @brief The allocations of the row mapping layer for every Scheme so far,
+///        ordered by Scheme name.
+inline auto alloc_report() -> std::vector<alloc_stats> {
+    return details::alloc_ledger::instance().snapshot();
+}
+
+/// @brief Sets the allocation counters of every Scheme back to zero.
+inline void reset_alloc_stats() {
+    details::alloc_ledger::instance().reset();
+}
+
+/// @brief The allocations made on this thread so far.
+///
+/// Taking the difference of two snapshots measures a block of code, which
+/// makes it possible to assert allocation budgets in tests.
+inline auto thread_alloc_counters() noexcept -> details::alloc_counters {
+    return details::t_alloc_counters;
+}
+
+}  // namespace db
@@ -0,0 +1,63 @@
+/*
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2024 Vladislav Nepogodin <vnepogodin@cachyos.org>
+ */
+#pragma once
+
+// Replaces the global allocation functions with ones counting every
+// allocation for `db::alloc_report`. Like a `main`, the replacements must be
+// defined exactly once per program: include this header in a single
+// translation unit, with `DB_WRAP_ALLOC_HOOKS_IMPLEMENT` defined.
+//
+// #define DB_WRAP_ALLOC_HOOKS_IMPLEMENT
+// #include <db_wrap/alloc_hooks.hpp>
+
+#include <db_wrap/alloc_accounting.hpp>
+
+#if defined(DB_WRAP_ALLOC_HOOKS_IMPLEMENT)
+
+#include <cstddef>  // for size_t
+#include <cstdlib>  // for malloc, free
+#include <new>      // for bad_alloc
+
+namespace db::details {
+
+inline auto counted_alloc(std::size_t size) -> void* {
+    details::count_allocation(size);
+    // NOTE: malloc(0) may return nullptr, which operator new must not
+    if (void* ptr = std::malloc(size == 0 ? 1 : size)) {
+        return ptr;
+    }
+    throw std::bad_alloc{};
+}
+
+}  // namespace db::details
+
+// NOLINTBEGIN(misc-new-delete-overloads)
+void* operator new(std::size_t size) {
+    return db::details::counted_alloc(size);
+}
+
+void* operator new[](std::size_t size) {
+    return db::details::counted_alloc(size);
+}
+
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t /*unused*/) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t /*unused*/) noexcept {
+    std::free(ptr);
+}
+// NOLINTEND(misc-new-delete-overloads)
+
+#endif
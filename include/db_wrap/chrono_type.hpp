@@ -0,0 +1,459 @@
+/*
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2024 Vladislav Nepogodin <vnepogodin@cachyos.org>
+ */
+#pragma once
+
+#include <array>        // for array
+#include <chrono>       // for sys_time, year_month_day, duration
+#include <cstdint>      // for int64_t
+#include <optional>     // for optional
+#include <string>       // for string
+#include <string_view>  // for string_view
+#include <utility>      // for pair
+
+#include <pqxx/pqxx>
+
+namespace db {
+
+/// @brief Point in time as stored by `timestamp` and `timestamptz` columns.
+using timestamp = std::chrono::sys_time<std::chrono::microseconds>;
+
+namespace details {
+
+/// @brief Reads exactly `width` decimal digits.
+constexpr auto parse_pg_fixed(std::string_view text, std::size_t& pos, std::size_t width, int& out) noexcept -> bool {
+    if (pos + width > text.size()) {
+        return false;
+    }
+    int value{};
+    for (std::size_t i = pos; i < pos + width; ++i) {
+        if (text[i] < '0' || text[i] > '9') {
+            return false;
+        }
+        value = (value * 10) + (text[i] - '0');
+    }
+    pos += width;
+    out = value;
+    return true;
+}
+
+constexpr auto parse_pg_separator(std::string_view text, std::size_t& pos, char separator) noexcept -> bool {
+    if (pos >= text.size() || text[pos] != separator) {
+        return false;
+    }
+    ++pos;
+    return true;
+}
+
+/// @brief Reads an ISO `YYYY-MM-DD` date (`DateStyle` ISO, the server default).
+constexpr auto parse_pg_date(std::string_view text, std::size_t& pos) noexcept -> std::optional<std::chrono::year_month_day> {
+    const auto year_begin = pos;
+    int year{};
+    while (pos < text.size() && text[pos] >= '0' && text[pos] <= '9' && pos - year_begin < 7) {
+        year = (year * 10) + (text[pos++] - '0');
+    }
+    int month{};
+    int day{};
+    if (pos - year_begin < 4 || !parse_pg_separator(text, pos, '-') || !parse_pg_fixed(text, pos, 2, month)
+        || !parse_pg_separator(text, pos, '-') || !parse_pg_fixed(text, pos, 2, day)) {
+        return std::nullopt;
+    }
+
+    const std::chrono::year_month_day date{std::chrono::year{year}, std::chrono::month{static_cast<unsigned>(month)},
+        std::chrono::day{static_cast<unsigned>(day)}};
+    if (!date.ok()) {
+        return std::nullopt;
+    }
+    return date;
+}
+
+/// @brief Reads `HH:MM:SS[.ffffff]`; hours may exceed 24 (as in intervals).
+constexpr auto parse_pg_time(std::string_view text, std::size_t& pos) noexcept -> std::optional<std::chrono::microseconds> {
+    std::int64_t hours{};
+    const auto hours_begin = pos;
+    while (pos < text.size() && text[pos] >= '0' && text[pos] <= '9') {
+        hours = (hours * 10) + (text[pos++] - '0');
+    }
+    int minutes{};
+    int seconds{};
+    if (pos - hours_begin < 2 || !parse_pg_separator(text, pos, ':') || !parse_pg_fixed(text, pos, 2, minutes)
+        || !parse_pg_separator(text, pos, ':') || !parse_pg_fixed(text, pos, 2, seconds)) {
+        return std::nullopt;
+    }
+
+    std::int64_t fraction{};
+    if (pos < text.size() && text[pos] == '.') {
+        std::int64_t scale{100000};
+        for (++pos; pos < text.size() && text[pos] >= '0' && text[pos] <= '9'; ++pos) {
+            fraction += (text[pos] - '0') * scale;
+            scale /= 10;
+        }
+    }
+    return std::chrono::hours{hours} + std::chrono::minutes{minutes} + std::chrono::seconds{seconds}
+        + std::chrono::microseconds{fraction};
+}
+
+/// @brief Parses the text form of a `timestamptz`, `timestamp` or `date` value.
+///
+/// A fixed-layout parser for the ISO output of the server, with no locale or
+/// `sscanf` involved. Values with a UTC offset are converted to UTC; values
+/// without one are taken as UTC.
+constexpr auto parse_pg_timestamp(std::string_view text) noexcept -> std::optional<timestamp> {
+    if (text == "infinity") {
+        return timestamp::max();
+    }
+    if (text == "-infinity") {
+        return timestamp::min();
+    }
+
+    const bool is_bc = text.ends_with(" BC");
+    if (is_bc) {
+        text.remove_suffix(3);
+    }
+
+    std::size_t pos{};
+    auto date = details::parse_pg_date(text, pos);
+    if (!date) {
+        return std::nullopt;
+    }
+    if (is_bc) {
+        // 1 BC is year 0
+        *date = std::chrono::year{1 - static_cast<int>(date->year())} / date->month() / date->day();
+    }
+
+    timestamp result{std::chrono::sys_days{*date}};
+    if (pos == text.size()) {
+        return result;
+    }
+    if (text[pos] != ' ' && text[pos] != 'T') {
+        return std::nullopt;
+    }
+    ++pos;
+
+    const auto time_of_day = details::parse_pg_time(text, pos);
+    if (!time_of_day) {
+        return std::nullopt;
+    }
+    result += *time_of_day;
+
+    if (pos < text.size() && (text[pos] == '+' || text[pos] == '-')) {
+        const bool is_negative = text[pos++] == '-';
+        int hours{};
+        int minutes{};
+        int seconds{};
+        if (!details::parse_pg_fixed(text, pos, 2, hours)) {
+            return std::nullopt;
+        }
+        if (details::parse_pg_separator(text, pos, ':') && !details::parse_pg_fixed(text, pos, 2, minutes)) {
+            return std::nullopt;
+        }
+        if (details::parse_pg_separator(text, pos, ':') && !details::parse_pg_fixed(text, pos, 2, seconds)) {
+            return std::nullopt;
+        }
+        const auto offset = std::chrono::hours{hours} + std::chrono::minutes{minutes} + std::chrono::seconds{seconds};
+        result -= is_negative ? -offset : offset;
+    }
+    if (pos != text.size()) {
+        return std::nullopt;
+    }
+    return result;
+}
+
+/// @brief Parses the text form of an `interval` (`IntervalStyle` postgres, the server default).
+///
+/// Only intervals of a fixed length can be represented by a duration, so
+/// intervals with a year or month part are rejected; days count as 24 hours.
+constexpr auto parse_pg_interval(std::string_view text) noexcept -> std::optional<std::chrono::microseconds> {
+    std::chrono::microseconds result{};
+    std::size_t pos{};
+    while (pos < text.size()) {
+        if (text[pos] == ' ') {
+            ++pos;
+            continue;
+        }
+
+        const bool is_negative = text[pos] == '-';
+        if (text[pos] == '+' || text[pos] == '-') {
+            ++pos;
+        }
+        auto digits_end = pos;
+        while (digits_end < text.size() && text[digits_end] >= '0' && text[digits_end] <= '9') {
+            ++digits_end;
+        }
+        if (digits_end < text.size() && text[digits_end] == ':') {
+            const auto time_part = details::parse_pg_time(text, pos);
+            if (!time_part) {
+                return std::nullopt;
+            }
+            result += is_negative ? -*time_part : *time_part;
+            continue;
+        }
+
+        const auto number_begin = pos;
+        std::int64_t number{};
+        while (pos < text.size() && text[pos] >= '0' && text[pos] <= '9') {
+            number = (number * 10) + (text[pos++] - '0');
+        }
+        if (pos == number_begin || !details::parse_pg_separator(text, pos, ' ')) {
+            return std::nullopt;
+        }
+        const auto unit_begin = pos;
+        while (pos < text.size() && text[pos] != ' ') {
+            ++pos;
+        }
+        const auto unit = text.substr(unit_begin, pos - unit_begin);
+        if (unit != "day" && unit != "days") {
+            return std::nullopt;
+        }
+        result += std::chrono::days{is_negative ? -number : number};
+    }
+    return result;
+}
+
+/// @brief Writes `value` in decimal, zero-padded to at least `width` digits.
+constexpr auto write_pg_number(char* out, std::int64_t value, int width) noexcept -> char* {
+    std::array<char, 20> digits{};
+    std::size_t count{};
+    auto magnitude = static_cast<std::uint64_t>(value < 0 ? -(value + 1) : value) + (value < 0 ? 1U : 0U);
+    do {
+        digits[count++] = static_cast<char>('0' + (magnitude % 10));
+        magnitude /= 10;
+    } while (magnitude != 0);
+    while (count < static_cast<std::size_t>(width)) {
+        digits[count++] = '0';
+    }
+    if (value < 0) {
+        *out++ = '-';
+    }
+    while (count != 0) {
+        *out++ = digits[--count];
+    }
+    return out;
+}
+
+constexpr auto write_pg_text(char* out, std::string_view text) noexcept -> char* {
+    for (const char chr : text) {
+        *out++ = chr;
+    }
+    return out;
+}
+
+/// @brief Writes a date as `YYYY-MM-DD`, leaving the ` BC` suffix to the caller.
+/// @return The end of the text and whether the date is before the common era.
+constexpr auto format_pg_date(char* out, std::chrono::year_month_day date) noexcept -> std::pair<char*, bool> {
+    auto year        = static_cast<int>(date.year());
+    const bool is_bc = year <= 0;
+    if (is_bc) {
+        year = 1 - year;
+    }
+
+    out    = details::write_pg_number(out, year, 4);
+    *out++ = '-';
+    out    = details::write_pg_number(out, static_cast<unsigned>(date.month()), 2);
+    *out++ = '-';
+    out    = details::write_pg_number(out, static_cast<unsigned>(date.day()), 2);
+    return {out, is_bc};
+}
+
+/// @brief Writes a timestamp as `YYYY-MM-DD HH:MM:SS.ffffff+00`, at most `kPgTimestampSize` chars.
+constexpr auto format_pg_timestamp(char* out, timestamp value) noexcept -> char* {
+    if (value == timestamp::max()) {
+        return details::write_pg_text(out, "infinity");
+    }
+    if (value == timestamp::min()) {
+        return details::write_pg_text(out, "-infinity");
+    }
+
+    const auto day = std::chrono::floor<std::chrono::days>(value);
+    const std::chrono::hh_mm_ss time_of_day{value - day};
+
+    auto [date_end, is_bc] = details::format_pg_date(out, std::chrono::year_month_day{day});
+    out                    = date_end;
+    *out++                 = ' ';
+    out    = details::write_pg_number(out, time_of_day.hours().count(), 2);
+    *out++ = ':';
+    out    = details::write_pg_number(out, time_of_day.minutes().count(), 2);
+    *out++ = ':';
+    out    = details::write_pg_number(out, time_of_day.seconds().count(), 2);
+    *out++ = '.';
+    out    = details::write_pg_number(out, time_of_day.subseconds().count(), 6);
+    out    = details::write_pg_text(out, "+00");
+    if (is_bc) {
+        out = details::write_pg_text(out, " BC");
+    }
+    return out;
+}
+
+/// @brief Upper bound of the text written by `format_pg_timestamp`.
+inline constexpr std::size_t kPgTimestampSize = 40;
+
+/// @brief Upper bound of the text written for an interval.
+inline constexpr std::size_t kPgIntervalSize = 40;
+
+/// @brief Implements `pqxx::string_traits::into_buf` for text of at most `max_size` chars.
+/// @param writer Writes the text to the given position and returns its end.
+template <typename Writer>
+auto into_pg_buf(char* begin, char* end, std::size_t max_size, Writer&& writer) -> char* {
+    if (end - begin < static_cast<std::ptrdiff_t>(max_size + 1)) {
+        throw pqxx::conversion_overrun{"Not enough buffer space to convert a chrono value."};
+    }
+    char* text_end = writer(begin);
+    *text_end++    = '\0';
+    return text_end;
+}
+
+}  // namespace details
+
+template <typename T>
+struct pg_type_names;
+
+template <typename Duration>
+struct pg_type_names<std::chrono::sys_time<Duration>> {
+    static constexpr std::array<std::string_view, 3> kNames{"timestamptz", "timestamp", "date"};
+};
+
+template <typename Rep, typename Period>
+struct pg_type_names<std::chrono::duration<Rep, Period>> {
+    static constexpr std::array<std::string_view, 1> kNames{"interval"};
+};
+
+template <>
+struct pg_type_names<std::chrono::year_month_day> {
+    static constexpr std::array<std::string_view, 1> kNames{"date"};
+};
+
+}  // namespace db
+
+namespace pqxx {
+
+/// `timestamptz`, `timestamp` and `date` as `std::chrono::sys_time`, in UTC.
+template <typename Duration>
+struct nullness<std::chrono::sys_time<Duration>> : no_null<std::chrono::sys_time<Duration>> {};
+
+template <typename Duration>
+inline const std::string_view type_name<std::chrono::sys_time<Duration>>{"std::chrono::sys_time"};
+
+template <typename Duration>
+struct string_traits<std::chrono::sys_time<Duration>> {
+    using value_type = std::chrono::sys_time<Duration>;
+
+    static constexpr bool converts_to_string{true};
+    static constexpr bool converts_from_string{true};
+
+    static auto from_string(std::string_view text) -> value_type {
+        const auto value = db::details::parse_pg_timestamp(text);
+        if (!value) {
+            throw conversion_error{"Could not convert '" + std::string{text} + "' to std::chrono::sys_time."};
+        }
+        if (*value == db::timestamp::max()) {
+            return value_type::max();
+        }
+        if (*value == db::timestamp::min()) {
+            return value_type::min();
+        }
+        return std::chrono::floor<Duration>(*value);
+    }
+
+    static auto to_buf(char* begin, char* end, const value_type& value) -> zview {
+        const char* text_end = into_buf(begin, end, value);
+        return zview{begin, static_cast<std::size_t>(text_end - begin - 1)};
+    }
+
+    static auto into_buf(char* begin, char* end, const value_type& value) -> char* {
+        db::timestamp micros{};
+        if (value == value_type::max()) {
+            micros = db::timestamp::max();
+        } else if (value == value_type::min()) {
+            micros = db::timestamp::min();
+        } else {
+            micros = std::chrono::floor<std::chrono::microseconds>(value);
+        }
+        return db::details::into_pg_buf(begin, end, db::details::kPgTimestampSize,
+            [micros](char* out) { return db::details::format_pg_timestamp(out, micros); });
+    }
+
+    static auto size_buffer(const value_type& /*value*/) noexcept -> std::size_t { return db::details::kPgTimestampSize + 1; }
+};
+
+/// `interval` as `std::chrono::duration`; intervals with years or months cannot be read.
+template <typename Rep, typename Period>
+struct nullness<std::chrono::duration<Rep, Period>> : no_null<std::chrono::duration<Rep, Period>> {};
+
+template <typename Rep, typename Period>
+inline const std::string_view type_name<std::chrono::duration<Rep, Period>>{"std::chrono::duration"};
+
+template <typename Rep, typename Period>
+struct string_traits<std::chrono::duration<Rep, Period>> {
+    using value_type = std::chrono::duration<Rep, Period>;
+
+    static constexpr bool converts_to_string{true};
+    static constexpr bool converts_from_string{true};
+
+    static auto from_string(std::string_view text) -> value_type {
+        const auto value = db::details::parse_pg_interval(text);
+        if (!value) {
+            throw conversion_error{"Could not convert '" + std::string{text} + "' to std::chrono::duration."};
+        }
+        return std::chrono::duration_cast<value_type>(*value);
+    }
+
+    static auto to_buf(char* begin, char* end, const value_type& value) -> zview {
+        const char* text_end = into_buf(begin, end, value);
+        return zview{begin, static_cast<std::size_t>(text_end - begin - 1)};
+    }
+
+    static auto into_buf(char* begin, char* end, const value_type& value) -> char* {
+        const auto micros = std::chrono::floor<std::chrono::microseconds>(value);
+        return db::details::into_pg_buf(begin, end, db::details::kPgIntervalSize, [micros](char* out) {
+            out = db::details::write_pg_number(out, micros.count(), 1);
+            return db::details::write_pg_text(out, " microseconds");
+        });
+    }
+
+    static auto size_buffer(const value_type& /*value*/) noexcept -> std::size_t { return db::details::kPgIntervalSize + 1; }
+};
+
+// libpqxx ships its own conversion of `date` to year_month_day when the
+// standard library supports it
+#if !defined(PQXX_HAVE_YEAR_MONTH_DAY)
+template <>
+struct nullness<std::chrono::year_month_day> : no_null<std::chrono::year_month_day> {};
+
+template <>
+inline const std::string_view type_name<std::chrono::year_month_day>{"std::chrono::year_month_day"};
+
+template <>
+struct string_traits<std::chrono::year_month_day> {
+    static constexpr bool converts_to_string{true};
+    static constexpr bool converts_from_string{true};
+
+    static auto from_string(std::string_view text) -> std::chrono::year_month_day {
+        const auto value = db::details::parse_pg_timestamp(text);
+        if (!value || *value == db::timestamp::max() || *value == db::timestamp::min()
+            || *value != std::chrono::floor<std::chrono::days>(*value)) {
+            throw conversion_error{"Could not convert '" + std::string{text} + "' to std::chrono::year_month_day."};
+        }
+        return std::chrono::year_month_day{std::chrono::floor<std::chrono::days>(*value)};
+    }
+
+    static auto to_buf(char* begin, char* end, const std::chrono::year_month_day& value) -> zview {
+        const char* text_end = into_buf(begin, end, value);
+        return zview{begin, static_cast<std::size_t>(text_end - begin - 1)};
+    }
+
+    static auto into_buf(char* begin, char* end, const std::chrono::year_month_day& value) -> char* {
+        return db::details::into_pg_buf(begin, end, db::details::kPgTimestampSize, [value](char* out) {
+            auto [date_end, is_bc] = db::details::format_pg_date(out, value);
+            return is_bc ? db::details::write_pg_text(date_end, " BC") : date_end;
+        });
+    }
+
+    static auto size_buffer(const std::chrono::year_month_day& /*value*/) noexcept -> std::size_t {
+        return db::details::kPgTimestampSize + 1;
+    }
+};
+#endif
+
+}  // namespace pqxx
@@ -5,16 +5,86 @@
  */
 #pragma once
 
+#include <db_wrap/db_error.hpp>
 #include <db_wrap/db_utils.hpp>
 #include <db_wrap/details/pfr_utils.hpp>
 #include <db_wrap/sql_utils.hpp>
 
-#include <optional>  // for optional
+#include <optional>     // for optional
+#include <ranges>       // for ranges::*
+#include <string>       // for string
+#include <string_view>  // for string_view
+#include <utility>      // for move, forward
+#include <vector>       // for vector
 
 #include <pqxx/pqxx>
 
 namespace db {
 
+/// @brief Thrown by `db::update_record` and `db::update_fields` when a
+///        record with a version field (see `sql::details::HasVersionField`)
+///        was changed or deleted since it was read.
+class version_conflict : public pqxx::failure {
+ public:
+    explicit version_conflict(std::string_view table)
+      : pqxx::failure("version conflict updating " + std::string{table}) { }
+};
+
+namespace details {
+
+/// @brief The version the record was read with.
+template <sql::details::HasVersionField Scheme>
+constexpr auto version_of(const Scheme& record) noexcept {
+    constexpr auto kVersionIdx = sql::details::version_field_idx<Scheme>();
+    static_assert(kVersionIdx < utils::get_fields_count<Scheme>(), "kVersionField names no field of the scheme!");
+    return utils::get_field_by_idx<kVersionIdx>(record);
+}
+
+/// @brief Turns an update of a versioned record that matched no row into a
+///        `db::version_conflict`.
+template <sql::details::HasName Scheme>
+auto check_version(std::size_t affected) -> std::size_t {
+    if constexpr (sql::details::HasVersionField<Scheme>) {
+        if (affected == 0) {
+            throw version_conflict{Scheme::kName};
+        }
+    }
+    return affected;
+}
+
+/// @brief Turns an update of a versioned record that matched no row into a
+///        `db::error_kind::version_conflict`, without throwing.
+template <sql::details::HasName Scheme>
+auto check_version_or_error(expected<std::size_t, error> affected) -> expected<std::size_t, error> {
+    if constexpr (sql::details::HasVersionField<Scheme>) {
+        if (affected && *affected == 0) {
+            return unexpected<error>{error{.kind = error_kind::version_conflict,
+                .message = "version conflict updating " + std::string{Scheme::kName}}};
+        }
+    }
+    return affected;
+}
+
+/// @brief Constructs the insert of `Scheme` that skips a row whose ID
+///        exists already instead of failing.
+///
+/// @example
+/// static_assert(db::details::construct_insert_or_skip_query<User>()
+///     == "INSERT INTO users (id, name, age) VALUES ($1, $2, $3) ON CONFLICT (id) DO NOTHING;");
+template <sql::details::HasName Scheme>
+consteval auto construct_insert_or_skip_query() noexcept {
+    constexpr auto kInsertAllQuery         = sql::utils::create_insert_all_query<Scheme>();
+    constexpr std::string_view kOnConflict = " ON CONFLICT (id) DO NOTHING;";
+
+    // the generated statement without its semicolon
+    ::db::details::static_string<kInsertAllQuery.size() + kOnConflict.size()> res{};
+    res += std::string_view{kInsertAllQuery.data(), kInsertAllQuery.size() - 1};
+    res += kOnConflict;
+    return res;
+}
+
+}  // namespace details
+
 /// @brief Finds a record in a database table by its unique ID.
 ///
 /// This function constructs and executes a SELECT query to retrieve a
@@ -55,6 +125,41 @@ auto find_by_id(pqxx::connection& conn, IdType&& id) -> std::optional<Scheme> {
     return db::utils::one_row_as<Scheme>(conn, kSelectQuery, id);
 }
 
+/// @brief Finds all records in a database table whose ID is in `ids`.
+///
+/// This function fetches every requested record with a single SELECT query
+/// using `id = ANY($1)`, binding the IDs as one array parameter. The order
+/// of the returned records is unspecified, and IDs without a matching
+/// record are silently skipped.
+///
+/// @tparam Scheme The type representing the database table scheme. Must
+///                satisfy the `sql::details::HasSchemeAndId` concept.
+/// @tparam Ids A range of values convertible to the type of `Scheme::id`.
+/// @param conn The pqxx::connection object representing the database connection.
+/// @param ids The IDs to search for.
+/// @return A vector of the matching records, empty if none matched.
+///
+/// @example
+/// std::vector<int> ids{1, 2, 3};
+/// auto users = db::find_by_ids<User>(conn, ids);
+/// std::cout << "Found " << users.size() << " users" << std::endl;
+template <sql::details::HasSchemeAndId Scheme, std::ranges::input_range Ids>
+auto find_by_ids(pqxx::connection& conn, Ids&& ids) -> std::vector<Scheme> {
+    constexpr auto kSelectQuery = sql::utils::construct_query_from_condition<Scheme, "id = ANY($1)">();
+
+    std::vector<sql::details::id_field_t<Scheme>> id_array{};
+    if constexpr (std::ranges::sized_range<Ids>) {
+        id_array.reserve(static_cast<std::size_t>(std::ranges::size(ids)));
+    }
+    for (auto&& id : ids) {
+        id_array.emplace_back(id);
+    }
+    if (id_array.empty()) {
+        return {};
+    }
+    return db::utils::as_set_of<Scheme>(conn, kSelectQuery, id_array).value_or(std::vector<Scheme>{});
+}
+
 /// @brief Retrieves all records from a table as an optional vector.
 ///
 /// This function constructs and executes a SELECT query to retrieve all
@@ -107,6 +212,10 @@ auto get_all_records(pqxx::connection& conn) -> std::optional<std::vector<Scheme
 /// values of the specified fields from the `record` object and binds
 /// them to the query parameters.
 ///
+/// If `Scheme` has a version field, the update only applies if the stored
+/// version still equals the one of `record`, and increments it; otherwise
+/// `db::version_conflict` is thrown.
+///
 /// @tparam Scheme The type representing the database table scheme. Must
 ///                satisfy the `sql::details::HasSchemeAndId` concept.
 /// @tparam Fields A pack of `db::details::static_string` representing the names
@@ -115,6 +224,7 @@ auto get_all_records(pqxx::connection& conn) -> std::optional<std::vector<Scheme
 /// @param record The object containing the data to update. The "id" field
 ///               of this object is used to identify the record to update.
 /// @return The number of rows affected by the UPDATE query.
+/// @throws db::version_conflict if the version of `record` is stale.
 ///
 /// @example
 /// struct User {
@@ -132,7 +242,14 @@ auto update_fields(pqxx::connection& conn, const Scheme& record) -> std::size_t
     static_assert(sql::details::validate_fields<Fields...>(Scheme{}), "non existent field detected!");
 
     constexpr auto kUpdateQuery = sql::utils::create_update_query<Scheme, Fields...>();
-    return db::utils::exec_affected(conn, kUpdateQuery, record.id, db::utils::get_field_by_name<Fields>(record)...);
+    if constexpr (sql::details::HasVersionField<Scheme>) {
+        static_assert(((std::string_view{Fields} != std::string_view{Scheme::kVersionField}) && ...),
+            "the version field is incremented by the update itself!");
+        return details::check_version<Scheme>(db::utils::exec_affected(conn, kUpdateQuery, record.id,
+            db::utils::get_field_by_name<Fields>(record)..., details::version_of(record)));
+    } else {
+        return db::utils::exec_affected(conn, kUpdateQuery, record.id, db::utils::get_field_by_name<Fields>(record)...);
+    }
 }
 
 /// @brief Deletes a record from a database table by its unique ID.
@@ -186,6 +303,14 @@ auto delete_record_by_id(pqxx::connection& conn, IdType&& id) -> std::size_t {
 /// The function automatically handles the binding of all fields from the
 /// `record` object as parameters to the query.
 ///
+/// If `Scheme` has a version field (see `sql::details::HasVersionField`),
+/// the update is optimistic: it only applies if the stored version still
+/// equals the one of `record`, and increments it, so concurrent
+/// read-modify-write cycles need no row locks. If another writer got there
+/// first, `db::version_conflict` is thrown and the record should be read
+/// again. After a successful update, the stored version is one more than
+/// the version of `record`.
+///
 /// @tparam Scheme The type representing the database table scheme. Must
 ///                satisfy the `sql::details::HasSchemeAndId` concept.
 /// @param conn The pqxx::connection object representing the database connection.
@@ -195,6 +320,7 @@ auto delete_record_by_id(pqxx::connection& conn, IdType&& id) -> std::size_t {
 ///               column in the database.
 /// @return The number of rows affected by the UPDATE query, which should
 ///         typically be 1 if the record was found and updated successfully.
+/// @throws db::version_conflict if the version of `record` is stale.
 ///
 /// @example
 /// struct User {
@@ -213,10 +339,19 @@ auto delete_record_by_id(pqxx::connection& conn, IdType&& id) -> std::size_t {
 /// } else {
 ///   std::cout << "Failed to update user (rows affected: " << rows_affected << ")" << std::endl;
 /// }
+///
+/// // optimistic update of a record with a version field
+/// auto account = db::find_by_id<Account>(conn, 1);
+/// account->balance += 100;
+/// try {
+///   db::update_record(conn, *account);
+/// } catch (const db::version_conflict&) {
+///   // changed concurrently, read it again and retry
+/// }
 template <sql::details::HasSchemeAndId Scheme>
 auto update_record(pqxx::connection& conn, const Scheme& record) -> std::size_t {
     constexpr auto kUpdateAllQuery = sql::utils::create_update_all_query<Scheme>();
-    return db::utils::exec_affected<Scheme>(conn, kUpdateAllQuery, record);
+    return details::check_version<Scheme>(db::utils::exec_affected<Scheme>(conn, kUpdateAllQuery, record));
 }
 
 /// @brief Inserts a new record into a database table and returns the number of rows affected.
@@ -250,4 +385,100 @@ auto insert_record(pqxx::connection& conn, const Scheme& record) -> std::size_t
     return db::utils::exec_affected<Scheme>(conn, kInsertAllQuery, record);
 }
 
+/// @brief Like `db::find_by_id`, but returns failures as a `db::error`
+///        instead of throwing them (see `db::utils::try_one_row_as`).
+template <sql::details::HasSchemeAndId Scheme, typename IdType = Scheme::id>
+auto try_find_by_id(pqxx::connection& conn, IdType&& id) -> expected<std::optional<Scheme>, error> {
+    constexpr auto kSelectQuery = sql::utils::construct_query_from_condition<Scheme, "id = $1">();
+    return db::utils::try_one_row_as<Scheme>(conn, kSelectQuery, id);
+}
+
+/// @brief Like `db::find_by_ids`, but returns failures as a `db::error`
+///        instead of throwing them (see `db::utils::try_one_row_as`).
+template <sql::details::HasSchemeAndId Scheme, std::ranges::input_range Ids>
+auto try_find_by_ids(pqxx::connection& conn, Ids&& ids) -> expected<std::vector<Scheme>, error> {
+    return db::details::capture_error([&] { return db::find_by_ids<Scheme>(conn, std::forward<Ids>(ids)); });
+}
+
+/// @brief Like `db::get_all_records`, but returns failures as a `db::error`
+///        instead of throwing them (see `db::utils::try_one_row_as`).
+template <sql::details::HasSchemeAndId Scheme>
+auto try_get_all_records(pqxx::connection& conn) -> expected<std::optional<std::vector<Scheme>>, error> {
+    constexpr auto kSelectAllQuery = sql::utils::construct_select_all_query<Scheme>();
+    return db::utils::try_as_set_of<Scheme>(conn, kSelectAllQuery);
+}
+
+/// @brief Like `db::update_fields`, but returns failures as a `db::error`
+///        instead of throwing them.
+///
+/// A stale version is reported as `db::error_kind::version_conflict` without
+/// throwing `db::version_conflict`.
+///
+/// @return The number of rows updated, or the error.
+template <sql::details::HasSchemeAndId Scheme, ::db::details::static_string... Fields>
+auto try_update_fields(pqxx::connection& conn, const Scheme& record) -> expected<std::size_t, error> {
+    static_assert(sql::details::validate_fields<Fields...>(Scheme{}), "non existent field detected!");
+
+    constexpr auto kUpdateQuery = sql::utils::create_update_query<Scheme, Fields...>();
+    if constexpr (sql::details::HasVersionField<Scheme>) {
+        static_assert(((std::string_view{Fields} != std::string_view{Scheme::kVersionField}) && ...),
+            "the version field is incremented by the update itself!");
+        auto updated = db::utils::try_exec_affected(conn, kUpdateQuery, record.id,
+            db::utils::get_field_by_name<Fields>(record)..., details::version_of(record));
+        return details::check_version_or_error<Scheme>(std::move(updated));
+    } else {
+        return db::utils::try_exec_affected(conn, kUpdateQuery, record.id, db::utils::get_field_by_name<Fields>(record)...);
+    }
+}
+
+/// @brief Like `db::insert_record`, but returns failures as a `db::error`
+///        instead of throwing them.
+///
+/// A record whose ID exists already is skipped with
+/// `ON CONFLICT (id) DO NOTHING` and reported as `db::error_kind::unique_violation`,
+/// so that the routine case of a duplicate insert neither fails on the
+/// server nor throws. Its `sqlstate` is "23505" and the constraint is not
+/// named. Violations of other constraints, unique ones included, fail on
+/// the server and are returned with their own SQLSTATE and message.
+///
+/// @return The number of rows inserted, 1, or the error.
+///
+/// @example
+/// auto inserted = db::try_insert_record(conn, new_user);
+/// if (!inserted && inserted.error().kind == db::error_kind::unique_violation) {
+///   // the user exists already
+/// }
+template <sql::details::HasSchemeAndId Scheme>
+auto try_insert_record(pqxx::connection& conn, const Scheme& record) -> expected<std::size_t, error> {
+    constexpr auto kInsertQuery = details::construct_insert_or_skip_query<Scheme>();
+    auto inserted               = db::utils::try_exec_affected<Scheme>(conn, kInsertQuery, record);
+    if (inserted && *inserted == 0) {
+        return unexpected<error>{error{.kind = error_kind::unique_violation,
+            .sqlstate = "23505",
+            .message  = "duplicate record in " + std::string{Scheme::kName}}};
+    }
+    return inserted;
+}
+
+/// @brief Like `db::update_record`, but returns failures as a `db::error`
+///        instead of throwing them.
+///
+/// A stale version is reported as `db::error_kind::version_conflict` without
+/// throwing `db::version_conflict`.
+///
+/// @return The number of rows updated, or the error.
+template <sql::details::HasSchemeAndId Scheme>
+auto try_update_record(pqxx::connection& conn, const Scheme& record) -> expected<std::size_t, error> {
+    constexpr auto kUpdateAllQuery = sql::utils::create_update_all_query<Scheme>();
+    return details::check_version_or_error<Scheme>(db::utils::try_exec_affected<Scheme>(conn, kUpdateAllQuery, record));
+}
+
+/// @brief Like `db::delete_record_by_id`, but returns failures as a
+///        `db::error` instead of throwing them (see `db::utils::try_one_row_as`).
+template <sql::details::HasSchemeAndId Scheme, typename IdType = Scheme::id>
+auto try_delete_record_by_id(pqxx::connection& conn, IdType&& id) -> expected<std::size_t, error> {
+    constexpr auto kDeleteQuery = sql::utils::construct_delete_query_from_condition<Scheme, "id = $1">();
+    return db::utils::try_exec_affected(conn, kDeleteQuery, id);
+}
+
 }  // namespace db
@@ -0,0 +1,457 @@
+/*
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2024 Vladislav Nepogodin <vnepogodin@cachyos.org>
+ */
+#pragma once
+
+#include <db_wrap/db_utils.hpp>
+#include <db_wrap/details/pfr_utils.hpp>
+
+#include <array>        // for array
+#include <chrono>       // for sys_time, sys_days, year_month_day, microseconds
+#include <cstddef>      // for size_t
+#include <cstdint>      // for int8_t ... uint64_t
+#include <memory>       // for unique_ptr, make_unique
+#include <optional>     // for optional
+#include <string>       // for string
+#include <string_view>  // for string_view
+#include <tuple>        // for tuple, get
+#include <type_traits>  // for is_same_v, remove_cvref_t, conditional_t
+#include <utility>      // for move, forward, index_sequence
+#include <vector>       // for vector
+
+#include <pqxx/pqxx>
+
+// The Arrow C data interface, as specified by Apache Arrow; guarded so
+// that it can be included next to Arrow's own headers.
+#ifndef ARROW_C_DATA_INTERFACE
+#define ARROW_C_DATA_INTERFACE
+
+#define ARROW_FLAG_DICTIONARY_ORDERED 1
+#define ARROW_FLAG_NULLABLE 2
+#define ARROW_FLAG_MAP_KEYS_SORTED 4
+
+// NOLINTBEGIN
+struct ArrowSchema {
+    // Array type description
+    const char* format;
+    const char* name;
+    const char* metadata;
+    int64_t flags;
+    int64_t n_children;
+    struct ArrowSchema** children;
+    struct ArrowSchema* dictionary;
+
+    // Release callback
+    void (*release)(struct ArrowSchema*);
+    // Opaque producer-specific data
+    void* private_data;
+};
+
+struct ArrowArray {
+    // Array data description
+    int64_t length;
+    int64_t null_count;
+    int64_t offset;
+    int64_t n_buffers;
+    int64_t n_children;
+    const void** buffers;
+    struct ArrowArray** children;
+    struct ArrowArray* dictionary;
+
+    // Release callback
+    void (*release)(struct ArrowArray*);
+    // Opaque producer-specific data
+    void* private_data;
+};
+// NOLINTEND
+
+#endif  // ARROW_C_DATA_INTERFACE
+
+namespace db {
+
+/// @brief Query results in the Arrow C data interface: a struct array with
+///        one child array per field of the Scheme.
+///
+/// Consumers take ownership by moving `schema` and `array` out, which the
+/// Arrow importers do by clearing their `release` callbacks; whatever is
+/// still owned when the batch is destroyed is released then.
+struct arrow_batch {
+    ArrowSchema schema{};
+    ArrowArray array{};
+
+    arrow_batch() = default;
+
+    arrow_batch(arrow_batch&& other) noexcept : schema(other.schema), array(other.array) {
+        other.schema.release = nullptr;
+        other.array.release  = nullptr;
+    }
+
+    arrow_batch& operator=(arrow_batch&& other) noexcept {
+        if (this != &other) {
+            reset();
+            schema               = other.schema;
+            array                = other.array;
+            other.schema.release = nullptr;
+            other.array.release  = nullptr;
+        }
+        return *this;
+    }
+
+    arrow_batch(const arrow_batch&)            = delete;
+    arrow_batch& operator=(const arrow_batch&) = delete;
+
+    ~arrow_batch() { reset(); }
+
+    /// @brief The number of rows.
+    [[nodiscard]] auto size() const noexcept -> std::size_t { return static_cast<std::size_t>(array.length); }
+
+ private:
+    void reset() noexcept {
+        if (schema.release != nullptr) {
+            schema.release(&schema);
+        }
+        if (array.release != nullptr) {
+            array.release(&array);
+        }
+    }
+};
+
+namespace details {
+
+template <typename T>
+struct arrow_nullable : std::false_type {
+    using value_type = T;
+};
+
+template <typename T>
+struct arrow_nullable<std::optional<T>> : std::true_type {
+    using value_type = T;
+};
+
+/// @brief The Arrow format string of a field type.
+template <typename T>
+consteval auto arrow_format() noexcept -> std::string_view {
+    if constexpr (std::is_same_v<T, bool>) {
+        return "b";
+    } else if constexpr (std::is_same_v<T, std::int8_t>) {
+        return "c";
+    } else if constexpr (std::is_same_v<T, std::uint8_t>) {
+        return "C";
+    } else if constexpr (std::is_same_v<T, std::int16_t>) {
+        return "s";
+    } else if constexpr (std::is_same_v<T, std::uint16_t>) {
+        return "S";
+    } else if constexpr (std::is_same_v<T, std::int32_t>) {
+        return "i";
+    } else if constexpr (std::is_same_v<T, std::uint32_t>) {
+        return "I";
+    } else if constexpr (std::is_same_v<T, std::int64_t>) {
+        return "l";
+    } else if constexpr (std::is_same_v<T, std::uint64_t>) {
+        return "L";
+    } else if constexpr (std::is_same_v<T, float>) {
+        return "f";
+    } else if constexpr (std::is_same_v<T, double>) {
+        return "g";
+    } else if constexpr (std::is_same_v<T, std::string>) {
+        // large UTF-8, with 64-bit offsets
+        return "U";
+    } else if constexpr (std::is_same_v<T, std::chrono::year_month_day>) {
+        // date32, days since the epoch
+        return "tdD";
+    } else if constexpr (requires { std::chrono::time_point_cast<std::chrono::microseconds>(T{}); }
+                         && std::is_same_v<typename T::clock, std::chrono::system_clock>) {
+        // timestamp in microseconds, as PostgreSQL stores it
+        return "tsu:UTC";
+    } else {
+        static_assert(sizeof(T) == 0, "type cannot be exported to Arrow");
+        return "";
+    }
+}
+
+/// @brief Buffers of one Arrow column, filled from the text of the cells.
+///
+/// Fixed width values go straight into the value buffer and text into the
+/// data buffer, without a Scheme in between.
+template <typename T>
+class arrow_column {
+ public:
+    using value_type = typename arrow_nullable<T>::value_type;
+
+    static constexpr bool kNullable = arrow_nullable<T>::value;
+    static constexpr bool kText     = std::is_same_v<value_type, std::string>;
+    static constexpr bool kBool     = std::is_same_v<value_type, bool>;
+
+    explicit arrow_column(std::size_t rows) {
+        m_validity.reserve(bitmap_bytes(rows));
+        if constexpr (kText) {
+            m_offsets.reserve(rows + 1);
+            m_offsets.emplace_back(0);
+        } else if constexpr (kBool) {
+            m_bits.reserve(bitmap_bytes(rows));
+        } else {
+            m_values.reserve(rows);
+        }
+    }
+
+    /// @brief Appends a cell, `std::nullopt` for SQL NULL.
+    /// @throws pqxx::conversion_error on a NULL in a field that cannot hold one.
+    void append(std::optional<std::string_view> text, std::string_view name) {
+        const auto row = m_length++;
+        if (row % 8 == 0) {
+            m_validity.emplace_back(0);
+            if constexpr (kBool) {
+                m_bits.emplace_back(0);
+            }
+        }
+        if (!text) {
+            if constexpr (!kNullable) {
+                throw pqxx::conversion_error{"arrow export: NULL in column " + std::string{name}};
+            }
+            ++m_null_count;
+            push_default();
+            return;
+        }
+        m_validity.back() |= static_cast<std::uint8_t>(1U << (row % 8));
+
+        if constexpr (kText) {
+            m_data.append(*text);
+            m_offsets.emplace_back(static_cast<std::int64_t>(m_data.size()));
+        } else if constexpr (kBool) {
+            if (pqxx::from_string<bool>(*text)) {
+                m_bits.back() |= static_cast<std::uint8_t>(1U << (row % 8));
+            }
+        } else if constexpr (std::is_same_v<value_type, std::chrono::year_month_day>) {
+            const auto days = std::chrono::sys_days{pqxx::from_string<value_type>(*text)};
+            m_values.emplace_back(static_cast<std::int32_t>(days.time_since_epoch().count()));
+        } else if constexpr (requires { typename value_type::clock; }) {
+            const auto time = std::chrono::time_point_cast<std::chrono::microseconds>(pqxx::from_string<value_type>(*text));
+            m_values.emplace_back(time.time_since_epoch().count());
+        } else {
+            m_values.emplace_back(pqxx::from_string<value_type>(*text));
+        }
+    }
+
+    /// @brief Moves the buffers into `array`, which owns them then.
+    void finish(ArrowArray& array) && {
+        auto owned = std::make_unique<arrow_column>(std::move(*this));
+
+        owned->m_buffers[0] = owned->m_null_count == 0 ? nullptr : owned->m_validity.data();
+        if constexpr (kText) {
+            owned->m_buffers[1] = owned->m_offsets.data();
+            owned->m_buffers[2] = owned->m_data.data();
+        } else if constexpr (kBool) {
+            owned->m_buffers[1] = owned->m_bits.data();
+        } else {
+            owned->m_buffers[1] = owned->m_values.data();
+        }
+
+        array = ArrowArray{
+            .length       = static_cast<std::int64_t>(owned->m_length),
+            .null_count   = static_cast<std::int64_t>(owned->m_null_count),
+            .offset       = 0,
+            .n_buffers    = kText ? 3 : 2,
+            .n_children   = 0,
+            .buffers      = owned->m_buffers.data(),
+            .children     = nullptr,
+            .dictionary   = nullptr,
+            .release      = &arrow_column::release,
+            .private_data = owned.release(),
+        };
+    }
+
+ private:
+    using storage_t = std::conditional_t<std::is_same_v<value_type, std::chrono::year_month_day>, std::int32_t,
+        std::conditional_t<requires { typename value_type::clock; }, std::int64_t, value_type>>;
+
+    static constexpr auto bitmap_bytes(std::size_t rows) noexcept -> std::size_t { return (rows + 7) / 8; }
+
+    void push_default() {
+        if constexpr (kText) {
+            m_offsets.emplace_back(static_cast<std::int64_t>(m_data.size()));
+        } else if constexpr (!kBool) {
+            m_values.emplace_back();
+        }
+    }
+
+    static void release(ArrowArray* array) noexcept {
+        delete static_cast<arrow_column*>(array->private_data);
+        array->release = nullptr;
+    }
+
+    std::size_t m_length{};
+    std::size_t m_null_count{};
+    std::vector<std::uint8_t> m_validity{};
+    std::vector<std::uint8_t> m_bits{};
+    std::vector<storage_t> m_values{};
+    std::vector<std::int64_t> m_offsets{};
+    std::string m_data{};
+    std::array<const void*, 3> m_buffers{};
+};
+
+template <typename Scheme, std::size_t Idx>
+using arrow_field_t = std::remove_cvref_t<decltype(utils::details::flat_field_ref<Idx>(std::declval<Scheme&>()))>;
+
+/// @brief The children of the top-level struct array.
+struct arrow_struct_array {
+    explicit arrow_struct_array(std::size_t count) : children(count), child_ptrs(count) {
+        for (std::size_t i = 0; i < count; ++i) {
+            child_ptrs[i] = &children[i];
+        }
+    }
+
+    static void release(ArrowArray* array) noexcept {
+        for (auto* child : static_cast<arrow_struct_array*>(array->private_data)->child_ptrs) {
+            if (child->release != nullptr) {
+                child->release(child);
+            }
+        }
+        delete static_cast<arrow_struct_array*>(array->private_data);
+        array->release = nullptr;
+    }
+
+    std::vector<ArrowArray> children;
+    std::vector<ArrowArray*> child_ptrs;
+    // a struct array has a validity buffer only, absent without nulls
+    std::array<const void*, 1> buffers{};
+};
+
+/// @brief The children of the top-level struct schema.
+struct arrow_struct_schema {
+    explicit arrow_struct_schema(std::size_t count) : children(count), child_ptrs(count) {
+        for (std::size_t i = 0; i < count; ++i) {
+            child_ptrs[i] = &children[i];
+        }
+    }
+
+    static void release(ArrowSchema* schema) noexcept {
+        for (auto* child : static_cast<arrow_struct_schema*>(schema->private_data)->child_ptrs) {
+            if (child->release != nullptr) {
+                child->release(child);
+            }
+        }
+        delete static_cast<arrow_struct_schema*>(schema->private_data);
+        schema->release = nullptr;
+    }
+
+    // children own their name, so that they can be moved out on their own
+    static void release_child(ArrowSchema* schema) noexcept {
+        delete static_cast<std::string*>(schema->private_data);
+        schema->release = nullptr;
+    }
+
+    std::vector<ArrowSchema> children;
+    std::vector<ArrowSchema*> child_ptrs;
+};
+
+/// @brief The schema of `Scheme`: a struct with a child per flattened field.
+template <typename Scheme>
+auto make_arrow_schema() -> ArrowSchema {
+    constexpr auto kNames = utils::get_struct_names<Scheme>();
+    auto data             = std::make_unique<arrow_struct_schema>(kNames.size());
+    [&]<std::size_t... I>(std::index_sequence<I...>) {
+        ([&] {
+            using field_t   = arrow_field_t<Scheme, I>;
+            auto* name      = new std::string{kNames[I]};
+            data->children[I] = ArrowSchema{
+                .format       = details::arrow_format<typename arrow_nullable<field_t>::value_type>().data(),
+                .name         = name->c_str(),
+                .metadata     = nullptr,
+                .flags        = arrow_nullable<field_t>::value ? ARROW_FLAG_NULLABLE : 0,
+                .n_children   = 0,
+                .children     = nullptr,
+                .dictionary   = nullptr,
+                .release      = &arrow_struct_schema::release_child,
+                .private_data = name,
+            };
+        }(), ...);
+    }(std::make_index_sequence<kNames.size()>{});
+
+    return ArrowSchema{
+        .format       = "+s",
+        .name         = "",
+        .metadata     = nullptr,
+        .flags        = 0,
+        .n_children   = static_cast<std::int64_t>(kNames.size()),
+        .children     = data->child_ptrs.data(),
+        .dictionary   = nullptr,
+        .release      = &arrow_struct_schema::release,
+        .private_data = data.release(),
+    };
+}
+
+}  // namespace details
+
+namespace utils {
+
+/// @brief Converts a query result to Arrow columns, following the Arrow C
+///        data interface, without an Arrow library.
+///
+/// Every flattened field of `Scheme` becomes a child column of a struct
+/// array, read from the result column of the same name. The text of each
+/// cell is decoded straight into the buffer of its column, so no `Scheme`
+/// is ever built; `std::optional` fields become nullable columns with a
+/// validity bitmap. Integers, floating point numbers, `bool` and
+/// `std::string` are supported, and with `<db_wrap/chrono_type.hpp>`,
+/// `std::chrono::sys_time` as microsecond timestamps and
+/// `std::chrono::year_month_day` as dates.
+///
+/// @tparam Scheme The type describing the columns.
+/// @param result The result of the query.
+/// @return The schema and the array; hand both to an Arrow importer, e.g.
+///         `arrow::ImportRecordBatch(&batch.array, &batch.schema)`.
+/// @throws pqxx::conversion_error if a cell does not fit its field.
+///
+/// @example
+/// pqxx::result result = db::utils::exec_in_transaction(conn, "SELECT * FROM users");
+/// auto batch = db::utils::as_arrow<User>(result);
+/// auto record_batch = arrow::ImportRecordBatch(&batch.array, &batch.schema).ValueOrDie();
+template <typename Scheme>
+auto as_arrow(const pqxx::result& result) -> arrow_batch {
+    constexpr auto kNames = utils::get_struct_names<Scheme>();
+    const auto rows       = static_cast<std::size_t>(result.size());
+
+    arrow_batch batch{};
+    batch.schema = db::details::make_arrow_schema<Scheme>();
+
+    auto data = std::make_unique<db::details::arrow_struct_array>(kNames.size());
+    [&]<std::size_t... I>(std::index_sequence<I...>) {
+        const std::array<pqxx::row::size_type, kNames.size()> columns{
+            result.column_number(pqxx::zview{kNames[I]})...};
+        std::tuple<db::details::arrow_column<db::details::arrow_field_t<Scheme, I>>...> builders{
+            db::details::arrow_column<db::details::arrow_field_t<Scheme, I>>{(static_cast<void>(I), rows)}...};
+
+        for (auto&& row : result) {
+            (std::get<I>(builders).append(row[columns[I]].is_null() ? std::nullopt
+                    : std::optional<std::string_view>{row[columns[I]].view()}, kNames[I]), ...);
+        }
+        (std::move(std::get<I>(builders)).finish(data->children[I]), ...);
+    }(std::make_index_sequence<kNames.size()>{});
+
+    batch.array = ArrowArray{
+        .length       = static_cast<std::int64_t>(rows),
+        .null_count   = 0,
+        .offset       = 0,
+        .n_buffers    = 1,
+        .n_children   = static_cast<std::int64_t>(kNames.size()),
+        .buffers      = data->buffers.data(),
+        .children     = data->child_ptrs.data(),
+        .dictionary   = nullptr,
+        .release      = &db::details::arrow_struct_array::release,
+        .private_data = data.release(),
+    };
+    return batch;
+}
+
+/// @brief Executes a query and returns its rows as Arrow columns (see
+///        `utils::as_arrow(const pqxx::result&)`).
+template <typename Scheme, typename... Args>
+auto as_arrow(pqxx::connection& conn, std::string_view query, Args&&... args) -> arrow_batch {
+    return utils::as_arrow<Scheme>(utils::exec_in_transaction(conn, query, std::forward<Args>(args)...));
+}
+
+}  // namespace utils
+
+}  // namespace db
@@ -0,0 +1,349 @@
+/*
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2024 Vladislav Nepogodin <vnepogodin@cachyos.org>
+ */
+#pragma once
+
+#include <db_wrap/db_pool.hpp>
+#include <db_wrap/db_utils.hpp>
+#include <db_wrap/details/query_monitor.hpp>
+#include <db_wrap/details/statement_registry.hpp>
+#include <db_wrap/details/static_string.hpp>
+
+#include <chrono>         // for steady_clock, milliseconds
+#include <cstdint>        // for uint64_t
+#include <functional>     // for hash
+#include <future>         // for async, future
+#include <list>           // for list
+#include <memory>         // for shared_ptr, make_shared
+#include <mutex>          // for mutex, lock_guard
+#include <optional>       // for optional
+#include <string>         // for string
+#include <string_view>    // for string_view
+#include <type_traits>    // for is_trivially_copyable_v
+#include <typeindex>      // for type_index
+#include <unordered_map>  // for unordered_map
+#include <utility>        // for move
+#include <vector>         // for vector
+
+#include <boost/pfr/core.hpp>
+
+#include <pqxx/pqxx>
+
+namespace db {
+
+/// @brief How long a cached result may be served.
+struct cache_policy {
+    /// The result is served as is for `ttl` after it was fetched.
+    std::chrono::milliseconds ttl{};
+    /// For this long after `ttl`, the stale result is still served, while a
+    /// fresh one is fetched in the background.
+    std::chrono::milliseconds stale_while_revalidate{};
+};
+
+/// @brief Counters of a single query in a `db::query_cache`.
+struct query_cache_stats {
+    /// The query text.
+    std::string_view query;
+    /// Calls served with a fresh result.
+    std::uint64_t hits{};
+    /// Calls served with a stale result while it was revalidated.
+    std::uint64_t stale_hits{};
+    /// Calls that had to run the query.
+    std::uint64_t misses{};
+    /// Background refreshes completed.
+    std::uint64_t refreshes{};
+    /// Results dropped to stay within the size bound.
+    std::uint64_t evictions{};
+};
+
+namespace details {
+
+/// @brief Approximates the heap memory owned by a value.
+///
+/// Accounts for the capacity of strings and vectors and recurses into
+/// `std::optional` and aggregates, which covers the types used as schemes.
+template <typename T>
+auto heap_bytes(const T& value) -> std::size_t {
+    if constexpr (std::is_trivially_copyable_v<T>) {
+        return 0;
+    } else if constexpr (requires { value.capacity(); *value.data(); value.begin(); }) {
+        std::size_t bytes = value.capacity() * sizeof(*value.data());
+        for (auto&& elem : value) {
+            bytes += details::heap_bytes(elem);
+        }
+        return bytes;
+    } else if constexpr (requires { value.has_value(); *value; }) {
+        return value.has_value() ? details::heap_bytes(*value) : 0;
+    } else if constexpr (std::is_aggregate_v<T>) {
+        std::size_t bytes{};
+        boost::pfr::for_each_field(value, [&bytes](const auto& field) { bytes += details::heap_bytes(field); });
+        return bytes;
+    } else {
+        return 0;
+    }
+}
+
+}  // namespace details
+
+/// @brief Opt-in cache for decoded results of expensive read queries.
+///
+/// Results are keyed by the compile-time query and the values of its
+/// parameters, and stored as decoded `std::vector<T>`, shared with every
+/// caller. Entries expire after the TTL of their `db::cache_policy`; within
+/// the stale-while-revalidate window after that, the stale result keeps
+/// being served while a single background refresh fetches a new one. The
+/// total size of the cached results is bounded, evicting the least recently
+/// used entries first.
+///
+/// Meant for queries with a small parameter space such as leaderboards or
+/// configuration lists; there is no invalidation on writes other than
+/// `invalidate` and `clear`.
+///
+/// @example
+/// static constexpr db::details::static_string kTopPlayers =
+///     "SELECT * FROM players WHERE season = $1 ORDER BY score DESC LIMIT 100;";
+///
+/// db::query_cache cache{pool, 16 * 1024 * 1024};
+/// auto top = cache.as_set_of<Player, kTopPlayers>({.ttl = 5s, .stale_while_revalidate = 30s}, season);
+class query_cache {
+ public:
+    using clock = std::chrono::steady_clock;
+
+    /// @brief Creates an empty cache.
+    /// @param pool The pool queries are run on, both on misses and in the background.
+    /// @param max_bytes Upper bound of the approximate memory used by cached results.
+    query_cache(connection_pool& pool, std::size_t max_bytes)
+      : m_pool(pool), m_max_bytes(max_bytes) {}
+
+    query_cache(const query_cache&)            = delete;
+    query_cache& operator=(const query_cache&) = delete;
+
+    /// @brief Waits for running background refreshes.
+    ~query_cache() {
+        for (auto&& refresh : take_refreshes()) {
+            refresh.wait();
+        }
+    }
+
+    /// @brief Cached variant of `db::utils::as_set_of`.
+    ///
+    /// @tparam T The type to convert each row to.
+    /// @tparam Query The SQL query to execute.
+    /// @tparam Args The types of the query parameters.
+    /// @param policy How long the result may be served from the cache.
+    /// @param args The parameters for the SQL query.
+    /// @return The rows of the result, empty if there are none.
+    template <typename T, ::db::details::static_string Query, typename... Args>
+    auto as_set_of(const cache_policy& policy, Args&&... args) -> std::shared_ptr<const std::vector<T>> {
+        static constexpr auto kQueryId = details::query_hash(Query);
+
+        cache_key key{.query_id = kQueryId, .type = typeid(T), .params = {}};
+        key.params.reserve(sizeof...(Args));
+        // parameters are kept in their text form, which is what is sent to the
+        // server anyway, so background refreshes can run without the caller
+        (key.params.emplace_back(details::param_text(args)), ...);
+
+        {
+            std::lock_guard lock{m_mutex};
+            auto& stats = stats_of(kQueryId, Query);
+            if (auto it = m_entries.find(key); it != m_entries.end()) {
+                auto& entry    = it->second;
+                const auto age = clock::now() - entry.fetched_at;
+                if (age < policy.ttl) {
+                    ++stats.hits;
+                    touch(entry);
+                    return std::static_pointer_cast<const std::vector<T>>(entry.value);
+                }
+                if (age < policy.ttl + policy.stale_while_revalidate) {
+                    ++stats.stale_hits;
+                    touch(entry);
+                    if (!entry.refreshing) {
+                        entry.refreshing = true;
+                        schedule_refresh<T, Query>(key);
+                    }
+                    return std::static_pointer_cast<const std::vector<T>>(entry.value);
+                }
+            }
+            ++stats.misses;
+        }
+
+        auto value = fetch<T, Query>(key.params);
+        std::lock_guard lock{m_mutex};
+        store(std::move(key), value);
+        return value;
+    }
+
+    /// @brief Drops every cached result of a query.
+    template <::db::details::static_string Query>
+    void invalidate() {
+        static constexpr auto kQueryId = details::query_hash(Query);
+
+        std::lock_guard lock{m_mutex};
+        std::erase_if(m_lru, [this](const cache_key* key) {
+            if (key->query_id != kQueryId) {
+                return false;
+            }
+            const auto it = m_entries.find(*key);
+            m_bytes -= it->second.bytes;
+            m_entries.erase(it);
+            return true;
+        });
+    }
+
+    /// @brief Drops every cached result.
+    void clear() {
+        std::lock_guard lock{m_mutex};
+        m_lru.clear();
+        m_entries.clear();
+        m_bytes = 0;
+    }
+
+    /// @brief The counters of every query used with the cache so far.
+    [[nodiscard]] auto stats() const -> std::vector<query_cache_stats> {
+        std::lock_guard lock{m_mutex};
+        std::vector<query_cache_stats> result{};
+        result.reserve(m_stats.size());
+        for (auto&& [query_id, stats] : m_stats) {
+            result.emplace_back(stats);
+        }
+        return result;
+    }
+
+    /// @brief The approximate memory used by the cached results.
+    [[nodiscard]] auto size_bytes() const -> std::size_t {
+        std::lock_guard lock{m_mutex};
+        return m_bytes;
+    }
+
+    /// @brief The upper bound of `size_bytes`.
+    [[nodiscard]] auto max_bytes() const noexcept -> std::size_t { return m_max_bytes; }
+
+ private:
+    using param_list = std::vector<std::optional<std::string>>;
+
+    struct cache_key {
+        std::uint64_t query_id;
+        std::type_index type;
+        param_list params;
+
+        bool operator==(const cache_key&) const = default;
+    };
+
+    struct cache_key_hash {
+        auto operator()(const cache_key& key) const noexcept -> std::size_t {
+            auto hash = static_cast<std::size_t>(key.query_id) ^ key.type.hash_code();
+            for (auto&& param : key.params) {
+                hash = (hash * 31U) ^ (param ? std::hash<std::string>{}(*param) : 0U);
+            }
+            return hash;
+        }
+    };
+
+    struct cache_entry {
+        std::shared_ptr<const void> value;
+        std::size_t bytes{};
+        clock::time_point fetched_at{};
+        bool refreshing{};
+        std::list<const cache_key*>::iterator lru_pos{};
+    };
+
+    template <typename T, ::db::details::static_string Query>
+    auto fetch(const param_list& params) -> std::shared_ptr<const std::vector<T>> {
+        pqxx::params query_params{};
+        query_params.reserve(params.size());
+        for (auto&& param : params) {
+            query_params.append(param);
+        }
+
+        auto conn = m_pool.acquire();
+        return std::make_shared<const std::vector<T>>(
+            db::utils::as_set_of<T>(*conn, Query, query_params).value_or(std::vector<T>{}));
+    }
+
+    template <typename T, ::db::details::static_string Query>
+    void schedule_refresh(const cache_key& key) {
+        std::erase_if(m_refreshes, [](const std::future<void>& refresh) {
+            return refresh.wait_for(std::chrono::seconds{0}) == std::future_status::ready;
+        });
+        m_refreshes.emplace_back(std::async(std::launch::async, [this, key = cache_key{key}]() mutable {
+            try {
+                auto value = fetch<T, Query>(key.params);
+                std::lock_guard lock{m_mutex};
+                ++m_stats.at(key.query_id).refreshes;
+                store(std::move(key), std::move(value));
+            } catch (const std::exception&) {
+                // keep serving the stale result, the next stale hit retries
+                std::lock_guard lock{m_mutex};
+                if (auto it = m_entries.find(key); it != m_entries.end()) {
+                    it->second.refreshing = false;
+                }
+            }
+        }));
+    }
+
+    template <typename T>
+    void store(cache_key&& key, std::shared_ptr<const std::vector<T>> value) {
+        std::size_t bytes = sizeof(std::vector<T>) + (value->capacity() * sizeof(T)) + details::heap_bytes(*value);
+        for (auto&& param : key.params) {
+            bytes += param ? param->capacity() : 0;
+        }
+
+        if (auto it = m_entries.find(key); it != m_entries.end()) {
+            m_bytes -= it->second.bytes;
+            m_lru.erase(it->second.lru_pos);
+            m_entries.erase(it);
+        }
+        if (bytes > m_max_bytes) {
+            return;
+        }
+        while (m_bytes + bytes > m_max_bytes) {
+            evict_oldest();
+        }
+
+        auto [it, inserted] = m_entries.emplace(std::move(key),
+            cache_entry{.value = std::move(value), .bytes = bytes, .fetched_at = clock::now(), .refreshing = false, .lru_pos = {}});
+        m_lru.emplace_front(&it->first);
+        it->second.lru_pos = m_lru.begin();
+        m_bytes += bytes;
+    }
+
+    void evict_oldest() {
+        const auto it = m_entries.find(*m_lru.back());
+        ++m_stats.at(it->first.query_id).evictions;
+        m_bytes -= it->second.bytes;
+        m_entries.erase(it);
+        m_lru.pop_back();
+    }
+
+    void touch(cache_entry& entry) {
+        m_lru.splice(m_lru.begin(), m_lru, entry.lru_pos);
+    }
+
+    auto stats_of(std::uint64_t query_id, std::string_view query) -> query_cache_stats& {
+        auto [it, inserted] = m_stats.try_emplace(query_id);
+        if (inserted) {
+            it->second.query = query;
+        }
+        return it->second;
+    }
+
+    auto take_refreshes() -> std::vector<std::future<void>> {
+        std::lock_guard lock{m_mutex};
+        return std::move(m_refreshes);
+    }
+
+    connection_pool& m_pool;
+    std::size_t m_max_bytes;
+
+    mutable std::mutex m_mutex{};
+    std::size_t m_bytes{};
+    std::unordered_map<cache_key, cache_entry, cache_key_hash> m_entries{};
+    /// Most recently used first.
+    std::list<const cache_key*> m_lru{};
+    std::unordered_map<std::uint64_t, query_cache_stats> m_stats{};
+    std::vector<std::future<void>> m_refreshes{};
+};
+
+}  // namespace db
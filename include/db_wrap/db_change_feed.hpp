@@ -0,0 +1,247 @@
+/*
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2024 Vladislav Nepogodin <vnepogodin@cachyos.org>
+ */
+#pragma once
+
+#include <db_wrap/db_utils.hpp>
+#include <db_wrap/details/pfr_utils.hpp>
+#include <db_wrap/details/test_decoding.hpp>
+
+#include <algorithm>      // for ranges::find_if
+#include <array>          // for array
+#include <cstddef>        // for size_t
+#include <cstdint>        // for int32_t
+#include <functional>     // for function
+#include <optional>       // for optional
+#include <span>           // for span
+#include <string>         // for string
+#include <string_view>    // for string_view
+#include <type_traits>    // for decay_t
+#include <unordered_map>  // for unordered_map
+#include <utility>        // for move
+#include <vector>         // for vector
+
+#include <pqxx/pqxx>
+
+namespace db {
+
+/// @brief A row change of the table of `Scheme`, decoded from the WAL.
+template <typename Scheme>
+struct change {
+    change_kind kind{};
+    /// The WAL position of the change, as text, e.g. `0/16B3748`.
+    std::string lsn;
+    /// The new row of an insert or update, or the key of a deleted row; all
+    /// of the deleted row with `REPLICA IDENTITY FULL`. Fields missing from
+    /// the change are value initialized and marked in `unchanged`.
+    /// Value initialized for a truncate.
+    Scheme record{};
+    /// Which flattened fields of `record`, in field order, the change did
+    /// not carry. An update leaves out the TOASTed values it did not
+    /// change, e.g. large text, so the previous value of such a field is
+    /// still current.
+    std::array<bool, utils::get_fields_count<Scheme>()> unchanged{};
+    /// The old row of an update, if the server logged it: with
+    /// `REPLICA IDENTITY FULL`, or the old key when the key changed.
+    std::optional<Scheme> old_record;
+};
+
+namespace details {
+
+/// @brief Fills the fields of a `Scheme` from the columns printed by
+///        `test_decoding`, matched by name.
+/// @param unchanged If not empty, set for each flattened field, in field
+///                  order, without a value in `columns`.
+/// @throws pqxx::conversion_error if a NULL is printed for a field that
+///         cannot hold one.
+template <typename Scheme>
+auto decode_tuple(const std::vector<decoded_column>& columns, std::span<bool> unchanged = {}) -> Scheme {
+    Scheme record{};
+    utils::for_each_flat_field(record, [&, index = std::size_t{}](std::string_view field_name, auto& field) mutable {
+        using field_t = std::decay_t<decltype(field)>;
+
+        const auto field_idx = index++;
+        const auto column = std::ranges::find_if(columns, [field_name](auto&& col) { return col.name == field_name; });
+        if (column == columns.end() || column->unchanged_toast) {
+            if (!unchanged.empty()) {
+                unchanged[field_idx] = true;
+            }
+            return;
+        }
+        if (column->value) {
+            field = pqxx::from_string<field_t>(*column->value);
+        } else if constexpr (pqxx::nullness<field_t>::has_null) {
+            field = pqxx::nullness<field_t>::null();
+        } else {
+            throw pqxx::conversion_error{"change feed: NULL in column " + std::string{field_name}};
+        }
+    });
+    return record;
+}
+
+}  // namespace details
+
+/// @brief Consumes the changes of a logical replication slot and hands them
+///        to callbacks as decoded Schemes.
+///
+/// The feed reads the slot through the SQL interface of logical decoding
+/// with the `test_decoding` output plugin, which ships with PostgreSQL, so
+/// it works over a regular connection and needs no replication connection.
+/// The server must run with `wal_level = logical`, and the slot is created
+/// with `create_slot`.
+///
+/// Every `poll` peeks the pending changes, calls the callback registered for
+/// the table of each change in commit order, and then acknowledges every
+/// transaction whose changes were all handled, so that the server can
+/// recycle its WAL. If a callback throws, the transactions before the
+/// failing one are acknowledged and the exception is rethrown; the failing
+/// transaction is delivered again on the next poll. Delivery is at least
+/// once, so callbacks should be idempotent, e.g. upserts keyed by ID.
+///
+/// A slot keeps WAL on the server until it is consumed: poll regularly, and
+/// drop slots that are no longer read.
+///
+/// @example
+/// db::change_feed::create_slot(conn, "search_index");
+/// db::change_feed feed{conn, "search_index"};
+/// feed.on<User>([&](const db::change<User>& change) {
+///   if (change.kind == db::change_kind::remove) {
+///     index.erase(change.record.id);
+///   } else {
+///     index.upsert(change.record);
+///   }
+/// });
+/// while (running) {
+///   if (feed.poll() == 0) {
+///     std::this_thread::sleep_for(std::chrono::seconds{1});
+///   }
+/// }
+class change_feed {
+ public:
+    /// @brief A feed of slot `slot` read through `conn`, which must outlive it.
+    change_feed(pqxx::connection& conn, std::string slot) noexcept : m_conn(&conn), m_slot(std::move(slot)) { }
+
+    /// @brief Creates the logical replication slot `slot` with the
+    ///        `test_decoding` plugin, unless it exists already.
+    ///
+    /// The slot only receives the changes committed after it was created.
+    /// A temporary slot can only be read through `conn`, and is dropped
+    /// when `conn` is closed, even if the process dies; a persistent slot
+    /// keeps WAL on the server until it is dropped.
+    ///
+    /// @param temporary Whether the slot is dropped with the session.
+    /// @return Whether the slot was created.
+    static auto create_slot(pqxx::connection& conn, std::string_view slot, bool temporary = false) -> bool {
+        constexpr std::string_view kCreateQuery
+            = "SELECT pg_create_logical_replication_slot($1, 'test_decoding', $2) "
+              "WHERE NOT EXISTS (SELECT 1 FROM pg_replication_slots WHERE slot_name = $1);";
+        return !utils::exec_statement(conn, kCreateQuery, slot, temporary).empty();
+    }
+
+    /// @brief Drops the replication slot `slot`, if it exists, releasing the
+    ///        WAL kept for it.
+    /// @return Whether the slot was dropped.
+    static auto drop_slot(pqxx::connection& conn, std::string_view slot) -> bool {
+        constexpr std::string_view kDropQuery
+            = "SELECT pg_drop_replication_slot(slot_name) FROM pg_replication_slots WHERE slot_name = $1;";
+        return !utils::exec_statement(conn, kDropQuery, slot).empty();
+    }
+
+    /// @brief Registers `callback` for the changes of the table of `Scheme`,
+    ///        replacing the previous callback of that table.
+    ///
+    /// `Scheme::kName` is matched against the schema qualified table name;
+    /// a name without a schema matches the table in `public`. The changes
+    /// of tables without a callback are acknowledged and skipped.
+    template <sql::details::HasName Scheme, typename F>
+    void on(F&& callback) {
+        m_handlers.insert_or_assign(std::string{Scheme::kName},
+            [callback = std::forward<F>(callback)](const details::decoded_change& decoded, std::string_view lsn) {
+                change<Scheme> item{};
+                item.kind = decoded.kind;
+                item.lsn  = lsn;
+                if (decoded.kind != change_kind::truncate) {
+                    item.record = details::decode_tuple<Scheme>(decoded.new_tuple, item.unchanged);
+                }
+                if (!decoded.old_tuple.empty()) {
+                    item.old_record = details::decode_tuple<Scheme>(decoded.old_tuple);
+                }
+                callback(item);
+            });
+    }
+
+    /// @brief Delivers the pending changes, in commit order.
+    ///
+    /// @param max_changes Stop reading after the transaction in which this
+    ///                    many changes were read. Whole transactions are
+    ///                    always read, so more changes may be delivered.
+    /// @return The number of changes handed to callbacks.
+    /// @throws Whatever a callback throws, after acknowledging the
+    ///         transactions handled before.
+    auto poll(std::size_t max_changes = 1000) -> std::size_t {
+        constexpr std::string_view kPeekQuery
+            = "SELECT lsn::text, data FROM pg_logical_slot_peek_changes($1, NULL, $2, "
+              "'include-xids', '0', 'skip-empty-xacts', '1');";
+
+        const auto rows
+            = utils::exec_statement(*m_conn, kPeekQuery, m_slot, static_cast<std::int32_t>(max_changes));
+
+        std::size_t delivered{};
+        std::string acknowledged{};
+        details::decoded_change decoded{};
+        try {
+            for (auto&& row : rows) {
+                const auto lsn  = row[0].view();
+                const auto kind = details::test_decoding_parser::parse(row[1].view(), decoded);
+                if (kind == details::decoded_line::commit) {
+                    acknowledged = lsn;
+                    continue;
+                }
+                if (kind != details::decoded_line::change) {
+                    continue;
+                }
+                if (const auto* handler = find_handler(decoded.table)) {
+                    (*handler)(decoded, lsn);
+                    ++delivered;
+                }
+            }
+        } catch (...) {
+            acknowledge(acknowledged);
+            throw;
+        }
+        acknowledge(acknowledged);
+        return delivered;
+    }
+
+    /// @brief The name of the replication slot.
+    [[nodiscard]] auto slot() const noexcept -> const std::string& { return m_slot; }
+
+ private:
+    using handler_t = std::function<void(const details::decoded_change&, std::string_view)>;
+
+    auto find_handler(const std::string& table) const -> const handler_t* {
+        using namespace std::string_view_literals;
+
+        auto handler = m_handlers.find(table);
+        if (handler == m_handlers.end() && std::string_view{table}.starts_with("public."sv)) {
+            handler = m_handlers.find(table.substr("public."sv.size()));
+        }
+        return handler == m_handlers.end() ? nullptr : &handler->second;
+    }
+
+    /// Moves the slot past `lsn`, the end of the last handled transaction.
+    void acknowledge(const std::string& lsn) {
+        constexpr std::string_view kAdvanceQuery = "SELECT pg_replication_slot_advance($1, $2::pg_lsn);";
+        if (!lsn.empty()) {
+            utils::exec_statement(*m_conn, kAdvanceQuery, m_slot, lsn);
+        }
+    }
+
+    pqxx::connection* m_conn;
+    std::string m_slot;
+    std::unordered_map<std::string, handler_t> m_handlers;
+};
+
+}  // namespace db
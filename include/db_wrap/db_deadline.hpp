@@ -0,0 +1,127 @@
+/*
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2024 Vladislav Nepogodin <vnepogodin@cachyos.org>
+ */
+#pragma once
+
+#include <algorithm>    // for min, max
+#include <chrono>       // for steady_clock, milliseconds
+#include <optional>     // for optional
+#include <string>       // for string, to_string
+#include <string_view>  // for string_view
+
+#include <pqxx/pqxx>
+
+namespace db {
+
+/// @brief The clock deadlines are measured with.
+using deadline_clock = std::chrono::steady_clock;
+
+/// @brief Thrown when a query or a connection acquire did not finish before
+///        the deadline of the calling thread (see `db::deadline_scope`).
+///
+/// The transaction of the query was rolled back, so the connection it ran
+/// on is in a clean state and can be used again.
+class deadline_exceeded : public pqxx::failure {
+ public:
+    explicit deadline_exceeded(std::string_view query)
+      : pqxx::failure(query.empty() ? std::string{"deadline exceeded while waiting for a connection"}
+                                    : "deadline exceeded: " + std::string{query}),
+        m_query(query) { }
+
+    /// @brief The query that was cancelled, empty for a connection acquire.
+    [[nodiscard]] auto query() const noexcept -> const std::string& { return m_query; }
+
+ private:
+    std::string m_query;
+};
+
+namespace details {
+
+/// SQLSTATE of a statement cancelled by `statement_timeout` or a cancel request.
+inline constexpr std::string_view kQueryCanceled = "57014";
+
+/// The deadline of the calling thread, `time_point::max()` if there is none.
+inline thread_local deadline_clock::time_point t_deadline{deadline_clock::time_point::max()};
+
+/// @brief The deadline of the calling thread, if one is set.
+inline auto current_deadline() noexcept -> std::optional<deadline_clock::time_point> {
+    if (t_deadline == deadline_clock::time_point::max()) [[likely]] {
+        return std::nullopt;
+    }
+    return t_deadline;
+}
+
+/// @brief Limits the statements of `txn` to the time left until `deadline`.
+///
+/// `SET LOCAL` only lasts until the end of the transaction, so the
+/// connection goes back to its default timeout whether the transaction
+/// commits, fails or is rolled back.
+///
+/// @throws db::deadline_exceeded if the deadline already passed.
+inline void limit_statement(pqxx::transaction_base& txn, deadline_clock::time_point deadline, std::string_view query) {
+    const auto left = std::chrono::ceil<std::chrono::milliseconds>(deadline - deadline_clock::now());
+    if (left.count() <= 0) {
+        throw deadline_exceeded{query};
+    }
+    txn.exec("SET LOCAL statement_timeout = " + std::to_string(left.count()));
+}
+
+/// @brief Is `ex` the error of a statement cancelled by its timeout?
+inline auto is_query_canceled(const pqxx::sql_error& ex) noexcept -> bool {
+    return ex.sqlstate() == kQueryCanceled;
+}
+
+}  // namespace details
+
+/// @brief Sets a deadline for every query and connection acquire of the
+///        calling thread while it is alive.
+///
+/// Every query run through `db::utils`, and so every function of
+/// `db_api.hpp`, is given a server-side `statement_timeout` of the time
+/// left, and `connection_pool::acquire` gives up waiting once the deadline
+/// passes. Either way `db::deadline_exceeded` is thrown. A query that hits
+/// the deadline is cancelled by the server and its transaction rolled back,
+/// so the connection is returned to the pool in a clean state instead of
+/// being held by a stuck query.
+///
+/// Scopes nest: an inner scope can only shorten the deadline of the outer
+/// one, which is restored when the inner scope ends.
+///
+/// @example
+/// db::deadline_scope deadline{std::chrono::milliseconds{250}};
+/// auto conn = pool.acquire();
+/// auto user = db::find_by_id<User>(*conn, 1);  // throws db::deadline_exceeded after 250ms
+class deadline_scope {
+ public:
+    /// @brief Sets the deadline to `deadline`, unless an outer scope ends earlier.
+    explicit deadline_scope(deadline_clock::time_point deadline) noexcept
+      : m_previous(details::t_deadline), m_deadline(std::min(m_previous, deadline)) {
+        details::t_deadline = m_deadline;
+    }
+
+    /// @brief Sets the deadline to `timeout` from now, unless an outer scope ends earlier.
+    template <typename Rep, typename Period>
+    explicit deadline_scope(const std::chrono::duration<Rep, Period>& timeout) noexcept
+      : deadline_scope(deadline_clock::now() + std::chrono::ceil<deadline_clock::duration>(timeout)) { }
+
+    deadline_scope(const deadline_scope&)            = delete;
+    deadline_scope& operator=(const deadline_scope&) = delete;
+
+    ~deadline_scope() { details::t_deadline = m_previous; }
+
+    /// @brief The deadline set by this scope.
+    [[nodiscard]] auto deadline() const noexcept -> deadline_clock::time_point { return m_deadline; }
+
+    /// @brief The time left until the deadline, zero once it passed.
+    [[nodiscard]] auto remaining() const noexcept -> deadline_clock::duration {
+        return std::max(m_deadline - deadline_clock::now(), deadline_clock::duration::zero());
+    }
+
+ private:
+    deadline_clock::time_point m_previous;
+    deadline_clock::time_point m_deadline;
+};
+
+}  // namespace db
@@ -0,0 +1,178 @@
+/*
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2024 Vladislav Nepogodin <vnepogodin@cachyos.org>
+ */
+#pragma once
+
+#include <db_wrap/db_deadline.hpp>
+
+#include <cstdint>      // for uint8_t
+#include <exception>    // for exception
+#include <string>       // for string
+#include <string_view>  // for string_view
+#include <type_traits>  // for invoke_result_t
+#include <utility>      // for move, forward, in_place_index
+#include <version>      // for __cpp_lib_expected
+
+#if defined(__cpp_lib_expected) && __cpp_lib_expected >= 202202L
+#include <expected>  // for expected, unexpected
+#else
+#include <variant>  // for variant, get, get_if
+#endif
+
+#include <pqxx/pqxx>
+
+namespace db {
+
+/// @brief What kind of failure a `db::error` is, classified by its SQLSTATE.
+enum class error_kind : std::uint8_t {
+    /// SQLSTATE 23505, or a row skipped by `db::try_insert_record`.
+    unique_violation,
+    /// SQLSTATE 23503.
+    foreign_key_violation,
+    /// SQLSTATE 23502.
+    not_null_violation,
+    /// SQLSTATE 23514.
+    check_violation,
+    /// SQLSTATE 40001.
+    serialization_failure,
+    /// SQLSTATE 40P01.
+    deadlock,
+    /// SQLSTATE 57014, outside of a `db::deadline_scope`.
+    query_canceled,
+    /// The deadline of the calling thread passed (see `db::deadline_exceeded`).
+    deadline_exceeded,
+    /// The connection was lost, or SQLSTATE class 08.
+    connection,
+    /// A value of the result could not be converted to its field.
+    conversion,
+    /// An update of a versioned record matched no row (see `db::version_conflict`).
+    version_conflict,
+    /// Anything else.
+    other,
+};
+
+/// @brief A failure returned by the `try_` functions instead of thrown.
+struct error {
+    error_kind kind{error_kind::other};
+    /// The SQLSTATE reported by the server, empty if the error did not come from it.
+    std::string sqlstate{};
+    std::string message{};
+};
+
+#if defined(__cpp_lib_expected) && __cpp_lib_expected >= 202202L
+template <typename T, typename E>
+using expected = std::expected<T, E>;
+
+template <typename E>
+using unexpected = std::unexpected<E>;
+#else
+/// @brief Stand-in for `std::unexpected` before C++23.
+template <typename E>
+class unexpected {
+ public:
+    constexpr explicit unexpected(E error) : m_error(std::move(error)) { }
+
+    [[nodiscard]] constexpr auto error() const& noexcept -> const E& { return m_error; }
+    [[nodiscard]] constexpr auto error() && noexcept -> E&& { return std::move(m_error); }
+
+ private:
+    E m_error;
+};
+
+/// @brief Stand-in for `std::expected` before C++23, with the part of its
+///        interface used by the `try_` functions.
+template <typename T, typename E>
+class expected {
+ public:
+    using value_type = T;
+    using error_type = E;
+
+    constexpr expected(T value) : m_storage(std::in_place_index<0>, std::move(value)) { }
+    template <typename G>
+    constexpr expected(unexpected<G> error) : m_storage(std::in_place_index<1>, std::move(error).error()) { }
+
+    [[nodiscard]] constexpr auto has_value() const noexcept -> bool { return m_storage.index() == 0; }
+    constexpr explicit operator bool() const noexcept { return has_value(); }
+
+    [[nodiscard]] constexpr auto operator*() & noexcept -> T& { return *std::get_if<0>(&m_storage); }
+    [[nodiscard]] constexpr auto operator*() const& noexcept -> const T& { return *std::get_if<0>(&m_storage); }
+    [[nodiscard]] constexpr auto operator*() && noexcept -> T&& { return std::move(*std::get_if<0>(&m_storage)); }
+    [[nodiscard]] constexpr auto operator->() noexcept -> T* { return std::get_if<0>(&m_storage); }
+    [[nodiscard]] constexpr auto operator->() const noexcept -> const T* { return std::get_if<0>(&m_storage); }
+
+    /// @throws std::bad_variant_access if there is no value.
+    [[nodiscard]] constexpr auto value() & -> T& { return std::get<0>(m_storage); }
+    [[nodiscard]] constexpr auto value() const& -> const T& { return std::get<0>(m_storage); }
+    [[nodiscard]] constexpr auto value() && -> T&& { return std::get<0>(std::move(m_storage)); }
+
+    template <typename U>
+    [[nodiscard]] constexpr auto value_or(U&& fallback) const& -> T {
+        return has_value() ? **this : static_cast<T>(std::forward<U>(fallback));
+    }
+
+    [[nodiscard]] constexpr auto error() const& noexcept -> const E& { return *std::get_if<1>(&m_storage); }
+    [[nodiscard]] constexpr auto error() && noexcept -> E&& { return std::move(*std::get_if<1>(&m_storage)); }
+
+ private:
+    std::variant<T, E> m_storage;
+};
+#endif
+
+namespace details {
+
+/// @brief Classifies a SQLSTATE.
+constexpr auto classify_sqlstate(std::string_view sqlstate) noexcept -> error_kind {
+    if (sqlstate == "23505") {
+        return error_kind::unique_violation;
+    }
+    if (sqlstate == "23503") {
+        return error_kind::foreign_key_violation;
+    }
+    if (sqlstate == "23502") {
+        return error_kind::not_null_violation;
+    }
+    if (sqlstate == "23514") {
+        return error_kind::check_violation;
+    }
+    if (sqlstate == "40001") {
+        return error_kind::serialization_failure;
+    }
+    if (sqlstate == "40P01") {
+        return error_kind::deadlock;
+    }
+    if (sqlstate == kQueryCanceled) {
+        return error_kind::query_canceled;
+    }
+    if (sqlstate.starts_with("08")) {
+        return error_kind::connection;
+    }
+    return error_kind::other;
+}
+
+/// @brief Runs `func`, returning what it throws as a `db::error`.
+///
+/// The exception is caught at the boundary of the `try_` function, so that
+/// it never reaches its caller.
+template <typename Func>
+auto capture_error(Func&& func) -> expected<std::invoke_result_t<Func>, error> {
+    try {
+        return std::forward<Func>(func)();
+    } catch (const deadline_exceeded& ex) {
+        return unexpected<error>{error{.kind = error_kind::deadline_exceeded, .message = ex.what()}};
+    } catch (const pqxx::sql_error& ex) {
+        return unexpected<error>{
+            error{.kind = details::classify_sqlstate(ex.sqlstate()), .sqlstate = ex.sqlstate(), .message = ex.what()}};
+    } catch (const pqxx::broken_connection& ex) {
+        return unexpected<error>{error{.kind = error_kind::connection, .message = ex.what()}};
+    } catch (const pqxx::conversion_error& ex) {
+        return unexpected<error>{error{.kind = error_kind::conversion, .message = ex.what()}};
+    } catch (const std::exception& ex) {
+        return unexpected<error>{error{.kind = error_kind::other, .message = ex.what()}};
+    }
+}
+
+}  // namespace details
+
+}  // namespace db
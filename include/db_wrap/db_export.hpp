@@ -0,0 +1,318 @@
+/*
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2024 Vladislav Nepogodin <vnepogodin@cachyos.org>
+ */
+#pragma once
+
+#include <db_wrap/db_deadline.hpp>
+#include <db_wrap/details/pfr_utils.hpp>
+#include <db_wrap/details/static_string.hpp>
+#include <db_wrap/sql_utils.hpp>
+
+#include <algorithm>    // for copy
+#include <array>        // for array
+#include <cstddef>      // for size_t
+#include <cstdint>      // for uint8_t
+#include <optional>     // for optional
+#include <string>       // for string
+#include <string_view>  // for string_view
+#include <tuple>        // for tuple, tuple_element_t, get
+#include <type_traits>  // for is_same_v, is_integral_v, is_floating_point_v
+#include <utility>      // for index_sequence, forward
+
+#include <pqxx/pqxx>
+
+namespace db {
+
+class json;
+
+/// @brief The text format written by `db::export_rows`.
+enum class export_format : std::uint8_t {
+    /// One JSON object per line, keyed by field name.
+    ndjson,
+    /// RFC 4180 CSV with a header line; NULL is an empty field and the
+    /// empty string is `""`.
+    csv,
+};
+
+namespace details {
+
+/// How the text of a column is written as a JSON value.
+enum class json_kind : std::uint8_t {
+    string,
+    number,
+    boolean,
+    /// The column holds JSON already.
+    raw,
+};
+
+template <typename T>
+struct export_value {
+    using type = T;
+};
+
+template <typename T>
+struct export_value<std::optional<T>> {
+    using type = T;
+};
+
+template <typename T>
+consteval auto json_kind_of() noexcept -> json_kind {
+    using value_t = typename export_value<T>::type;
+    if constexpr (std::is_same_v<value_t, bool>) {
+        return json_kind::boolean;
+    } else if constexpr (std::is_integral_v<value_t> || std::is_floating_point_v<value_t>) {
+        return json_kind::number;
+    } else if constexpr (std::is_same_v<value_t, db::json>) {
+        return json_kind::raw;
+    } else {
+        return json_kind::string;
+    }
+}
+
+/// @brief Appends `text` as the body of a JSON string, escaped.
+constexpr void append_json_escaped(std::string& dest, std::string_view text) {
+    constexpr std::string_view kHex = "0123456789abcdef";
+    for (const char c : text) {
+        switch (c) {
+        case '"':
+            dest += "\\\"";
+            break;
+        case '\\':
+            dest += "\\\\";
+            break;
+        case '\n':
+            dest += "\\n";
+            break;
+        case '\r':
+            dest += "\\r";
+            break;
+        case '\t':
+            dest += "\\t";
+            break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+                dest += "\\u00";
+                dest += kHex[static_cast<unsigned char>(c) >> 4];
+                dest += kHex[static_cast<unsigned char>(c) & 0xf];
+            } else {
+                dest += c;
+            }
+        }
+    }
+}
+
+/// @brief Appends `text` as a CSV field, quoted if it has to be.
+constexpr void append_csv_field(std::string& dest, std::string_view text) {
+    if (!text.empty() && text.find_first_of(",\"\r\n") == std::string_view::npos) {
+        dest += text;
+        return;
+    }
+    dest += '"';
+    for (const char c : text) {
+        if (c == '"') {
+            dest += '"';
+        }
+        dest += c;
+    }
+    dest += '"';
+}
+
+/// @brief The JSON keys of the flattened fields of `Scheme`, each with
+///        its separator, e.g. `{"id":` and `,"name":`, escaped at compile time.
+template <typename Scheme>
+inline constexpr auto kJsonKeysText = [] {
+    constexpr auto kNames = utils::get_struct_names<Scheme>();
+    constexpr auto kSize  = [&] {
+        std::string keys{};
+        for (auto&& name : kNames) {
+            keys += ",\"";
+            details::append_json_escaped(keys, name);
+            keys += "\":";
+        }
+        return keys.size();
+    }();
+
+    std::string keys{};
+    for (auto&& name : kNames) {
+        keys += keys.empty() ? "{\"" : ",\"";
+        details::append_json_escaped(keys, name);
+        keys += "\":";
+    }
+    std::array<char, kSize> text{};
+    std::ranges::copy(keys, text.begin());
+    return text;
+}();
+
+template <typename Scheme>
+inline constexpr auto kJsonKeys = [] {
+    constexpr auto kNames = utils::get_struct_names<Scheme>();
+    std::array<std::string_view, kNames.size()> keys{};
+    std::size_t pos{};
+    for (std::size_t i = 0; i < kNames.size(); ++i) {
+        std::string key{};
+        details::append_json_escaped(key, kNames[i]);
+        keys[i] = std::string_view{kJsonKeysText<Scheme>.data() + pos, key.size() + 4};
+        pos += keys[i].size();
+    }
+    return keys;
+}();
+
+/// @brief Appends a cell of a column of type `T` as a JSON value.
+template <typename T>
+void append_json_value(std::string& dest, const std::optional<std::string_view>& cell) {
+    constexpr auto kKind = details::json_kind_of<T>();
+    if (!cell) {
+        dest += "null";
+        return;
+    }
+    if constexpr (kKind == json_kind::boolean) {
+        dest += (*cell == "t" || *cell == "true") ? "true" : "false";
+    } else if constexpr (kKind == json_kind::number) {
+        // JSON has no NaN or infinities
+        const bool finite = cell->find_first_of("nN") == std::string_view::npos;
+        if (finite) {
+            dest += *cell;
+        } else {
+            dest += '"';
+            dest += *cell;
+            dest += '"';
+        }
+    } else if constexpr (kKind == json_kind::raw) {
+        dest += *cell;
+    } else {
+        dest += '"';
+        details::append_json_escaped(dest, *cell);
+        dest += '"';
+    }
+}
+
+/// @brief Appends a cell of a column of type `T` as a CSV field.
+template <typename T>
+void append_csv_value(std::string& dest, const std::optional<std::string_view>& cell) {
+    if (!cell) {
+        return;
+    }
+    if constexpr (details::json_kind_of<T>() == json_kind::boolean) {
+        dest += (*cell == "t" || *cell == "true") ? "true" : "false";
+    } else {
+        details::append_csv_field(dest, *cell);
+    }
+}
+
+/// @brief Strips the trailing semicolon of a generated query, which
+///        `COPY (...) TO STDOUT` does not accept.
+constexpr auto copy_query(std::string_view query) noexcept -> std::string_view {
+    while (!query.empty() && (query.back() == ';' || query.back() == ' ' || query.back() == '\n')) {
+        query.remove_suffix(1);
+    }
+    return query;
+}
+
+template <std::size_t>
+using export_cell_t = std::optional<std::string_view>;
+
+}  // namespace details
+
+/// @brief Streams the rows of `query` to `sink` as NDJSON or CSV, without
+///        building a `Scheme` per row.
+///
+/// The rows are read with `COPY (query) TO STDOUT` as they arrive from the
+/// server, and the text of each cell is written straight to a buffer that
+/// is handed to `sink` whenever it fills up, so memory use does not depend
+/// on the number of rows. Field names and how each field is written are
+/// derived from `Scheme` at compile time: numbers and booleans are written
+/// bare, `db::json` fields as embedded JSON, and everything else as
+/// escaped strings.
+///
+/// The columns of `query` must be in the order of the fields of `Scheme`,
+/// as with the queries of `sql::utils`, and `COPY` does not take
+/// parameters, so values in `query` must be literals.
+///
+/// @tparam Scheme The type describing the columns.
+/// @param conn The pqxx::connection object representing the database connection.
+/// @param format The format to write.
+/// @param query The query, a trailing semicolon is allowed.
+/// @param sink Called with each chunk of output as `sink(std::string_view)`.
+/// @return The number of rows written.
+/// @throws db::deadline_exceeded if the deadline passed before all rows were read.
+///
+/// @example
+/// constexpr auto kQuery = db::sql::utils::construct_select_all_query<User>();
+/// db::export_rows<User>(conn, db::export_format::ndjson, kQuery, [&](std::string_view chunk) {
+///   response.write(chunk);
+/// });
+template <typename Scheme, typename Sink>
+auto export_rows(pqxx::connection& conn, export_format format, std::string_view query, Sink&& sink) -> std::size_t {
+    constexpr std::size_t kFlushSize = 64 * 1024;
+    constexpr auto kNames            = utils::get_struct_names<Scheme>();
+
+    std::string buffer{};
+    buffer.reserve(kFlushSize + 1024);
+    auto flush_if_full = [&] {
+        if (buffer.size() >= kFlushSize) {
+            sink(std::string_view{buffer});
+            buffer.clear();
+        }
+    };
+
+    if (format == export_format::csv) {
+        for (std::size_t i = 0; i < kNames.size(); ++i) {
+            if (i != 0) {
+                buffer += ',';
+            }
+            details::append_csv_field(buffer, kNames[i]);
+        }
+        buffer += "\r\n";
+    }
+
+    std::size_t rows{};
+    try {
+        pqxx::work txn{conn};
+        if (const auto deadline = details::current_deadline()) {
+            details::limit_statement(txn, *deadline, query);
+        }
+        [&]<std::size_t... I>(std::index_sequence<I...>) {
+            using field_types = std::tuple<std::remove_cvref_t<
+                decltype(utils::details::flat_field_ref<I>(std::declval<Scheme&>()))>...>;
+
+            for (auto&& row : txn.template stream<details::export_cell_t<I>...>(details::copy_query(query))) {
+                if (format == export_format::ndjson) {
+                    ((buffer += details::kJsonKeys<Scheme>[I],
+                         details::append_json_value<std::tuple_element_t<I, field_types>>(buffer, std::get<I>(row))),
+                        ...);
+                    buffer += "}\n";
+                } else {
+                    ((buffer += (I == 0 ? "" : ","),
+                         details::append_csv_value<std::tuple_element_t<I, field_types>>(buffer, std::get<I>(row))),
+                        ...);
+                    buffer += "\r\n";
+                }
+                ++rows;
+                flush_if_full();
+            }
+        }(std::make_index_sequence<kNames.size()>{});
+        txn.commit();
+    } catch (const pqxx::sql_error& ex) {
+        if (details::current_deadline() && details::is_query_canceled(ex)) {
+            throw deadline_exceeded{query};
+        }
+        throw;
+    }
+
+    if (!buffer.empty()) {
+        sink(std::string_view{buffer});
+    }
+    return rows;
+}
+
+/// @brief Streams every row of the table of `Scheme` to `sink` (see
+///        `db::export_rows`).
+template <sql::details::HasName Scheme, typename Sink>
+auto export_table(pqxx::connection& conn, export_format format, Sink&& sink) -> std::size_t {
+    constexpr auto kSelectAllQuery = sql::utils::construct_select_all_query<Scheme>();
+    return db::export_rows<Scheme>(conn, format, kSelectAllQuery, std::forward<Sink>(sink));
+}
+
+}  // namespace db
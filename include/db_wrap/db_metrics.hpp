@@ -0,0 +1,323 @@
+/*
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2024 Vladislav Nepogodin <vnepogodin@cachyos.org>
+ */
+#pragma once
+
+#include <db_wrap/alloc_accounting.hpp>
+#include <db_wrap/db_cache.hpp>
+#include <db_wrap/db_pool.hpp>
+#include <db_wrap/db_retry.hpp>
+#include <db_wrap/details/query_metrics.hpp>
+
+#include <array>             // for array
+#include <charconv>          // for to_chars
+#include <chrono>            // for duration
+#include <cstdint>           // for uint64_t
+#include <filesystem>        // for path, rename
+#include <fstream>           // for ofstream
+#include <initializer_list>  // for initializer_list
+#include <string>            // for string
+#include <string_view>       // for string_view
+#include <system_error>      // for errc
+#include <utility>           // for pair, move
+#include <vector>            // for vector
+
+namespace db {
+
+/// @brief Turns the recording of per-query latency histograms on or off.
+///
+/// While enabled, every query run through `db::utils` is timed and its
+/// latency, row count and result size are added to lock-free counters,
+/// which `db::metrics_exporter` renders.
+inline void enable_query_metrics(bool enabled = true) noexcept {
+    details::query_metrics::instance().enable(enabled);
+}
+
+namespace details {
+
+/// @brief Builds a Prometheus text exposition, one metric family at a time.
+class prometheus_writer {
+ public:
+    using label = std::pair<std::string_view, std::string_view>;
+
+    /// @brief Starts a metric family; its samples must follow.
+    void family(std::string_view name, std::string_view type, std::string_view help) {
+        m_out += "# HELP ";
+        m_out += name;
+        m_out += ' ';
+        m_out += help;
+        m_out += "\n# TYPE ";
+        m_out += name;
+        m_out += ' ';
+        m_out += type;
+        m_out += '\n';
+    }
+
+    template <typename T>
+    void sample(std::string_view name, std::initializer_list<label> labels, T value) {
+        m_out += name;
+        if (labels.size() != 0) {
+            m_out += '{';
+            bool first = true;
+            for (auto&& [key, label_value] : labels) {
+                m_out += first ? "" : ",";
+                first = false;
+                m_out += key;
+                m_out += "=\"";
+                prometheus_writer::append_label_value(m_out, label_value);
+                m_out += '"';
+            }
+            m_out += '}';
+        }
+        m_out += ' ';
+        prometheus_writer::append_number(m_out, value);
+        m_out += '\n';
+    }
+
+    [[nodiscard]] auto take() noexcept -> std::string { return std::move(m_out); }
+
+    template <typename T>
+    static void append_number(std::string& dest, T value) {
+        std::array<char, 32> buf{};
+        const auto [end, ec] = std::to_chars(buf.data(), buf.data() + buf.size(), value);
+        dest.append(buf.data(), ec == std::errc{} ? end : buf.data());
+    }
+
+    /// @brief Appends `value` without an exponent, as bucket bounds are
+    ///        conventionally written (`0.0005` rather than `5e-04`).
+    static void append_fixed(std::string& dest, double value) {
+        std::array<char, 32> buf{};
+        const auto [end, ec] = std::to_chars(buf.data(), buf.data() + buf.size(), value, std::chars_format::fixed);
+        dest.append(buf.data(), ec == std::errc{} ? end : buf.data());
+    }
+
+ private:
+    static void append_label_value(std::string& dest, std::string_view value) {
+        for (const char chr : value) {
+            switch (chr) {
+            case '\\': dest += "\\\\"; break;
+            case '"': dest += "\\\""; break;
+            case '\n': dest += "\\n"; break;
+            default: dest += chr;
+            }
+        }
+    }
+
+    std::string m_out{};
+};
+
+inline auto to_seconds(std::chrono::nanoseconds value) noexcept -> double {
+    return std::chrono::duration<double>(value).count();
+}
+
+}  // namespace details
+
+/// @brief Renders the counters of the library in the Prometheus text
+///        exposition format.
+///
+/// Covers the registered connection pools (wait time, open and borrowed
+/// connections), the registered result caches (hits, misses, hit ratio,
+/// size), the per-query latency histograms with the rows and bytes decoded
+/// (see `db::enable_query_metrics`), the retries of `db::with_retry` and,
+/// in builds with allocation accounting, the allocations per Scheme. Pool,
+/// query and retry counters are atomics read without taking any lock, so
+/// scraping never stalls queries; only the cache statistics are copied
+/// under the cache's lock.
+///
+/// The registered pools and caches must outlive the exporter.
+///
+/// @example
+/// db::enable_query_metrics();
+/// db::metrics_exporter exporter{};
+/// exporter.add_pool("primary", pool);
+/// exporter.add_cache("leaderboard", cache);
+/// http_response.body = exporter.render();
+class metrics_exporter {
+ public:
+    /// @brief Exports the counters of `pool`, labelled `pool="name"`.
+    void add_pool(std::string name, const connection_pool& pool) { m_pools.emplace_back(std::move(name), &pool); }
+
+    /// @brief Exports the counters of `cache`, labelled `cache="name"`.
+    void add_cache(std::string name, const query_cache& cache) { m_caches.emplace_back(std::move(name), &cache); }
+
+    /// @brief Renders every counter.
+    [[nodiscard]] auto render() const -> std::string {
+        details::prometheus_writer out{};
+        render_pools(out);
+        render_caches(out);
+        render_queries(out);
+        render_retries(out);
+        render_allocations(out);
+        return out.take();
+    }
+
+    /// @brief Renders every counter into `path`, e.g. for the textfile
+    ///        collector of the node exporter.
+    ///
+    /// The file is written next to `path` first and then renamed over it, so
+    /// a concurrent scrape never sees a partial file.
+    void write_to(const std::filesystem::path& path) const {
+        auto tmp_path = path;
+        tmp_path += ".tmp";
+        {
+            std::ofstream file{tmp_path, std::ios::trunc};
+            file << render();
+        }
+        std::filesystem::rename(tmp_path, path);
+    }
+
+ private:
+    void render_pools(details::prometheus_writer& out) const {
+        if (m_pools.empty()) {
+            return;
+        }
+        std::vector<pool_stats> stats{};
+        stats.reserve(m_pools.size());
+        for (auto&& [name, pool] : m_pools) {
+            stats.emplace_back(pool->stats());
+        }
+
+        auto family = [&](std::string_view metric, std::string_view type, std::string_view help, auto&& value) {
+            out.family(metric, type, help);
+            for (std::size_t i = 0; i < m_pools.size(); ++i) {
+                out.sample(metric, {{"pool", m_pools[i].first}}, value(stats[i]));
+            }
+        };
+        family("db_wrap_pool_connections_max", "gauge", "Maximum number of connections of the pool.",
+            [](const pool_stats& pool) { return pool.max_size; });
+        family("db_wrap_pool_connections_limit", "gauge", "Connections that may be checked out at once.",
+            [](const pool_stats& pool) { return pool.limit; });
+        family("db_wrap_pool_connections_open", "gauge", "Open connections, idle or checked out.",
+            [](const pool_stats& pool) { return pool.open; });
+        family("db_wrap_pool_connections_checked_out", "gauge", "Connections currently checked out.",
+            [](const pool_stats& pool) { return pool.checked_out; });
+        family("db_wrap_pool_waiting", "gauge", "Callers waiting for a connection.",
+            [](const pool_stats& pool) { return pool.waiting; });
+        family("db_wrap_pool_acquires_total", "counter", "Connections handed out.",
+            [](const pool_stats& pool) { return pool.acquires; });
+        family("db_wrap_pool_acquire_timeouts_total", "counter", "Acquires that gave up waiting.",
+            [](const pool_stats& pool) { return pool.timeouts; });
+        family("db_wrap_pool_shed_total", "counter", "Acquires rejected by admission control.",
+            [](const pool_stats& pool) { return pool.shed; });
+        family("db_wrap_pool_wait_seconds_total", "counter", "Time spent waiting for a connection.",
+            [](const pool_stats& pool) { return details::to_seconds(pool.wait_time); });
+    }
+
+    void render_caches(details::prometheus_writer& out) const {
+        if (m_caches.empty()) {
+            return;
+        }
+        struct cache_snapshot {
+            std::string_view name;
+            std::vector<query_cache_stats> queries;
+            std::size_t bytes;
+        };
+        std::vector<cache_snapshot> caches{};
+        caches.reserve(m_caches.size());
+        for (auto&& [name, cache] : m_caches) {
+            caches.push_back({.name = name, .queries = cache->stats(), .bytes = cache->size_bytes()});
+        }
+
+        out.family("db_wrap_cache_bytes", "gauge", "Approximate memory held by cached results.");
+        for (auto&& cache : caches) {
+            out.sample("db_wrap_cache_bytes", {{"cache", cache.name}}, cache.bytes);
+        }
+        auto family = [&](std::string_view metric, std::string_view type, std::string_view help, auto&& value) {
+            out.family(metric, type, help);
+            for (auto&& cache : caches) {
+                for (auto&& query : cache.queries) {
+                    out.sample(metric, {{"cache", cache.name}, {"query", query.query}}, value(query));
+                }
+            }
+        };
+        family("db_wrap_cache_hits_total", "counter", "Calls served with a fresh result.",
+            [](const query_cache_stats& query) { return query.hits; });
+        family("db_wrap_cache_stale_hits_total", "counter", "Calls served with a stale result.",
+            [](const query_cache_stats& query) { return query.stale_hits; });
+        family("db_wrap_cache_misses_total", "counter", "Calls that ran the query.",
+            [](const query_cache_stats& query) { return query.misses; });
+        family("db_wrap_cache_refreshes_total", "counter", "Background refreshes completed.",
+            [](const query_cache_stats& query) { return query.refreshes; });
+        family("db_wrap_cache_evictions_total", "counter", "Results evicted to stay within the size bound.",
+            [](const query_cache_stats& query) { return query.evictions; });
+        family("db_wrap_cache_hit_ratio", "gauge", "Share of calls served from the cache.",
+            [](const query_cache_stats& query) {
+                const auto served = query.hits + query.stale_hits;
+                const auto calls  = served + query.misses;
+                return calls == 0 ? 0.0 : static_cast<double>(served) / static_cast<double>(calls);
+            });
+    }
+
+    static void render_queries(details::prometheus_writer& out) {
+        const auto& metrics = details::query_metrics::instance();
+
+        constexpr std::string_view kDuration = "db_wrap_query_duration_seconds";
+        out.family(kDuration, "histogram", "Latency of the queries run by db_wrap.");
+        metrics.for_each([&out](std::string_view query, const details::query_histogram& histogram) {
+            std::uint64_t cumulative{};
+            for (std::size_t i = 0; i < histogram.buckets.size(); ++i) {
+                cumulative += histogram.buckets[i].load(std::memory_order_relaxed);
+                std::string bound{"+Inf"};
+                if (i < details::kLatencyBuckets.size()) {
+                    bound.clear();
+                    details::prometheus_writer::append_fixed(bound, std::chrono::duration<double>(details::kLatencyBuckets[i]).count());
+                }
+                out.sample("db_wrap_query_duration_seconds_bucket", {{"query", query}, {"le", bound}}, cumulative);
+            }
+            const auto sum = std::chrono::nanoseconds{histogram.sum_ns.load(std::memory_order_relaxed)};
+            out.sample("db_wrap_query_duration_seconds_sum", {{"query", query}}, details::to_seconds(sum));
+            // NOTE: the count is taken from the buckets, so it always matches the +Inf bucket
+            out.sample("db_wrap_query_duration_seconds_count", {{"query", query}}, cumulative);
+        });
+
+        out.family("db_wrap_query_rows_total", "counter", "Rows returned by the queries.");
+        metrics.for_each([&out](std::string_view query, const details::query_histogram& histogram) {
+            out.sample("db_wrap_query_rows_total", {{"query", query}}, histogram.rows.load(std::memory_order_relaxed));
+        });
+        out.family("db_wrap_query_decoded_bytes_total", "counter", "Bytes of field text returned by the queries.");
+        metrics.for_each([&out](std::string_view query, const details::query_histogram& histogram) {
+            out.sample("db_wrap_query_decoded_bytes_total", {{"query", query}}, histogram.bytes.load(std::memory_order_relaxed));
+        });
+    }
+
+    static void render_retries(details::prometheus_writer& out) {
+        const auto stats = db::retry_stats_snapshot();
+        if (stats.transactions == 0) {
+            return;
+        }
+        out.family("db_wrap_retry_transactions_total", "counter", "Transactions run by db::with_retry.");
+        out.sample("db_wrap_retry_transactions_total", {}, stats.transactions);
+        out.family("db_wrap_retries_total", "counter", "Transactions run again after a retryable error.");
+        out.sample("db_wrap_retries_total", {{"reason", "serialization_failure"}}, stats.serialization_retries);
+        out.sample("db_wrap_retries_total", {{"reason", "deadlock"}}, stats.deadlock_retries);
+        out.family("db_wrap_retries_given_up_total", "counter", "Transactions that failed without a further retry.");
+        out.sample("db_wrap_retries_given_up_total", {{"reason", "attempts"}}, stats.exhausted);
+        out.sample("db_wrap_retries_given_up_total", {{"reason", "budget"}}, stats.denied);
+    }
+
+    static void render_allocations(details::prometheus_writer& out) {
+        const auto report = db::alloc_report();
+        if (report.empty()) {
+            return;
+        }
+        auto family = [&](std::string_view metric, std::string_view help, auto&& value) {
+            out.family(metric, "counter", help);
+            for (auto&& scheme : report) {
+                out.sample(metric, {{"scheme", scheme.scheme}}, value(scheme));
+            }
+        };
+        family("db_wrap_decoded_rows_total", "Rows decoded per Scheme.",
+            [](const alloc_stats& scheme) { return scheme.rows; });
+        family("db_wrap_row_allocations_total", "Allocations made while decoding rows.",
+            [](const alloc_stats& scheme) { return scheme.row_allocations; });
+        family("db_wrap_row_allocated_bytes_total", "Bytes allocated while decoding rows.",
+            [](const alloc_stats& scheme) { return scheme.row_bytes; });
+    }
+
+    std::vector<std::pair<std::string, const connection_pool*>> m_pools{};
+    std::vector<std::pair<std::string, const query_cache*>> m_caches{};
+};
+
+}  // namespace db
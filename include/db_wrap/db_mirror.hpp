@@ -0,0 +1,366 @@
+/*
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2024 Vladislav Nepogodin <vnepogodin@cachyos.org>
+ */
+#pragma once
+
+#include <db_wrap/db_api.hpp>
+#include <db_wrap/db_change_feed.hpp>
+#include <db_wrap/details/pfr_utils.hpp>
+#include <db_wrap/details/static_string.hpp>
+
+#include <algorithm>      // for ranges::stable_sort, ranges::lower_bound, ranges::equal_range
+#include <array>          // for array
+#include <atomic>         // for atomic
+#include <cstddef>        // for size_t
+#include <functional>     // for hash, equal_to
+#include <map>            // for map
+#include <memory>         // for shared_ptr, make_shared
+#include <mutex>          // for mutex, lock_guard
+#include <span>           // for span
+#include <string>         // for string
+#include <string_view>    // for string_view
+#include <tuple>          // for tuple, get
+#include <type_traits>    // for remove_cvref_t, is_same_v
+#include <unordered_map>  // for unordered_map
+#include <utility>        // for move, pair, index_sequence
+#include <vector>         // for vector
+
+#include <pqxx/pqxx>
+
+namespace db {
+
+/// @brief Declares a hash index on the field `Field` of a `db::mirror`, for
+///        lookups by equality.
+template <::db::details::static_string Field>
+struct hash_index {
+    static constexpr auto kField = Field;
+};
+
+/// @brief Declares a sorted index on the field `Field` of a `db::mirror`,
+///        for lookups by equality and by range.
+template <::db::details::static_string Field>
+struct sorted_index {
+    static constexpr auto kField = Field;
+};
+
+namespace details {
+
+/// @brief The index of the field named `Field` among the fields of `Scheme`.
+template <typename Scheme, ::db::details::static_string Field>
+consteval auto index_field_idx() noexcept -> std::size_t {
+    constexpr auto kIdx = utils::get_field_idx_by_name<Field, Scheme>();
+    static_assert(kIdx < utils::get_fields_count<Scheme>(), "indexed field is not a field of the scheme");
+    return kIdx;
+}
+
+/// @brief The type of the field named `Field` of `Scheme`.
+template <typename Scheme, ::db::details::static_string Field>
+using index_key_t
+    = std::remove_cvref_t<decltype(utils::details::flat_field_ref<details::index_field_idx<Scheme, Field>()>(std::declval<Scheme&>()))>;
+
+/// @brief Hash of index keys; strings are also looked up by `std::string_view`.
+template <typename Key>
+struct index_key_hash {
+    using is_transparent = void;
+
+    auto operator()(const Key& key) const noexcept -> std::size_t {
+        if constexpr (std::is_same_v<Key, std::string>) {
+            return std::hash<std::string_view>{}(key);
+        } else {
+            return std::hash<Key>{}(key);
+        }
+    }
+
+    auto operator()(std::string_view key) const noexcept -> std::size_t
+        requires std::is_same_v<Key, std::string>
+    {
+        return std::hash<std::string_view>{}(key);
+    }
+};
+
+/// @brief Converts a lookup key to what the index of `Key` is searched with,
+///        without copying strings.
+template <typename Key, typename K>
+constexpr auto lookup_key(const K& key) {
+    if constexpr (std::is_same_v<Key, std::string> && std::is_convertible_v<const K&, std::string_view>) {
+        return std::string_view{key};
+    } else {
+        return Key(key);
+    }
+}
+
+template <typename Scheme, typename Index>
+class mirror_index;
+
+template <typename Scheme, ::db::details::static_string Field>
+class mirror_index<Scheme, hash_index<Field>> {
+ public:
+    using key_type = index_key_t<Scheme, Field>;
+
+    void build(const std::vector<Scheme>& rows) {
+        m_rows.reserve(rows.size());
+        for (auto&& row : rows) {
+            m_rows[utils::details::flat_field_ref<index_field_idx<Scheme, Field>()>(row)].emplace_back(&row);
+        }
+    }
+
+    template <typename K>
+    [[nodiscard]] auto find(const K& key) const -> std::span<const Scheme* const> {
+        const auto it = m_rows.find(details::lookup_key<key_type>(key));
+        if (it == m_rows.end()) {
+            return {};
+        }
+        return it->second;
+    }
+
+ private:
+    std::unordered_map<key_type, std::vector<const Scheme*>, index_key_hash<key_type>, std::equal_to<>> m_rows;
+};
+
+template <typename Scheme, ::db::details::static_string Field>
+class mirror_index<Scheme, sorted_index<Field>> {
+ public:
+    using key_type = index_key_t<Scheme, Field>;
+
+    void build(const std::vector<Scheme>& rows) {
+        std::vector<std::pair<key_type, const Scheme*>> entries{};
+        entries.reserve(rows.size());
+        for (auto&& row : rows) {
+            entries.emplace_back(utils::details::flat_field_ref<index_field_idx<Scheme, Field>()>(row), &row);
+        }
+        std::ranges::stable_sort(entries, {}, &std::pair<key_type, const Scheme*>::first);
+
+        m_keys.reserve(entries.size());
+        m_rows.reserve(entries.size());
+        for (auto&& [key, row] : entries) {
+            m_keys.emplace_back(std::move(key));
+            m_rows.emplace_back(row);
+        }
+    }
+
+    template <typename K>
+    [[nodiscard]] auto find(const K& key) const -> std::span<const Scheme* const> {
+        const auto [first, last] = std::ranges::equal_range(m_keys, details::lookup_key<key_type>(key));
+        return rows_between(first, last);
+    }
+
+    template <typename K>
+    [[nodiscard]] auto range(const K& from, const K& to) const -> std::span<const Scheme* const> {
+        const auto first = std::ranges::lower_bound(m_keys, details::lookup_key<key_type>(from));
+        const auto last  = std::ranges::lower_bound(first, m_keys.end(), details::lookup_key<key_type>(to));
+        return rows_between(first, last);
+    }
+
+ private:
+    using key_iterator = typename std::vector<key_type>::const_iterator;
+
+    [[nodiscard]] auto rows_between(key_iterator first, key_iterator last) const -> std::span<const Scheme* const> {
+        return std::span{m_rows}.subspan(static_cast<std::size_t>(first - m_keys.begin()),
+            static_cast<std::size_t>(last - first));
+    }
+
+    std::vector<key_type> m_keys;
+    std::vector<const Scheme*> m_rows;
+};
+
+/// @brief The position of the index on `Field` among `Indexes`.
+template <::db::details::static_string Field, typename... Indexes>
+consteval auto index_position() noexcept -> std::size_t {
+    constexpr std::array<bool, sizeof...(Indexes)> kMatches{
+        (std::string_view{Indexes::kField} == std::string_view{Field})...};
+    constexpr auto kIdx = static_cast<std::size_t>(std::ranges::find(kMatches, true) - kMatches.begin());
+    static_assert(kIdx < sizeof...(Indexes), "no index on this field is declared");
+    return kIdx;
+}
+
+/// @brief Copies the fields of `previous` marked in `unchanged` into `record`.
+template <typename Scheme, std::size_t N>
+void keep_unchanged(Scheme& record, const Scheme& previous, const std::array<bool, N>& unchanged) {
+    [&]<std::size_t... I>(std::index_sequence<I...>) {
+        ((unchanged[I] ? void(utils::details::flat_field_ref<I>(record) = utils::details::flat_field_ref<I>(previous))
+                       : void()),
+            ...);
+    }(std::make_index_sequence<N>{});
+}
+
+}  // namespace details
+
+/// @brief An immutable copy of a table held by a `db::mirror`, with the
+///        indexes declared on it.
+///
+/// Rows are ordered by their ID. The pointers returned by lookups stay
+/// valid as long as the snapshot is held.
+template <sql::details::HasSchemeAndId Scheme, typename... Indexes>
+class mirror_snapshot {
+ public:
+    using id_type = sql::details::id_field_t<Scheme>;
+
+    /// @brief Builds the indexes over `rows`, which must be ordered by ID.
+    explicit mirror_snapshot(std::vector<Scheme> rows) : m_rows(std::move(rows)) {
+        std::apply([this](auto&... indexes) { (indexes.build(m_rows), ...); }, m_indexes);
+    }
+
+    // the indexes point into the rows
+    mirror_snapshot(const mirror_snapshot&)            = delete;
+    mirror_snapshot& operator=(const mirror_snapshot&) = delete;
+
+    /// @brief Every row, ordered by ID.
+    [[nodiscard]] auto rows() const noexcept -> const std::vector<Scheme>& { return m_rows; }
+    [[nodiscard]] auto size() const noexcept -> std::size_t { return m_rows.size(); }
+
+    /// @brief Finds the row with the ID `id`.
+    /// @return The row, or null if there is none.
+    [[nodiscard]] auto find(const id_type& id) const -> const Scheme* {
+        const auto it = std::ranges::lower_bound(m_rows, id, {}, &Scheme::id);
+        return it != m_rows.end() && it->id == id ? &*it : nullptr;
+    }
+
+    /// @brief Finds the rows whose field `Field` equals `key`, through the
+    ///        index declared on it.
+    template <::db::details::static_string Field, typename K>
+    [[nodiscard]] auto find(const K& key) const -> std::span<const Scheme* const> {
+        return std::get<details::index_position<Field, Indexes...>()>(m_indexes).find(key);
+    }
+
+    /// @brief Finds the rows whose field `Field` is in `[from, to)`, through
+    ///        the `db::sorted_index` declared on it, ordered by the field.
+    template <::db::details::static_string Field, typename K>
+    [[nodiscard]] auto range(const K& from, const K& to) const -> std::span<const Scheme* const> {
+        return std::get<details::index_position<Field, Indexes...>()>(m_indexes).range(from, to);
+    }
+
+ private:
+    std::vector<Scheme> m_rows;
+    std::tuple<details::mirror_index<Scheme, Indexes>...> m_indexes;
+};
+
+/// @brief An in-memory copy of a table, kept current through a
+///        `db::change_feed`, with in-memory secondary indexes.
+///
+/// The mirror loads the whole table, then applies the changes committed
+/// since whenever `refresh` is called. Readers take the current snapshot
+/// with `snapshot()` and never wait for a refresh: a refresh builds a new
+/// snapshot on the side and publishes it with a single atomic pointer
+/// swap, and the previous snapshot is freed once its last reader drops
+/// it. Since every refresh that applied changes rebuilds the snapshot and
+/// its indexes, the mirror suits tables that are read far more often than
+/// they change, such as reference data.
+///
+/// The mirror owns its replication slot. The slot is temporary: it is
+/// created when the mirror is constructed and dropped by the server when
+/// the connection of the mirror closes, even if the process dies, so that
+/// no WAL is kept for a mirror that is gone. Every connection needs a slot
+/// name of its own. The server must run with `wal_level = logical`. Values
+/// of large (TOASTed) columns that an update did not change are not logged
+/// by the server; the mirror keeps the values it had for them.
+///
+/// @tparam Scheme The type representing the table.
+/// @tparam Indexes The `db::hash_index` and `db::sorted_index` to maintain.
+///
+/// @example
+/// db::mirror<Country, db::hash_index<"code">, db::sorted_index<"population">> countries{conn, "countries_mirror"};
+/// // on a timer, or after a NOTIFY
+/// countries.refresh();
+/// // on any thread
+/// auto snapshot = countries.snapshot();
+/// for (const auto* country : snapshot->find<"code">("DE")) {
+///   std::cout << country->name << '\n';
+/// }
+template <sql::details::HasSchemeAndId Scheme, typename... Indexes>
+class mirror {
+ public:
+    using snapshot_type = mirror_snapshot<Scheme, Indexes...>;
+
+    /// @brief Creates the temporary replication slot `slot` and loads the table.
+    ///
+    /// `conn` must outlive the mirror, and should not be used by anything
+    /// else while `refresh` runs.
+    ///
+    /// @throws pqxx::usage_error if a replication slot named `slot` exists.
+    mirror(pqxx::connection& conn, std::string slot) : m_feed(conn, slot) {
+        // create the slot before loading, so that no change can slip in between
+        if (!change_feed::create_slot(conn, slot, true)) {
+            throw pqxx::usage_error{"replication slot " + slot + " exists already"};
+        }
+        for (auto&& record : db::get_all_records<Scheme>(conn).value_or(std::vector<Scheme>{})) {
+            auto id = record.id;
+            m_records.insert_or_assign(std::move(id), std::move(record));
+        }
+        m_feed.on<Scheme>([this](const change<Scheme>& item) { apply(item); });
+        publish();
+    }
+
+    mirror(const mirror&)            = delete;
+    mirror& operator=(const mirror&) = delete;
+
+    /// @brief The current snapshot of the table; never waits for a refresh.
+    [[nodiscard]] auto snapshot() const noexcept -> std::shared_ptr<const snapshot_type> {
+        return m_snapshot.load(std::memory_order_acquire);
+    }
+
+    /// @brief Applies the changes committed since the last refresh and
+    ///        publishes a new snapshot if there were any.
+    ///
+    /// Changes committed between the slot creation and the initial load
+    /// are applied again, which is harmless, since every change carries
+    /// the whole new row, apart from the unchanged TOASTed values kept.
+    ///
+    /// @param max_changes See `db::change_feed::poll`.
+    /// @return The number of changes applied.
+    auto refresh(std::size_t max_changes = 1000) -> std::size_t {
+        const std::lock_guard lock{m_refresh_mutex};
+        const auto applied = m_feed.poll(max_changes);
+        if (applied != 0) {
+            publish();
+        }
+        return applied;
+    }
+
+    /// @brief The change feed of the mirror, e.g. to drop its slot.
+    [[nodiscard]] auto feed() noexcept -> change_feed& { return m_feed; }
+
+ private:
+    void apply(const change<Scheme>& item) {
+        switch (item.kind) {
+        case change_kind::insert:
+        case change_kind::update: {
+            const auto& previous_id = item.old_record ? item.old_record->id : item.record.id;
+            auto previous           = m_records.find(previous_id);
+            Scheme record           = item.record;
+            if (previous != m_records.end()) {
+                details::keep_unchanged(record, previous->second, item.unchanged);
+                if (!(previous_id == record.id)) {
+                    m_records.erase(previous);
+                }
+            }
+            auto id = record.id;
+            m_records.insert_or_assign(std::move(id), std::move(record));
+            break;
+        }
+        case change_kind::remove:
+            m_records.erase(item.record.id);
+            break;
+        case change_kind::truncate:
+            m_records.clear();
+            break;
+        }
+    }
+
+    void publish() {
+        std::vector<Scheme> rows{};
+        rows.reserve(m_records.size());
+        for (auto&& [id, record] : m_records) {
+            rows.emplace_back(record);
+        }
+        m_snapshot.store(std::make_shared<const snapshot_type>(std::move(rows)), std::memory_order_release);
+    }
+
+    change_feed m_feed;
+    std::mutex m_refresh_mutex{};
+    std::map<sql::details::id_field_t<Scheme>, Scheme> m_records{};
+    std::atomic<std::shared_ptr<const snapshot_type>> m_snapshot{};
+};
+
+}  // namespace db
@@ -0,0 +1,198 @@
+/*
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2024 Vladislav Nepogodin <vnepogodin@cachyos.org>
+ */
+#pragma once
+
+#include <db_wrap/db_api.hpp>
+#include <db_wrap/db_deadline.hpp>
+#include <db_wrap/db_utils.hpp>
+#include <db_wrap/details/static_string.hpp>
+#include <db_wrap/sql_utils.hpp>
+
+#include <cstdint>      // for int64_t
+#include <memory>       // for unique_ptr, make_unique
+#include <string_view>  // for string_view
+#include <utility>      // for move, forward
+#include <vector>       // for vector
+
+#include <pqxx/pqxx>
+
+namespace db {
+
+namespace details {
+
+/// @brief Constructs the query claiming up to `$1` rows of a queue table.
+///
+/// @example
+/// constexpr auto query = db::details::construct_dequeue_query<Job, "run_at <= now()">();
+/// static_assert(query == "SELECT * FROM jobs WHERE run_at <= now() ORDER BY id LIMIT $1 FOR UPDATE SKIP LOCKED;");
+template <sql::details::HasSchemeAndId Scheme, static_string Condition>
+consteval auto construct_dequeue_query() noexcept {
+    constexpr auto kDbName = []() {
+        constexpr std::string_view db_name_str = Scheme::kName;
+        static_string<db_name_str.size()> res{};
+        res += db_name_str;
+        return res;
+    }();
+
+    constexpr auto kStatementBegin = static_string("SELECT * FROM ") + kDbName;
+    constexpr auto kStatementEnd   = static_string(" ORDER BY id LIMIT $1 FOR UPDATE SKIP LOCKED;");
+    if constexpr (std::string_view{Condition}.empty()) {
+        return kStatementBegin + kStatementEnd;
+    } else {
+        return kStatementBegin + static_string(" WHERE ") + Condition + kStatementEnd;
+    }
+}
+
+/// @brief Runs `func`, which runs `query` in a transaction limited by a
+///        deadline if `limited`, throwing `db::deadline_exceeded` if the
+///        server cancelled it for that.
+template <typename Func>
+auto run_queue_statement(bool limited, std::string_view query, Func&& func) -> decltype(auto) {
+    try {
+        return std::forward<Func>(func)();
+    } catch (const pqxx::sql_error& ex) {
+        if (limited && details::is_query_canceled(ex)) {
+            throw deadline_exceeded{query};
+        }
+        throw;
+    }
+}
+
+}  // namespace details
+
+/// @brief Rows claimed from a `db::queue`, locked by an open transaction.
+///
+/// Other workers skip the claimed rows until the batch is committed or
+/// destroyed. Each row is either completed, i.e. deleted, or retried, i.e.
+/// written back with its possibly modified fields, in the same
+/// transaction; `commit` makes that durable and releases the rows that
+/// were neither. A batch destroyed without `commit`, e.g. by an exception
+/// thrown while processing a row, rolls back and hands every row back to
+/// the queue unchanged.
+///
+/// If the batch was claimed under a `db::deadline_scope`, a statement of it
+/// cancelled by that deadline throws `db::deadline_exceeded`.
+///
+/// @tparam Scheme The type representing the queue table.
+template <sql::details::HasSchemeAndId Scheme>
+class claimed_batch {
+ public:
+    claimed_batch(std::unique_ptr<pqxx::work> txn, std::vector<Scheme> records, bool limited = false) noexcept
+      : m_txn(std::move(txn)), m_records(std::move(records)), m_limited(limited) { }
+
+    /// @brief The claimed rows, in order of their ID.
+    [[nodiscard]] auto records() const noexcept -> const std::vector<Scheme>& { return m_records; }
+    [[nodiscard]] auto begin() noexcept { return m_records.begin(); }
+    [[nodiscard]] auto end() noexcept { return m_records.end(); }
+    [[nodiscard]] auto size() const noexcept -> std::size_t { return m_records.size(); }
+    [[nodiscard]] auto empty() const noexcept -> bool { return m_records.empty(); }
+
+    /// @brief The transaction holding the claim, to run the work of the
+    ///        rows in it too.
+    [[nodiscard]] auto transaction() noexcept -> pqxx::work& { return *m_txn; }
+
+    /// @brief Deletes `record` from the queue once the batch is committed.
+    /// @return Whether the row was deleted.
+    auto complete(const Scheme& record) -> bool {
+        constexpr auto kDeleteQuery = sql::utils::construct_delete_query_from_condition<Scheme, "id = $1">();
+        return details::run_queue_statement(m_limited, kDeleteQuery, [&] {
+            return m_txn->exec_params(kDeleteQuery.data(), record.id).affected_rows() == 1;
+        });
+    }
+
+    /// @brief Writes the fields of `record` back to the queue once the batch
+    ///        is committed, e.g. an increased attempt count or a later time
+    ///        to run at, and releases it for any worker to claim again.
+    /// @return Whether the row was updated.
+    auto retry(const Scheme& record) -> bool {
+        constexpr auto kUpdateAllQuery = sql::utils::create_update_all_query<Scheme>();
+        auto&& unroll_func = [this, &kUpdateAllQuery](const auto&... fields) {
+            return m_txn->exec_params(kUpdateAllQuery.data(), fields...).affected_rows() == 1;
+        };
+        return details::run_queue_statement(
+            m_limited, kUpdateAllQuery, [&] { return db::utils::unpack_fields(std::move(unroll_func), record); });
+    }
+
+    /// @brief Commits the completions and retries and releases every row.
+    void commit() {
+        details::run_queue_statement(m_limited, "COMMIT", [this] { m_txn->commit(); });
+    }
+
+ private:
+    std::unique_ptr<pqxx::work> m_txn;
+    std::vector<Scheme> m_records;
+    bool m_limited{};
+};
+
+/// @brief A table used as a work queue, drained by any number of workers.
+///
+/// `dequeue_batch` claims rows with `SELECT ... FOR UPDATE SKIP LOCKED`:
+/// every worker locks a different set of rows in a single statement instead
+/// of queueing behind the lock of the oldest one, so adding workers adds
+/// throughput rather than lock contention. Rows are claimed in order of
+/// their ID, restricted to those matching `Condition` if one is given.
+///
+/// @tparam Scheme The type representing the queue table.
+/// @tparam Condition An optional WHERE clause selecting the rows ready to run.
+///
+/// @example
+/// struct Job {
+///   static constexpr std::string_view kName = "jobs";
+///   std::int64_t id;
+///   std::string payload;
+///   std::int32_t attempts;
+/// };
+///
+/// db::queue<Job> jobs{conn};
+/// auto batch = jobs.dequeue_batch(32);
+/// for (auto& job : batch) {
+///   if (process(job)) {
+///     batch.complete(job);
+///   } else {
+///     ++job.attempts;
+///     batch.retry(job);
+///   }
+/// }
+/// batch.commit();
+template <sql::details::HasSchemeAndId Scheme, ::db::details::static_string Condition = "">
+class queue {
+ public:
+    static constexpr auto kDequeueQuery = details::construct_dequeue_query<Scheme, Condition>();
+
+    /// @brief A queue on `conn`, which must outlive it.
+    explicit queue(pqxx::connection& conn) noexcept : m_conn(&conn) { }
+
+    /// @brief Inserts a row into the queue, in its own transaction.
+    /// @return The number of rows inserted.
+    auto enqueue(const Scheme& record) -> std::size_t { return db::insert_record(*m_conn, record); }
+
+    /// @brief Claims up to `max_count` rows no other worker holds.
+    ///
+    /// The rows stay locked until the returned batch is committed or
+    /// destroyed, and only one batch can be open per connection at a time.
+    /// While a `db::deadline_scope` is active, it limits the whole batch
+    /// transaction, and a statement it cancels throws `db::deadline_exceeded`.
+    ///
+    /// @param max_count The maximum number of rows to claim.
+    /// @return The claimed rows, empty if there were none to claim.
+    auto dequeue_batch(std::size_t max_count) -> claimed_batch<Scheme> {
+        auto txn            = std::make_unique<pqxx::work>(*m_conn);
+        const auto deadline = details::current_deadline();
+        if (deadline) {
+            details::limit_statement(*txn, *deadline, kDequeueQuery);
+        }
+        pqxx::result result = details::run_queue_statement(deadline.has_value(), kDequeueQuery, [&] {
+            return txn->exec_params(kDequeueQuery.data(), static_cast<std::int64_t>(max_count));
+        });
+        auto records = db::utils::extract_all_rows<Scheme>(std::move(result));
+        return claimed_batch<Scheme>{std::move(txn), std::move(records), deadline.has_value()};
+    }
+
+ private:
+    pqxx::connection* m_conn;
+};
+
+}  // namespace db
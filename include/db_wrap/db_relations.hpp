@@ -0,0 +1,316 @@
+/*
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2024 Vladislav Nepogodin <vnepogodin@cachyos.org>
+ */
+#pragma once
+
+#include <db_wrap/db_api.hpp>
+#include <db_wrap/details/pfr_utils.hpp>
+#include <db_wrap/details/static_string.hpp>
+#include <db_wrap/sql_utils.hpp>
+
+#include <algorithm>      // for sort, unique
+#include <array>          // for array
+#include <concepts>       // for totally_ordered, convertible_to
+#include <cstddef>        // for size_t
+#include <functional>     // for hash
+#include <map>            // for map
+#include <optional>       // for optional
+#include <string_view>    // for string_view
+#include <tuple>          // for tuple, get
+#include <type_traits>    // for conditional_t, is_same_v
+#include <unordered_map>  // for unordered_map
+#include <ranges>         // for ranges::*
+#include <utility>        // for move
+#include <vector>         // for vector
+
+#include <pqxx/pqxx>
+
+namespace db {
+
+/// @brief Declares that the field `ForeignKey` of a Scheme references the
+///        `id` of `Target`.
+///
+/// Relations are declared on the referencing Scheme through a nested
+/// `relations` alias; the foreign key field may be optional, in which case
+/// records holding `NULL` have no related record.
+///
+/// @tparam ForeignKey The name of the foreign key field.
+/// @tparam Target The referenced Scheme.
+///
+/// @example
+/// struct Order {
+///   static constexpr std::string_view kName = "orders";
+///   using relations = db::relations<db::belongs_to<"customer_id", Customer>>;
+///   std::int64_t id;
+///   std::int64_t customer_id;
+/// };
+template <::db::details::static_string ForeignKey, typename Target>
+struct belongs_to {
+    static constexpr auto kForeignKey = ForeignKey;
+    using target                      = Target;
+};
+
+/// @brief The list of relations of a Scheme (see `db::belongs_to`).
+template <typename... Relations>
+struct relations { };
+
+/// @brief Tag type selecting the related Schemes loaded with a list query.
+template <typename... Related>
+struct include_t { };
+
+/// @brief Requests the records of `Related...` referenced by the records
+///        of a list query, e.g. `db::get_all_records<Order>(conn, db::include<Customer>)`.
+template <typename... Related>
+inline constexpr include_t<Related...> include{};
+
+namespace details {
+
+template <typename T>
+struct is_optional : std::false_type { };
+
+template <typename T>
+struct is_optional<std::optional<T>> : std::true_type { };
+
+template <typename T>
+concept Hashable = requires(const T& value) {
+    { std::hash<T>{}(value) } -> std::convertible_to<std::size_t>;
+};
+
+/// @brief Concept satisfied by Schemes declaring their relations.
+template <typename Scheme>
+concept HasRelations = requires { typename Scheme::relations; };
+
+/// @brief Records of `Target` keyed by their id, hashed when the id allows it.
+template <typename Target>
+using related_index_t = std::conditional_t<Hashable<sql::details::id_field_t<Target>>,
+    std::unordered_map<sql::details::id_field_t<Target>, Target>,
+    std::map<sql::details::id_field_t<Target>, Target>>;
+
+/// @brief Calls `func.template operator()<Relation>()` for every relation of
+///        `Scheme` referencing `Target`.
+template <typename Scheme, typename Target, typename F>
+constexpr void for_each_relation_to(F&& func) {
+    []<typename... Relations>(db::relations<Relations...>, F& f) {
+        ([&] {
+            if constexpr (std::is_same_v<typename Relations::target, Target>) {
+                f.template operator()<Relations>();
+            }
+        }(), ...);
+    }(typename Scheme::relations{}, func);
+}
+
+/// @brief The number of relations of `Scheme` referencing `Target`.
+template <typename Scheme, typename Target>
+consteval auto relations_to_count() noexcept -> std::size_t {
+    std::size_t count{};
+    details::for_each_relation_to<Scheme, Target>([&]<typename>() { ++count; });
+    return count;
+}
+
+template <::db::details::static_string ForeignKey, typename Relations>
+struct relation_by_key;
+
+template <::db::details::static_string ForeignKey, typename... Relations>
+struct relation_by_key<ForeignKey, db::relations<Relations...>> {
+    static constexpr std::array<bool, sizeof...(Relations)> kMatches{
+        (std::string_view{Relations::kForeignKey} == std::string_view{ForeignKey})...};
+    static constexpr auto kIdx = static_cast<std::size_t>(std::ranges::find(kMatches, true) - kMatches.begin());
+    static_assert(kIdx < sizeof...(Relations), "no relation with this foreign key is declared");
+
+    using type = std::tuple_element_t<kIdx, std::tuple<Relations...>>;
+};
+
+/// @brief The relation of `Scheme` with the foreign key `ForeignKey`.
+template <typename Scheme, ::db::details::static_string ForeignKey>
+using relation_by_key_t = typename relation_by_key<ForeignKey, typename Scheme::relations>::type;
+
+/// @brief The id of the record referenced by `record` through `Relation`.
+/// @return `std::nullopt` if the foreign key is `NULL`.
+template <typename Relation, typename Scheme>
+constexpr auto foreign_key_of(const Scheme& record) -> std::optional<sql::details::id_field_t<typename Relation::target>> {
+    constexpr auto kIdx = utils::get_field_idx_by_name<Relation::kForeignKey, Scheme>();
+    static_assert(kIdx < utils::get_fields_count<Scheme>(), "foreign key is not a field of the scheme");
+
+    const auto& key = utils::details::flat_field_ref<kIdx>(record);
+    if constexpr (is_optional<std::remove_cvref_t<decltype(key)>>::value) {
+        if (!key) {
+            return std::nullopt;
+        }
+        return sql::details::id_field_t<typename Relation::target>(*key);
+    } else {
+        return sql::details::id_field_t<typename Relation::target>(key);
+    }
+}
+
+}  // namespace details
+
+/// @brief Records of a list query together with the records they reference.
+///
+/// Holds the records of `Scheme` and, for every Scheme in `Related...`, the
+/// referenced records keyed by their id. Each related Scheme is fetched with
+/// one `id = ANY($1)` query no matter how many records reference it, so a
+/// page of 200 orders with their customers takes two queries instead of 201.
+///
+/// @tparam Scheme The Scheme of the list query.
+/// @tparam Related The referenced Schemes, each the target of at least one
+///                 relation declared on `Scheme`.
+template <sql::details::HasSchemeAndId Scheme, sql::details::HasSchemeAndId... Related>
+    requires details::HasRelations<Scheme>
+class with_related {
+ public:
+    with_related() = default;
+    with_related(std::vector<Scheme> records, details::related_index_t<Related>... related)
+      : m_records(std::move(records)), m_related(std::move(related)...) { }
+
+    /// @brief The records of the list query, in the order of its result.
+    [[nodiscard]] auto records() const noexcept -> const std::vector<Scheme>& { return m_records; }
+    [[nodiscard]] auto begin() const noexcept { return m_records.begin(); }
+    [[nodiscard]] auto end() const noexcept { return m_records.end(); }
+    [[nodiscard]] auto size() const noexcept -> std::size_t { return m_records.size(); }
+    [[nodiscard]] auto empty() const noexcept -> bool { return m_records.empty(); }
+
+    /// @brief Releases the records of the list query.
+    [[nodiscard]] auto take_records() noexcept -> std::vector<Scheme> { return std::move(m_records); }
+
+    /// @brief The record of `Target` referenced by `record`.
+    ///
+    /// `Scheme` must declare exactly one relation to `Target`; use the
+    /// overload taking the foreign key otherwise.
+    ///
+    /// @return The referenced record, or `nullptr` if the foreign key is
+    ///         `NULL` or references no existing record.
+    template <typename Target>
+    [[nodiscard]] auto related(const Scheme& record) const -> const Target* {
+        static_assert(details::relations_to_count<Scheme, Target>() == 1, "the relation to Target is ambiguous, name its foreign key");
+
+        const Target* result{};
+        details::for_each_relation_to<Scheme, Target>([&]<typename Relation>() { result = lookup<Relation>(record); });
+        return result;
+    }
+
+    /// @brief The record referenced by `record` through the foreign key `ForeignKey`.
+    /// @return The referenced record, or `nullptr` if the foreign key is
+    ///         `NULL` or references no existing record.
+    template <::db::details::static_string ForeignKey>
+    [[nodiscard]] auto related(const Scheme& record) const -> const typename details::relation_by_key_t<Scheme, ForeignKey>::target* {
+        return lookup<details::relation_by_key_t<Scheme, ForeignKey>>(record);
+    }
+
+    /// @brief All loaded records of `Target`, keyed by their id.
+    template <typename Target>
+    [[nodiscard]] auto all_related() const noexcept -> const details::related_index_t<Target>& {
+        return std::get<details::related_index_t<Target>>(m_related);
+    }
+
+ private:
+    template <typename Relation>
+    auto lookup(const Scheme& record) const -> const typename Relation::target* {
+        using target_t = typename Relation::target;
+        static_assert((std::is_same_v<target_t, Related> || ...), "Target was not included in the query");
+
+        const auto key = details::foreign_key_of<Relation>(record);
+        if (!key) {
+            return nullptr;
+        }
+        const auto& index = all_related<target_t>();
+        if (auto it = index.find(*key); it != index.end()) {
+            return &it->second;
+        }
+        return nullptr;
+    }
+
+    std::vector<Scheme> m_records{};
+    std::tuple<details::related_index_t<Related>...> m_related{};
+};
+
+/// @brief Loads the records of `Related...` referenced by `records`.
+///
+/// The ids referenced through every relation of `Scheme` to a related
+/// Scheme are collected and deduplicated, then fetched with one
+/// `db::find_by_ids` query per related Scheme. Nothing is queried for a
+/// Scheme no record references.
+///
+/// @tparam Related The referenced Schemes to load.
+/// @tparam Scheme The Scheme of `records`, which must declare a relation
+///                to every Scheme in `Related...`.
+/// @param conn The pqxx::connection object representing the database connection.
+/// @param records The records whose references are loaded.
+/// @return The records together with the records they reference.
+///
+/// @example
+/// auto orders = db::utils::as_set_of<Order>(conn, "SELECT * FROM orders LIMIT 200");
+/// auto page = db::load_related<Customer>(conn, orders.value_or(std::vector<Order>{}));
+/// for (auto&& order : page) {
+///   if (const auto* customer = page.related<Customer>(order)) {
+///     std::cout << customer->name << std::endl;
+///   }
+/// }
+template <sql::details::HasSchemeAndId... Related, sql::details::HasSchemeAndId Scheme>
+    requires details::HasRelations<Scheme>
+auto load_related(pqxx::connection& conn, std::vector<Scheme> records) -> with_related<Scheme, Related...> {
+    static_assert(((details::relations_to_count<Scheme, Related>() > 0) && ...), "Scheme declares no relation to an included Scheme");
+
+    auto load_one = [&]<typename Target>() {
+        using target_id_t = sql::details::id_field_t<Target>;
+
+        std::vector<target_id_t> ids{};
+        ids.reserve(records.size() * details::relations_to_count<Scheme, Target>());
+        details::for_each_relation_to<Scheme, Target>([&]<typename Relation>() {
+            for (auto&& record : records) {
+                if (auto key = details::foreign_key_of<Relation>(record)) {
+                    ids.emplace_back(std::move(*key));
+                }
+            }
+        });
+        if constexpr (std::totally_ordered<target_id_t>) {
+            std::ranges::sort(ids);
+            ids.erase(std::ranges::unique(ids).begin(), ids.end());
+        }
+
+        details::related_index_t<Target> index{};
+        for (auto&& related : db::find_by_ids<Target>(conn, ids)) {
+            auto key = related.id;
+            index.emplace(std::move(key), std::move(related));
+        }
+        return index;
+    };
+    // NOTE: the braced list keeps the queries in the order of Related...
+    return with_related<Scheme, Related...>{std::move(records), load_one.template operator()<Related>()...};
+}
+
+/// @brief Finds the records whose ID is in `ids` together with the records
+///        of `Related...` they reference.
+///
+/// @return The matching records with their references; see `db::find_by_ids`
+///         and `db::load_related`.
+///
+/// @example
+/// auto orders = db::find_by_ids<Order>(conn, std::vector{1, 2, 3}, db::include<Customer>);
+template <sql::details::HasSchemeAndId Scheme, std::ranges::input_range Ids, sql::details::HasSchemeAndId... Related>
+    requires details::HasRelations<Scheme>
+auto find_by_ids(pqxx::connection& conn, Ids&& ids, include_t<Related...> /*unused*/) -> with_related<Scheme, Related...> {
+    return db::load_related<Related...>(conn, db::find_by_ids<Scheme>(conn, std::forward<Ids>(ids)));
+}
+
+/// @brief Retrieves all records from a table together with the records of
+///        `Related...` they reference.
+///
+/// @return `std::nullopt` if the table has no records, otherwise the records
+///         with their references; see `db::get_all_records` and
+///         `db::load_related`.
+///
+/// @example
+/// auto orders = db::get_all_records<Order>(conn, db::include<Customer>);
+template <sql::details::HasSchemeAndId Scheme, sql::details::HasSchemeAndId... Related>
+    requires details::HasRelations<Scheme>
+auto get_all_records(pqxx::connection& conn, include_t<Related...> /*unused*/) -> std::optional<with_related<Scheme, Related...>> {
+    auto records = db::get_all_records<Scheme>(conn);
+    if (!records) {
+        return std::nullopt;
+    }
+    return db::load_related<Related...>(conn, std::move(*records));
+}
+
+}  // namespace db
@@ -0,0 +1,241 @@
+/*
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2024 Vladislav Nepogodin <vnepogodin@cachyos.org>
+ */
+#pragma once
+
+#include <db_wrap/db_deadline.hpp>
+#include <db_wrap/db_pool.hpp>
+
+#include <algorithm>    // for min
+#include <atomic>       // for atomic
+#include <chrono>       // for milliseconds, nanoseconds
+#include <cstdint>      // for uint32_t, uint64_t, int64_t
+#include <exception>    // for exception_ptr, rethrow_exception
+#include <random>       // for random_device, minstd_rand, uniform_int_distribution
+#include <string_view>  // for string_view
+#include <thread>       // for this_thread::sleep_for
+#include <type_traits>  // for invoke_result_t, is_void_v
+
+#include <pqxx/pqxx>
+
+namespace db {
+
+/// @brief Limits retries to a share of the transactions run, so that retries
+///        cannot multiply the load on a database that is already failing.
+///
+/// Every transaction run deposits `ratio` tokens, up to `max_tokens`, and
+/// every retry withdraws one. The budget starts full, so rare conflicts are
+/// always retried. Share one budget between every `db::with_retry` call
+/// site that hits the same database.
+class retry_budget {
+ public:
+    /// @param ratio Retries allowed per transaction run, e.g. `0.1` for 10%.
+    /// @param max_tokens Retries that may be made in a burst.
+    explicit retry_budget(double ratio = 0.1, std::uint32_t max_tokens = 10) noexcept
+      : m_deposit(static_cast<std::int64_t>(ratio * kScale)), m_max(static_cast<std::int64_t>(max_tokens) * kScale),
+        m_tokens(m_max) { }
+
+    retry_budget(const retry_budget&)            = delete;
+    retry_budget& operator=(const retry_budget&) = delete;
+
+    /// @brief Called once per transaction run.
+    void deposit() noexcept {
+        auto tokens = m_tokens.load(std::memory_order_relaxed);
+        while (tokens < m_max
+            && !m_tokens.compare_exchange_weak(tokens, std::min(tokens + m_deposit, m_max), std::memory_order_relaxed)) { }
+    }
+
+    /// @brief Takes a token for a retry.
+    /// @return Whether the retry is within the budget.
+    [[nodiscard]] auto try_withdraw() noexcept -> bool {
+        auto tokens = m_tokens.load(std::memory_order_relaxed);
+        while (tokens >= kScale) {
+            if (m_tokens.compare_exchange_weak(tokens, tokens - kScale, std::memory_order_relaxed)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+ private:
+    // tokens are counted in thousandths, so that fractional deposits add up
+    static constexpr std::int64_t kScale = 1000;
+
+    const std::int64_t m_deposit;
+    const std::int64_t m_max;
+    std::atomic<std::int64_t> m_tokens;
+};
+
+/// @brief When and how often `db::with_retry` runs a transaction again.
+struct retry_policy {
+    /// Runs of the transaction, including the first one.
+    std::uint32_t max_attempts{5};
+    /// The backoff before the first retry; it doubles with every retry.
+    std::chrono::milliseconds base_delay{5};
+    /// The backoff never exceeds this.
+    std::chrono::milliseconds max_delay{500};
+    /// Shared limit of retries, none if null. Must outlive every call using it.
+    retry_budget* budget{};
+};
+
+/// @brief Process-wide counters of `db::with_retry`.
+struct retry_stats {
+    /// Transactions run by `db::with_retry`, not counting retries.
+    std::uint64_t transactions{};
+    /// Retries after a serialization failure (SQLSTATE 40001).
+    std::uint64_t serialization_retries{};
+    /// Retries after a deadlock (SQLSTATE 40P01).
+    std::uint64_t deadlock_retries{};
+    /// Transactions that failed after `max_attempts` runs.
+    std::uint64_t exhausted{};
+    /// Retries not made because the retry budget or the deadline ran out.
+    std::uint64_t denied{};
+};
+
+namespace details {
+
+class retry_metrics {
+ public:
+    static auto instance() -> retry_metrics& {
+        static retry_metrics metrics{};
+        return metrics;
+    }
+
+    retry_metrics(const retry_metrics&)            = delete;
+    retry_metrics& operator=(const retry_metrics&) = delete;
+
+    [[nodiscard]] auto snapshot() const noexcept -> retry_stats {
+        return retry_stats{
+            .transactions          = transactions.load(std::memory_order_relaxed),
+            .serialization_retries = serialization_retries.load(std::memory_order_relaxed),
+            .deadlock_retries      = deadlock_retries.load(std::memory_order_relaxed),
+            .exhausted             = exhausted.load(std::memory_order_relaxed),
+            .denied                = denied.load(std::memory_order_relaxed),
+        };
+    }
+
+    std::atomic<std::uint64_t> transactions{};
+    std::atomic<std::uint64_t> serialization_retries{};
+    std::atomic<std::uint64_t> deadlock_retries{};
+    std::atomic<std::uint64_t> exhausted{};
+    std::atomic<std::uint64_t> denied{};
+
+ private:
+    retry_metrics() = default;
+};
+
+/// @brief The backoff before retry number `retry` (starting at 0): a uniformly
+///        random duration up to the exponentially growing cap ("full jitter"),
+///        so that conflicting transactions do not collide again in lockstep.
+inline auto retry_backoff(const retry_policy& policy, std::uint32_t retry) -> std::chrono::nanoseconds {
+    thread_local std::minstd_rand engine{std::random_device{}()};
+
+    const auto cap  = std::chrono::nanoseconds{policy.max_delay};
+    auto ceiling    = std::chrono::nanoseconds{policy.base_delay};
+    for (std::uint32_t i = 0; i < retry && ceiling < cap; ++i) {
+        ceiling *= 2;
+    }
+    ceiling = std::min(ceiling, cap);
+    std::uniform_int_distribution<std::int64_t> distribution{0, ceiling.count()};
+    return std::chrono::nanoseconds{distribution(engine)};
+}
+
+}  // namespace details
+
+/// @brief The counters of every `db::with_retry` call so far.
+inline auto retry_stats_snapshot() noexcept -> retry_stats {
+    return details::retry_metrics::instance().snapshot();
+}
+
+/// @brief Runs `body` in a transaction on a connection of `pool`, and runs it
+///        again when it fails with a serialization failure or a deadlock.
+///
+/// Under `SERIALIZABLE` and `REPEATABLE READ` isolation, concurrent
+/// transactions may be aborted by the server with SQLSTATE 40001 or 40P01,
+/// and are expected to be run again. `body` is called with the transaction
+/// and must do all of its work through it, since everything it did is
+/// rolled back before a retry; it may run several times. Retries back off
+/// exponentially with full jitter and stop after `policy.max_attempts`
+/// runs, when `policy.budget` is used up, or when the backoff would pass
+/// the deadline of the calling thread (see `db::deadline_scope`); the last
+/// error is rethrown then. The connection goes back to the pool during the
+/// backoff. Every other error is rethrown right away.
+///
+/// @tparam Isolation The isolation level of the transaction.
+/// @param pool The pool to borrow connections from.
+/// @param policy When to retry.
+/// @param body Called with the transaction; its result is returned after
+///             the transaction committed.
+/// @return The result of the successful run of `body`.
+///
+/// @example
+/// db::retry_budget budget{};
+/// const db::retry_policy policy{.max_attempts = 5, .budget = &budget};
+/// auto balance = db::with_retry(pool, policy, [&](auto& txn) {
+///   auto from = txn.template query_value<std::int64_t>("SELECT balance FROM accounts WHERE id = 1");
+///   txn.exec_params("UPDATE accounts SET balance = $1 WHERE id = 1", from - 10);
+///   txn.exec_params("UPDATE accounts SET balance = balance + 10 WHERE id = 2");
+///   return from - 10;
+/// });
+template <pqxx::isolation_level Isolation = pqxx::isolation_level::serializable, typename F>
+auto with_retry(connection_pool& pool, const retry_policy& policy, F&& body) {
+    using txn_t    = pqxx::transaction<Isolation>;
+    using result_t = std::invoke_result_t<F&, txn_t&>;
+
+    constexpr std::string_view kTransactionLabel = "with_retry transaction";
+
+    auto& metrics = details::retry_metrics::instance();
+    metrics.transactions.fetch_add(1, std::memory_order_relaxed);
+    if (policy.budget != nullptr) {
+        policy.budget->deposit();
+    }
+
+    for (std::uint32_t attempt = 1;; ++attempt) {
+        std::exception_ptr error{};
+        bool deadlock{};
+        try {
+            auto conn = pool.acquire();
+            txn_t txn{*conn};
+            if (const auto deadline = details::current_deadline()) {
+                details::limit_statement(txn, *deadline, kTransactionLabel);
+            }
+            if constexpr (std::is_void_v<result_t>) {
+                body(txn);
+                txn.commit();
+                return;
+            } else {
+                result_t result = body(txn);
+                txn.commit();
+                return result;
+            }
+        } catch (const pqxx::serialization_failure&) {
+            error = std::current_exception();
+        } catch (const pqxx::deadlock_detected&) {
+            error    = std::current_exception();
+            deadlock = true;
+        } catch (const pqxx::sql_error& ex) {
+            if (details::current_deadline() && details::is_query_canceled(ex)) {
+                throw deadline_exceeded{kTransactionLabel};
+            }
+            throw;
+        }
+
+        if (attempt >= policy.max_attempts) {
+            metrics.exhausted.fetch_add(1, std::memory_order_relaxed);
+            std::rethrow_exception(error);
+        }
+        const auto backoff  = details::retry_backoff(policy, attempt - 1);
+        const auto deadline = details::current_deadline();
+        if ((deadline && deadline_clock::now() + backoff >= *deadline)
+            || (policy.budget != nullptr && !policy.budget->try_withdraw())) {
+            metrics.denied.fetch_add(1, std::memory_order_relaxed);
+            std::rethrow_exception(error);
+        }
+        (deadlock ? metrics.deadlock_retries : metrics.serialization_retries).fetch_add(1, std::memory_order_relaxed);
+        std::this_thread::sleep_for(backoff);
+    }
+}
+
+}  // namespace db
@@ -0,0 +1,351 @@
+/*
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2024 Vladislav Nepogodin <vnepogodin@cachyos.org>
+ */
+#pragma once
+
+#include <db_wrap/db_api.hpp>
+#include <db_wrap/db_pool.hpp>
+
+#include <algorithm>           // for max
+#include <atomic>              // for atomic
+#include <chrono>              // for steady_clock, duration_cast
+#include <concepts>            // for same_as
+#include <condition_variable>  // for condition_variable_any
+#include <cstdint>             // for int64_t
+#include <limits>              // for numeric_limits
+#include <memory>              // for unique_ptr
+#include <mutex>               // for mutex, unique_lock
+#include <optional>            // for optional
+#include <stop_token>          // for stop_token
+#include <thread>              // for jthread
+#include <type_traits>         // for invoke_result_t
+#include <utility>             // for forward
+#include <vector>              // for vector
+
+#include <pqxx/pqxx>
+
+namespace db {
+
+/// @brief Tuning knobs for `db::router`.
+struct router_options {
+    /// Replicas lagging behind the primary by more than this are not used for reads.
+    std::chrono::milliseconds max_lag{1000};
+    /// How often the replication lag of every replica is re-measured. Also
+    /// how long a measurement waits for a connection of an exhausted replica pool.
+    std::chrono::milliseconds lag_refresh_interval{500};
+};
+
+/// @brief Routes reads to replica pools and writes to the primary pool.
+///
+/// The router keeps an estimate of the replication lag of every replica,
+/// obtained from `pg_last_xact_replay_timestamp()`. The estimate is refreshed
+/// by a background thread every `router_options::lag_refresh_interval`, or
+/// explicitly with `refresh_lag`, so reads never wait for a measurement,
+/// even of a replica that is down. Replicas that lag more than
+/// `router_options::max_lag`, whose lag could not be measured, or that do
+/// not stream WAL from the primary, are skipped, and reads fall back to the
+/// primary. Until the first measurement, all reads go to the primary.
+///
+/// Alongside the lag, the router records the WAL position every replica has
+/// replayed, which `db::session` uses to provide read-your-writes
+/// consistency. Reads issued directly on the router may observe stale data.
+///
+/// @example
+/// db::connection_pool primary{"postgresql://primary/app", 8};
+/// db::connection_pool replica{"postgresql://replica/app", 8};
+/// db::router router{primary, {&replica}};
+///
+/// auto users = db::get_all_records<User>(router);   // served by the replica
+/// db::insert_record(router, new_user);              // served by the primary
+class router {
+ public:
+    using clock = std::chrono::steady_clock;
+
+    router(connection_pool& primary, std::vector<connection_pool*> replicas, router_options options = {})
+      : m_primary(&primary), m_options(options) {
+        m_replicas.reserve(replicas.size());
+        for (auto* replica : replicas) {
+            m_replicas.emplace_back(std::make_unique<replica_state>(replica));
+        }
+        if (!m_replicas.empty()) {
+            m_worker = std::jthread{[this](std::stop_token stop) { run(stop); }};
+        }
+    }
+
+    router(const router&)            = delete;
+    router& operator=(const router&) = delete;
+
+    /// @brief The pool all writes go to.
+    [[nodiscard]] auto primary() const noexcept -> connection_pool& { return *m_primary; }
+
+    /// @brief The router configuration.
+    [[nodiscard]] auto options() const noexcept -> const router_options& { return m_options; }
+
+    /// @brief The number of configured replicas.
+    [[nodiscard]] auto replica_count() const noexcept -> std::size_t { return m_replicas.size(); }
+
+    /// @brief The last measured replication lag of the replica at `index`.
+    /// @return The lag, or `std::nullopt` if it is unknown or the replica is unreachable.
+    [[nodiscard]] auto replica_lag(std::size_t index) const -> std::optional<std::chrono::microseconds> {
+        const auto lag = m_replicas.at(index)->lag_us.load(std::memory_order_relaxed);
+        if (lag < 0) {
+            return std::nullopt;
+        }
+        return std::chrono::microseconds{lag};
+    }
+
+    /// @brief Measures the replication lag of every replica now, on the
+    ///        calling thread.
+    void refresh_lag() {
+        for (auto&& replica : m_replicas) {
+            measure(*replica);
+        }
+    }
+
+    /// @brief Picks a replica that has replayed the primary's WAL up to `min_lsn`.
+    ///
+    /// Replicas are tried round-robin. Only replicas with a known lag below
+    /// `router_options::max_lag` are considered.
+    ///
+    /// @param min_lsn The WAL position whose changes must be visible, or
+    ///                `std::nullopt` if any data within `max_lag` is fine.
+    /// @return The replica pool, or `nullptr` if reads must go to the primary.
+    auto pick_replica(std::optional<std::int64_t> min_lsn = std::nullopt) -> connection_pool* {
+        if (m_replicas.empty()) {
+            return nullptr;
+        }
+
+        const auto max_lag = std::chrono::duration_cast<std::chrono::microseconds>(m_options.max_lag).count();
+        const auto start   = m_next.fetch_add(1, std::memory_order_relaxed);
+        for (std::size_t i = 0; i < m_replicas.size(); ++i) {
+            auto& replica  = *m_replicas[(start + i) % m_replicas.size()];
+            const auto lag = replica.lag_us.load(std::memory_order_relaxed);
+            if (lag < 0 || lag > max_lag) {
+                continue;
+            }
+            if (min_lsn && replica.replay_lsn.load(std::memory_order_relaxed) < *min_lsn) {
+                continue;
+            }
+            return replica.pool;
+        }
+        return nullptr;
+    }
+
+    /// @brief Runs `func` with a connection from an eligible replica, or the primary.
+    ///
+    /// If the replica connection turns out to be broken, the replica is
+    /// marked as unusable until the next lag refresh and `func` is retried
+    /// on the primary. `func` must therefore be safe to run twice.
+    ///
+    /// @param func A callable taking `pqxx::connection&`.
+    /// @param min_lsn See `pick_replica`.
+    /// @return Whatever `func` returns.
+    template <typename F>
+    auto read(F&& func, std::optional<std::int64_t> min_lsn = std::nullopt) -> std::invoke_result_t<F, pqxx::connection&> {
+        if (auto* pool = pick_replica(min_lsn)) {
+            try {
+                auto conn = pool->acquire();
+                // NOTE: not forwarded, it may run again on the primary
+                return func(*conn);
+            } catch (const pqxx::broken_connection&) {
+                mark_unreachable(pool);
+            }
+        }
+        return write(std::forward<F>(func));
+    }
+
+    /// @brief Runs `func` with a connection from the primary.
+    /// @param func A callable taking `pqxx::connection&`.
+    /// @param written_lsn If not null, receives the primary's WAL position
+    ///                    after `func` returned.
+    /// @return Whatever `func` returns.
+    template <typename F>
+    auto write(F&& func, std::int64_t* written_lsn = nullptr) -> std::invoke_result_t<F, pqxx::connection&> {
+        auto conn = m_primary->acquire();
+        if constexpr (std::is_void_v<std::invoke_result_t<F, pqxx::connection&>>) {
+            std::forward<F>(func)(*conn);
+            track_lsn(*conn, written_lsn);
+        } else {
+            auto result = std::forward<F>(func)(*conn);
+            track_lsn(*conn, written_lsn);
+            return result;
+        }
+    }
+
+ private:
+    struct replica_state {
+        explicit replica_state(connection_pool* replica_pool) noexcept : pool(replica_pool) {}
+
+        connection_pool* pool;
+        /// Measured lag in microseconds, negative when unknown.
+        std::atomic<std::int64_t> lag_us{-1};
+        /// Replayed WAL position, as a byte offset.
+        std::atomic<std::int64_t> replay_lsn{0};
+    };
+
+    // NOTE: a streaming standby that has replayed all received WAL is considered up to date,
+    // otherwise `pg_last_xact_replay_timestamp()` would keep growing on an idle primary.
+    // A standby without a streaming WAL receiver has caught up with nothing, and is skipped.
+    // Roles without pg_read_all_stats see a NULL status, only whether a receiver runs.
+    static constexpr auto kReplicationLagQuery = R"~(
+SELECT CASE
+  WHEN NOT pg_is_in_recovery() THEN 0
+  WHEN NOT EXISTS (SELECT 1 FROM pg_stat_wal_receiver WHERE COALESCE(status, 'streaming') = 'streaming') THEN -1
+  WHEN pg_last_wal_receive_lsn() = pg_last_wal_replay_lsn() THEN 0
+  ELSE COALESCE((EXTRACT(EPOCH FROM (now() - pg_last_xact_replay_timestamp())) * 1000000)::bigint, -1)
+END,
+(COALESCE(pg_last_wal_replay_lsn(), pg_current_wal_lsn()) - '0/0'::pg_lsn)::bigint
+)~";
+
+    static constexpr auto kCurrentLsnQuery = "SELECT (pg_current_wal_lsn() - '0/0'::pg_lsn)::bigint";
+
+    static void track_lsn(pqxx::connection& conn, std::int64_t* written_lsn) noexcept {
+        if (written_lsn == nullptr) {
+            return;
+        }
+        try {
+            pqxx::nontransaction txn{conn};
+            *written_lsn = txn.query_value<std::int64_t>(kCurrentLsnQuery);
+        } catch (const std::exception&) {
+            // position unknown, no replica can prove it has caught up
+            *written_lsn = std::numeric_limits<std::int64_t>::max();
+        }
+    }
+
+    void run(const std::stop_token& stop) {
+        std::unique_lock lock{m_worker_mutex};
+        while (!stop.stop_requested()) {
+            lock.unlock();
+            refresh_lag();
+            lock.lock();
+            m_wakeup.wait_for(lock, stop, m_options.lag_refresh_interval, [] { return false; });
+        }
+    }
+
+    void measure(replica_state& replica) const noexcept {
+        try {
+            auto conn = replica.pool->try_acquire_for(m_options.lag_refresh_interval);
+            if (!conn) {
+                // the lag of an exhausted replica is unknown, not zero
+                replica.lag_us.store(-1, std::memory_order_relaxed);
+                return;
+            }
+            pqxx::nontransaction txn{**conn};
+            const auto row = txn.exec1(kReplicationLagQuery);
+
+            replica.replay_lsn.store(row[1].as<std::int64_t>(), std::memory_order_relaxed);
+            replica.lag_us.store(row[0].as<std::int64_t>(), std::memory_order_relaxed);
+        } catch (const std::exception&) {
+            replica.lag_us.store(-1, std::memory_order_relaxed);
+        }
+    }
+
+    void mark_unreachable(const connection_pool* pool) noexcept {
+        for (auto&& replica : m_replicas) {
+            if (replica->pool == pool) {
+                replica->lag_us.store(-1, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    connection_pool* m_primary;
+    router_options m_options;
+    std::vector<std::unique_ptr<replica_state>> m_replicas{};
+    std::atomic<std::size_t> m_next{0};
+
+    std::mutex m_worker_mutex{};
+    std::condition_variable_any m_wakeup{};
+    // NOTE: declared last, so it is started after and stopped before everything it uses
+    std::jthread m_worker{};
+};
+
+/// @brief A sequence of operations with read-your-writes consistency.
+///
+/// After every write a session records the primary's WAL position.
+/// Subsequent reads are only sent to replicas whose last measured replay
+/// position has passed it; until one has, reads are pinned to the primary.
+/// A session is cheap to create and is meant to live for the duration of
+/// one request. It is not thread-safe.
+///
+/// @example
+/// db::session session{router};
+/// db::update_record(session, user);
+/// auto fresh = db::find_by_id<User>(session, user.id);  // sees the update
+class session {
+ public:
+    explicit session(db::router& router) noexcept : m_router(&router) {}
+
+    /// @brief Runs `func` on a replica that has caught up with this session's writes.
+    template <typename F>
+    auto read(F&& func) -> std::invoke_result_t<F, pqxx::connection&> {
+        return m_router->read(std::forward<F>(func), m_written_lsn);
+    }
+
+    /// @brief Runs `func` on the primary and pins subsequent reads to it until replicas catch up.
+    template <typename F>
+    auto write(F&& func) -> std::invoke_result_t<F, pqxx::connection&> {
+        std::int64_t lsn{};
+        if constexpr (std::is_void_v<std::invoke_result_t<F, pqxx::connection&>>) {
+            m_router->write(std::forward<F>(func), &lsn);
+            m_written_lsn = std::max(lsn, m_written_lsn.value_or(0));
+        } else {
+            auto result   = m_router->write(std::forward<F>(func), &lsn);
+            m_written_lsn = std::max(lsn, m_written_lsn.value_or(0));
+            return result;
+        }
+    }
+
+    /// @brief The primary's WAL position after the last write of the session, if any.
+    [[nodiscard]] auto written_lsn() const noexcept -> std::optional<std::int64_t> { return m_written_lsn; }
+
+    /// @brief The router the session is bound to.
+    [[nodiscard]] auto router() const noexcept -> db::router& { return *m_router; }
+
+ private:
+    db::router* m_router;
+    std::optional<std::int64_t> m_written_lsn{};
+};
+
+/// @brief Concept for the routing front ends accepted by the `db_api.hpp` overloads below.
+template <typename T>
+concept Routing = std::same_as<T, db::router> || std::same_as<T, db::session>;
+
+/// @brief Routed variant of `db::find_by_id`, served by a replica when possible.
+template <sql::details::HasSchemeAndId Scheme, Routing Route, typename IdType = Scheme::id>
+auto find_by_id(Route& route, IdType&& id) -> std::optional<Scheme> {
+    return route.read([&](pqxx::connection& conn) { return db::find_by_id<Scheme>(conn, id); });
+}
+
+/// @brief Routed variant of `db::get_all_records`, served by a replica when possible.
+template <sql::details::HasSchemeAndId Scheme, Routing Route>
+auto get_all_records(Route& route) -> std::optional<std::vector<Scheme>> {
+    return route.read([](pqxx::connection& conn) { return db::get_all_records<Scheme>(conn); });
+}
+
+/// @brief Routed variant of `db::update_fields`, always served by the primary.
+template <sql::details::HasSchemeAndId Scheme, ::db::details::static_string... Fields, Routing Route>
+auto update_fields(Route& route, const Scheme& record) -> std::size_t {
+    return route.write([&](pqxx::connection& conn) { return db::update_fields<Scheme, Fields...>(conn, record); });
+}
+
+/// @brief Routed variant of `db::delete_record_by_id`, always served by the primary.
+template <sql::details::HasSchemeAndId Scheme, Routing Route, typename IdType = Scheme::id>
+auto delete_record_by_id(Route& route, IdType&& id) -> std::size_t {
+    return route.write([&](pqxx::connection& conn) { return db::delete_record_by_id<Scheme>(conn, id); });
+}
+
+/// @brief Routed variant of `db::update_record`, always served by the primary.
+template <sql::details::HasSchemeAndId Scheme, Routing Route>
+auto update_record(Route& route, const Scheme& record) -> std::size_t {
+    return route.write([&](pqxx::connection& conn) { return db::update_record<Scheme>(conn, record); });
+}
+
+/// @brief Routed variant of `db::insert_record`, always served by the primary.
+template <sql::details::HasSchemeAndId Scheme, Routing Route>
+auto insert_record(Route& route, const Scheme& record) -> std::size_t {
+    return route.write([&](pqxx::connection& conn) { return db::insert_record<Scheme>(conn, record); });
+}
+
+}  // namespace db
@@ -0,0 +1,263 @@
+/*
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2024 Vladislav Nepogodin <vnepogodin@cachyos.org>
+ */
+#pragma once
+
+#include <db_wrap/db_api.hpp>
+#include <db_wrap/db_deadline.hpp>
+#include <db_wrap/db_pool.hpp>
+
+#include <algorithm>    // for ranges::move
+#include <concepts>     // for integral
+#include <cstdint>      // for uint64_t
+#include <future>       // for async, future
+#include <iterator>     // for back_inserter
+#include <optional>     // for optional
+#include <ranges>       // for ranges::*
+#include <string_view>  // for string_view
+#include <type_traits>  // for invoke_result_t
+#include <utility>      // for forward, move
+#include <vector>       // for vector
+
+#include <pqxx/pqxx>
+
+namespace db {
+
+/// @brief Default shard function of `db::sharded`.
+///
+/// Maps an ID to a shard with a hash that is stable across platforms and
+/// library versions, so the placement of rows never depends on the build.
+/// Integral IDs go through the splitmix64 finalizer, which spreads
+/// consecutive IDs evenly; textual IDs (including `db::uuids::uuid`) are
+/// hashed with 64-bit FNV-1a.
+struct hash_shard {
+    template <std::integral Id>
+    constexpr auto operator()(Id id, std::size_t shard_count) const noexcept -> std::size_t {
+        auto hash = static_cast<std::uint64_t>(id);
+        hash      = (hash ^ (hash >> 30U)) * 0xbf58476d1ce4e5b9ULL;
+        hash      = (hash ^ (hash >> 27U)) * 0x94d049bb133111ebULL;
+        hash ^= hash >> 31U;
+        return static_cast<std::size_t>(hash % shard_count);
+    }
+
+    constexpr auto operator()(std::string_view id, std::size_t shard_count) const noexcept -> std::size_t {
+        std::uint64_t hash{0xcbf29ce484222325ULL};
+        for (const char chr : id) {
+            hash ^= static_cast<std::uint8_t>(chr);
+            hash *= 0x100000001b3ULL;
+        }
+        return static_cast<std::size_t>(hash % shard_count);
+    }
+
+    template <std::ranges::contiguous_range Id>
+        requires std::same_as<std::ranges::range_value_t<Id>, char> && (!std::convertible_to<const Id&, std::string_view>)
+    constexpr auto operator()(const Id& id, std::size_t shard_count) const noexcept -> std::size_t {
+        return (*this)(std::string_view{std::ranges::data(id), std::ranges::size(id)}, shard_count);
+    }
+};
+
+/// @brief Front end over a set of databases that are sharded by entity ID.
+///
+/// Every shard is served by its own `db::connection_pool`. Calls addressing
+/// a single record are routed to the shard chosen by `ShardFn` from the
+/// record ID; calls spanning several shards are scattered to them in
+/// parallel and their results gathered, so the latency is that of the
+/// slowest shard instead of the sum of all of them.
+///
+/// @tparam ShardFn Callable `(const Id&, std::size_t shard_count) -> std::size_t`.
+///
+/// @example
+/// std::vector<db::connection_pool*> pools{&shard0, &shard1, &shard2, &shard3};
+/// db::sharded shards{pools};
+///
+/// auto user  = db::find_by_id<User>(shards, 42);          // one shard
+/// auto users = db::find_by_ids<User>(shards, ids);        // scatter-gather
+/// auto all   = db::get_all_records<User>(shards);         // every shard
+template <typename ShardFn = hash_shard>
+class sharded {
+ public:
+    explicit sharded(std::vector<connection_pool*> shards, ShardFn shard_fn = {})
+      : m_shards(std::move(shards)), m_shard_fn(std::move(shard_fn)) {}
+
+    /// @brief The number of shards.
+    [[nodiscard]] auto shard_count() const noexcept -> std::size_t { return m_shards.size(); }
+
+    /// @brief The pool of the shard at `index`.
+    [[nodiscard]] auto shard(std::size_t index) const -> connection_pool& { return *m_shards.at(index); }
+
+    /// @brief The index of the shard owning `id`.
+    template <typename Id>
+    [[nodiscard]] auto shard_of(const Id& id) const -> std::size_t {
+        return m_shard_fn(id, m_shards.size());
+    }
+
+    /// @brief Runs `func` with a connection to the shard owning `id`.
+    /// @param func A callable taking `pqxx::connection&`.
+    template <typename Id, typename F>
+    auto on_shard_of(const Id& id, F&& func) -> std::invoke_result_t<F, pqxx::connection&> {
+        auto conn = shard(shard_of(id)).acquire();
+        return std::forward<F>(func)(*conn);
+    }
+
+    /// @brief Runs `func` on every shard in parallel.
+    /// @param func A callable taking `(pqxx::connection&, std::size_t shard_index)`.
+    /// @return The results of `func`, indexed by shard.
+    template <typename F>
+    auto scatter(F&& func) {
+        std::vector<std::size_t> indices(m_shards.size());
+        for (std::size_t i = 0; i < indices.size(); ++i) {
+            indices[i] = i;
+        }
+        return scatter(indices, std::forward<F>(func));
+    }
+
+    /// @brief Runs `func` on the shards listed in `indices` in parallel.
+    ///
+    /// The first shard is served on the calling thread, every other one on
+    /// its own thread. The deadline of the calling thread (see
+    /// `db::deadline_scope`) applies on every shard. If `func` throws on any
+    /// shard, the exception is rethrown after all shards have finished.
+    ///
+    /// @param indices The shard indices to run on.
+    /// @param func A callable taking `(pqxx::connection&, std::size_t shard_index)`.
+    /// @return The results of `func`, in the order of `indices`.
+    template <typename F>
+    auto scatter(const std::vector<std::size_t>& indices, F&& func) {
+        using result_t = std::invoke_result_t<F&, pqxx::connection&, std::size_t>;
+        static_assert(!std::is_void_v<result_t>, "scatter requires a non-void result");
+
+        // the deadline is thread local, so it is carried over to every shard thread
+        const auto deadline = details::current_deadline();
+
+        auto run_on = [this, &func, deadline](std::size_t index) -> result_t {
+            const deadline_scope scope{deadline.value_or(deadline_clock::time_point::max())};
+            auto conn = shard(index).acquire();
+            return func(*conn, index);
+        };
+
+        std::vector<result_t> results{};
+        if (indices.empty()) {
+            return results;
+        }
+        results.reserve(indices.size());
+
+        std::vector<std::future<result_t>> pending{};
+        pending.reserve(indices.size() - 1);
+        for (std::size_t i = 1; i < indices.size(); ++i) {
+            pending.emplace_back(std::async(std::launch::async, run_on, indices[i]));
+        }
+        // NOTE: futures returned by std::async join in their destructor,
+        // so nothing referenced by `run_on` can dangle if this throws
+        results.emplace_back(run_on(indices.front()));
+        for (auto&& result : pending) {
+            results.emplace_back(result.get());
+        }
+        return results;
+    }
+
+ private:
+    std::vector<connection_pool*> m_shards;
+    ShardFn m_shard_fn;
+};
+
+namespace details {
+template <typename T>
+struct is_sharded : std::false_type {};
+template <typename ShardFn>
+struct is_sharded<sharded<ShardFn>> : std::true_type {};
+
+/// @brief Concatenates the per-shard results of a scatter into one vector.
+template <typename T>
+auto merge_shard_results(std::vector<std::vector<T>>&& per_shard) -> std::vector<T> {
+    std::size_t total{};
+    for (auto&& part : per_shard) {
+        total += part.size();
+    }
+
+    std::vector<T> merged{};
+    merged.reserve(total);
+    for (auto&& part : per_shard) {
+        std::ranges::move(part, std::back_inserter(merged));
+    }
+    return merged;
+}
+}  // namespace details
+
+/// @brief Concept satisfied by every `db::sharded` specialization.
+template <typename T>
+concept Sharding = details::is_sharded<T>::value;
+
+/// @brief Sharded variant of `db::find_by_id`, served by the shard owning `id`.
+template <sql::details::HasSchemeAndId Scheme, Sharding Shards, typename IdType = Scheme::id>
+auto find_by_id(Shards& shards, IdType&& id) -> std::optional<Scheme> {
+    return shards.on_shard_of(id, [&](pqxx::connection& conn) { return db::find_by_id<Scheme>(conn, id); });
+}
+
+/// @brief Sharded variant of `db::find_by_ids`.
+///
+/// The IDs are grouped by shard, and every involved shard is queried in
+/// parallel with a single `id = ANY($1)` query.
+template <sql::details::HasSchemeAndId Scheme, Sharding Shards, std::ranges::input_range Ids>
+auto find_by_ids(Shards& shards, Ids&& ids) -> std::vector<Scheme> {
+    std::vector<std::vector<sql::details::id_field_t<Scheme>>> ids_by_shard(shards.shard_count());
+    for (auto&& id : ids) {
+        const sql::details::id_field_t<Scheme> shard_id(id);
+        ids_by_shard[shards.shard_of(shard_id)].emplace_back(shard_id);
+    }
+
+    std::vector<std::size_t> involved{};
+    for (std::size_t i = 0; i < ids_by_shard.size(); ++i) {
+        if (!ids_by_shard[i].empty()) {
+            involved.emplace_back(i);
+        }
+    }
+
+    auto per_shard = shards.scatter(involved, [&ids_by_shard](pqxx::connection& conn, std::size_t index) {
+        return db::find_by_ids<Scheme>(conn, ids_by_shard[index]);
+    });
+    return details::merge_shard_results(std::move(per_shard));
+}
+
+/// @brief Sharded variant of `db::get_all_records`, merging the records of all shards.
+/// @return The records of every shard, or `std::nullopt` if all shards are empty.
+template <sql::details::HasSchemeAndId Scheme, Sharding Shards>
+auto get_all_records(Shards& shards) -> std::optional<std::vector<Scheme>> {
+    auto per_shard = shards.scatter([](pqxx::connection& conn, std::size_t) {
+        return db::get_all_records<Scheme>(conn).value_or(std::vector<Scheme>{});
+    });
+
+    auto records = details::merge_shard_results(std::move(per_shard));
+    if (records.empty()) {
+        return std::nullopt;
+    }
+    return records;
+}
+
+/// @brief Sharded variant of `db::update_fields`, served by the shard owning `record.id`.
+template <sql::details::HasSchemeAndId Scheme, ::db::details::static_string... Fields, Sharding Shards>
+auto update_fields(Shards& shards, const Scheme& record) -> std::size_t {
+    return shards.on_shard_of(record.id,
+        [&](pqxx::connection& conn) { return db::update_fields<Scheme, Fields...>(conn, record); });
+}
+
+/// @brief Sharded variant of `db::delete_record_by_id`, served by the shard owning `id`.
+template <sql::details::HasSchemeAndId Scheme, Sharding Shards, typename IdType = Scheme::id>
+auto delete_record_by_id(Shards& shards, IdType&& id) -> std::size_t {
+    return shards.on_shard_of(id, [&](pqxx::connection& conn) { return db::delete_record_by_id<Scheme>(conn, id); });
+}
+
+/// @brief Sharded variant of `db::update_record`, served by the shard owning `record.id`.
+template <sql::details::HasSchemeAndId Scheme, Sharding Shards>
+auto update_record(Shards& shards, const Scheme& record) -> std::size_t {
+    return shards.on_shard_of(record.id, [&](pqxx::connection& conn) { return db::update_record<Scheme>(conn, record); });
+}
+
+/// @brief Sharded variant of `db::insert_record`, served by the shard owning `record.id`.
+template <sql::details::HasSchemeAndId Scheme, Sharding Shards>
+auto insert_record(Shards& shards, const Scheme& record) -> std::size_t {
+    return shards.on_shard_of(record.id, [&](pqxx::connection& conn) { return db::insert_record<Scheme>(conn, record); });
+}
+
+}  // namespace db
@@ -0,0 +1,455 @@
+/*
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2024 Vladislav Nepogodin <vnepogodin@cachyos.org>
+ */
+#pragma once
+
+#include <db_wrap/db_sync.hpp>
+#include <db_wrap/details/pfr_utils.hpp>
+#include <db_wrap/details/sql_impl.hpp>
+#include <db_wrap/details/static_string.hpp>
+
+#include <algorithm>    // for max
+#include <array>        // for array
+#include <cstddef>      // for size_t, byte
+#include <cstdint>      // for uint8_t, uint32_t, uint64_t
+#include <cstring>      // for memcpy
+#include <filesystem>   // for path, rename
+#include <fstream>      // for ofstream
+#include <limits>       // for numeric_limits
+#include <optional>     // for optional
+#include <span>         // for span
+#include <string>       // for string
+#include <string_view>  // for string_view
+#include <type_traits>  // for is_trivially_copyable_v, remove_cvref_t
+#include <utility>      // for exchange, index_sequence
+#include <vector>       // for vector
+
+#include <fcntl.h>     // for open
+#include <sys/mman.h>  // for mmap, munmap
+#include <sys/stat.h>  // for fstat
+#include <unistd.h>    // for close
+
+#include <pqxx/pqxx>
+
+namespace db {
+
+namespace details {
+
+/// How a field is stored in a snapshot file.
+enum class snapshot_slot : std::uint8_t {
+    /// The bytes of the value, for trivially copyable types.
+    raw,
+    /// Offset and size of the text in the string arena.
+    text,
+    /// Like `text`, with a size of `kNullText` for `std::nullopt`.
+    optional_text,
+};
+
+inline constexpr std::uint64_t kNullText = std::numeric_limits<std::uint64_t>::max();
+
+template <typename T>
+consteval auto snapshot_slot_of() noexcept -> snapshot_slot {
+    if constexpr (std::is_same_v<T, std::string>) {
+        return snapshot_slot::text;
+    } else if constexpr (std::is_same_v<T, std::optional<std::string>>) {
+        return snapshot_slot::optional_text;
+    } else {
+        static_assert(std::is_trivially_copyable_v<T>,
+            "snapshot fields must be trivially copyable, std::string or std::optional<std::string>");
+        return snapshot_slot::raw;
+    }
+}
+
+template <typename T>
+consteval auto snapshot_slot_size() noexcept -> std::size_t {
+    return details::snapshot_slot_of<T>() == snapshot_slot::raw ? sizeof(T) : 2 * sizeof(std::uint64_t);
+}
+
+template <typename Scheme, std::size_t Idx>
+using snapshot_field_t
+    = std::remove_cvref_t<decltype(utils::details::flat_field_ref<Idx>(std::declval<Scheme&>()))>;
+
+/// @brief The offsets of the flattened fields of `Scheme` in a row of a
+///        snapshot file; the last element is the size of a row.
+template <typename Scheme>
+consteval auto snapshot_layout() noexcept {
+    constexpr auto kCount = utils::get_struct_names<Scheme>().size();
+    return []<std::size_t... I>(std::index_sequence<I...>) {
+        std::array<std::size_t, kCount + 1> offsets{};
+        std::size_t offset{};
+        ((offsets[I] = offset, offset += details::snapshot_slot_size<snapshot_field_t<Scheme, I>>()), ...);
+        offsets[kCount] = offset;
+        return offsets;
+    }(std::make_index_sequence<kCount>{});
+}
+
+/// @brief The name of `T` as spelled by the compiler, e.g. in
+///        `auto db::details::snapshot_type_name() [with T = long int]`.
+///
+/// Only meant to tell types apart: the text differs between compilers, and
+/// so do the hashes of snapshots written by them.
+template <typename T>
+consteval auto snapshot_type_name() noexcept -> std::string_view {
+#if defined(_MSC_VER) && !defined(__clang__)
+    return __FUNCSIG__;
+#else
+    return __PRETTY_FUNCTION__;
+#endif
+}
+
+/// @brief A hash of the name, field names and field types of `Scheme`, so
+///        that a snapshot written for another layout is rejected.
+template <typename Scheme>
+consteval auto snapshot_schema_hash() noexcept -> std::uint64_t {
+    // FNV-1a
+    std::uint64_t hash = 14695981039346656037ULL;
+    auto mix = [&hash](std::string_view text) {
+        for (const char c : text) {
+            hash ^= static_cast<std::uint8_t>(c);
+            hash *= 1099511628211ULL;
+        }
+        hash ^= 0xff;
+        hash *= 1099511628211ULL;
+    };
+    auto mix_number = [&hash](std::uint64_t value) {
+        for (int i = 0; i < 8; ++i) {
+            hash ^= (value >> (i * 8)) & 0xff;
+            hash *= 1099511628211ULL;
+        }
+    };
+
+    mix(Scheme::kName);
+    constexpr auto kNames = utils::get_struct_names<Scheme>();
+    [&]<std::size_t... I>(std::index_sequence<I...>) {
+        ([&] {
+            using field_t = snapshot_field_t<Scheme, I>;
+            mix(kNames[I]);
+            mix(details::snapshot_type_name<field_t>());
+            mix_number(static_cast<std::uint64_t>(details::snapshot_slot_of<field_t>()));
+            mix_number(sizeof(field_t));
+            mix_number(alignof(field_t));
+            mix_number(std::is_floating_point_v<field_t> ? 2 : (std::is_signed_v<field_t> ? 1 : 0));
+        }(), ...);
+    }(std::make_index_sequence<kNames.size()>{});
+    return hash;
+}
+
+/// @brief The header at the start of a snapshot file.
+struct snapshot_header {
+    static constexpr std::array<char, 8> kMagic{'D', 'B', 'W', 'S', 'N', 'A', 'P', '\0'};
+    static constexpr std::uint32_t kFormatVersion = 1;
+    static constexpr std::size_t kWatermarkSize = 16;
+
+    std::array<char, 8> magic;
+    std::uint32_t format_version;
+    std::uint32_t row_size;
+    std::uint64_t schema_hash;
+    std::uint64_t row_count;
+    std::uint64_t rows_offset;
+    std::uint64_t arena_offset;
+    std::uint64_t arena_size;
+    std::uint8_t has_watermark;
+    std::array<std::uint8_t, 7> reserved;
+    std::array<std::byte, kWatermarkSize> watermark;
+};
+
+}  // namespace details
+
+/// @brief A row of a `db::mapped_snapshot`, read in place.
+template <typename Scheme>
+class snapshot_row {
+ public:
+    snapshot_row(const std::byte* data, std::string_view arena) noexcept : m_data(data), m_arena(arena) { }
+
+    /// @brief Reads the field `Field`: text fields as `std::string_view`
+    ///        (or `std::optional<std::string_view>`) pointing into the
+    ///        mapped file, every other field by value.
+    template <::db::details::static_string Field>
+    [[nodiscard]] auto get() const {
+        constexpr auto kIdx = utils::get_field_idx_by_name<Field, Scheme>();
+        static_assert(kIdx < utils::get_fields_count<Scheme>(), "field is not a field of the scheme");
+        return read<kIdx>();
+    }
+
+    /// @brief Copies the row into a `Scheme`.
+    [[nodiscard]] auto load() const -> Scheme {
+        Scheme record{};
+        [&]<std::size_t... I>(std::index_sequence<I...>) {
+            ((utils::details::flat_field_ref<I>(record) = field_value<I>()), ...);
+        }(std::make_index_sequence<utils::get_struct_names<Scheme>().size()>{});
+        return record;
+    }
+
+ private:
+    template <std::size_t Idx>
+    [[nodiscard]] auto read() const {
+        using field_t         = details::snapshot_field_t<Scheme, Idx>;
+        constexpr auto kSlot  = details::snapshot_slot_of<field_t>();
+        const std::byte* slot = m_data + details::snapshot_layout<Scheme>()[Idx];
+        if constexpr (kSlot == details::snapshot_slot::raw) {
+            field_t value;
+            std::memcpy(&value, slot, sizeof(field_t));
+            return value;
+        } else {
+            std::uint64_t offset{};
+            std::uint64_t size{};
+            std::memcpy(&offset, slot, sizeof(offset));
+            std::memcpy(&size, slot + sizeof(offset), sizeof(size));
+            if constexpr (kSlot == details::snapshot_slot::optional_text) {
+                if (size == details::kNullText) {
+                    return std::optional<std::string_view>{};
+                }
+                return std::optional<std::string_view>{text(offset, size)};
+            } else {
+                return text(offset, size);
+            }
+        }
+    }
+
+    template <std::size_t Idx>
+    [[nodiscard]] auto field_value() const -> details::snapshot_field_t<Scheme, Idx> {
+        using field_t = details::snapshot_field_t<Scheme, Idx>;
+        if constexpr (std::is_same_v<field_t, std::optional<std::string>>) {
+            const auto value = read<Idx>();
+            return value ? std::optional<std::string>{std::string{*value}} : std::nullopt;
+        } else {
+            return field_t(read<Idx>());
+        }
+    }
+
+    [[nodiscard]] auto text(std::uint64_t offset, std::uint64_t size) const -> std::string_view {
+        if (offset > m_arena.size() || size > m_arena.size() - offset) {
+            throw pqxx::failure{"snapshot: text out of bounds of the string arena"};
+        }
+        return m_arena.substr(static_cast<std::size_t>(offset), static_cast<std::size_t>(size));
+    }
+
+    const std::byte* m_data;
+    std::string_view m_arena;
+};
+
+/// @brief Writes `rows` to a snapshot file at `path` that
+///        `db::mapped_snapshot` maps back without parsing.
+///
+/// Fields are stored as their bytes and strings in an arena after the
+/// rows, so every field of `Scheme` must be trivially copyable, a
+/// `std::string` or a `std::optional<std::string>`. The file records a
+/// hash of the layout of `Scheme` and is replaced atomically. The bytes
+/// are in the native byte order, so snapshots are only for the machine
+/// type they were written on.
+///
+/// @param path Where to write the snapshot.
+/// @param rows The rows to store.
+/// @param watermark The `db::sync_since` watermark the rows are current
+///                  up to, to continue with a delta sync after loading.
+/// @throws std::ios_base::failure if the file could not be written.
+template <sql::details::HasSchemeAndId Scheme>
+void write_snapshot(const std::filesystem::path& path, std::span<const Scheme> rows,
+    const std::optional<watermark_t<Scheme>>& watermark = std::nullopt) {
+    using watermark_type = watermark_t<Scheme>;
+    static_assert(std::is_trivially_copyable_v<watermark_type>
+            && sizeof(watermark_type) <= details::snapshot_header::kWatermarkSize,
+        "the watermark of the scheme cannot be stored in a snapshot");
+
+    constexpr auto kLayout  = details::snapshot_layout<Scheme>();
+    constexpr auto kRowSize = kLayout.back();
+
+    std::vector<std::byte> row_bytes(rows.size() * kRowSize);
+    std::string arena{};
+    for (std::size_t row = 0; row < rows.size(); ++row) {
+        std::byte* dest = row_bytes.data() + row * kRowSize;
+        auto write_text = [](std::byte* slot, std::uint64_t offset, std::uint64_t size) {
+            std::memcpy(slot, &offset, sizeof(offset));
+            std::memcpy(slot + sizeof(offset), &size, sizeof(size));
+        };
+        [&]<std::size_t... I>(std::index_sequence<I...>) {
+            ([&] {
+                using field_t         = details::snapshot_field_t<Scheme, I>;
+                constexpr auto kSlot  = details::snapshot_slot_of<field_t>();
+                const auto& value     = utils::details::flat_field_ref<I>(rows[row]);
+                std::byte* slot       = dest + kLayout[I];
+                if constexpr (kSlot == details::snapshot_slot::raw) {
+                    std::memcpy(slot, &value, sizeof(field_t));
+                } else if constexpr (kSlot == details::snapshot_slot::optional_text) {
+                    if (!value) {
+                        write_text(slot, 0, details::kNullText);
+                        return;
+                    }
+                    write_text(slot, arena.size(), value->size());
+                    arena += *value;
+                } else {
+                    write_text(slot, arena.size(), value.size());
+                    arena += value;
+                }
+            }(), ...);
+        }(std::make_index_sequence<kLayout.size() - 1>{});
+    }
+
+    details::snapshot_header header{};
+    header.magic          = details::snapshot_header::kMagic;
+    header.format_version = details::snapshot_header::kFormatVersion;
+    header.row_size       = static_cast<std::uint32_t>(kRowSize);
+    header.schema_hash    = details::snapshot_schema_hash<Scheme>();
+    header.row_count      = rows.size();
+    header.rows_offset    = sizeof(details::snapshot_header);
+    header.arena_offset   = header.rows_offset + row_bytes.size();
+    header.arena_size     = arena.size();
+    if (watermark) {
+        header.has_watermark = 1;
+        std::memcpy(header.watermark.data(), &*watermark, sizeof(watermark_type));
+    }
+
+    auto tmp_path = path;
+    tmp_path += ".tmp";
+    {
+        std::ofstream file{tmp_path, std::ios::binary | std::ios::trunc};
+        file.exceptions(std::ios::failbit | std::ios::badbit);
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(row_bytes.data()), static_cast<std::streamsize>(row_bytes.size()));
+        file.write(arena.data(), static_cast<std::streamsize>(arena.size()));
+    }
+    std::filesystem::rename(tmp_path, path);
+}
+
+/// @brief A snapshot file written by `db::write_snapshot`, mapped into
+///        memory and read in place.
+///
+/// Opening a snapshot only checks its header, so a table of any size is
+/// usable right away, and pages are read from disk as rows are touched.
+/// Snapshots written for a different layout of `Scheme` or format are
+/// rejected, so a service falls back to loading the table after its
+/// Schemes changed.
+///
+/// @example
+/// std::unordered_map<std::int64_t, Price> prices{};
+/// std::optional<db::watermark_t<Price>> watermark{};
+/// if (auto snapshot = db::mapped_snapshot<Price>::open("prices.snap")) {
+///   for (std::size_t i = 0; i < snapshot->size(); ++i) {
+///     auto price = snapshot->row(i).load();
+///     prices.emplace(price.id, std::move(price));
+///   }
+///   watermark = snapshot->watermark();
+/// }
+/// watermark = db::sync_since<Price>(conn, watermark, prices);
+///
+/// std::vector<Price> rows{};
+/// for (auto&& [id, price] : prices) {
+///   rows.emplace_back(price);
+/// }
+/// db::write_snapshot<Price>("prices.snap", rows, watermark);
+template <sql::details::HasSchemeAndId Scheme>
+class mapped_snapshot {
+ public:
+    /// @brief Maps the snapshot at `path`.
+    /// @return The snapshot, or `std::nullopt` if the file does not exist,
+    ///         was written for another layout of `Scheme`, or is truncated.
+    static auto open(const std::filesystem::path& path) -> std::optional<mapped_snapshot> {
+        const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return std::nullopt;
+        }
+        struct stat info{};
+        if (::fstat(fd, &info) != 0 || static_cast<std::size_t>(info.st_size) < sizeof(details::snapshot_header)) {
+            ::close(fd);
+            return std::nullopt;
+        }
+        const auto size = static_cast<std::size_t>(info.st_size);
+        void* data      = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        // the mapping stays valid after the descriptor is closed
+        ::close(fd);
+        if (data == MAP_FAILED) {
+            return std::nullopt;
+        }
+
+        mapped_snapshot snapshot{static_cast<const std::byte*>(data), size};
+        if (!snapshot.valid()) {
+            return std::nullopt;
+        }
+        return snapshot;
+    }
+
+    mapped_snapshot(mapped_snapshot&& other) noexcept
+      : m_data(std::exchange(other.m_data, nullptr)), m_size(std::exchange(other.m_size, 0)), m_header(other.m_header) { }
+
+    mapped_snapshot& operator=(mapped_snapshot&& other) noexcept {
+        if (this != &other) {
+            unmap();
+            m_data   = std::exchange(other.m_data, nullptr);
+            m_size   = std::exchange(other.m_size, 0);
+            m_header = other.m_header;
+        }
+        return *this;
+    }
+
+    mapped_snapshot(const mapped_snapshot&)            = delete;
+    mapped_snapshot& operator=(const mapped_snapshot&) = delete;
+
+    ~mapped_snapshot() { unmap(); }
+
+    [[nodiscard]] auto size() const noexcept -> std::size_t { return static_cast<std::size_t>(m_header.row_count); }
+    [[nodiscard]] auto empty() const noexcept -> bool { return size() == 0; }
+
+    /// @brief The row at `index`, which must be less than `size()`.
+    [[nodiscard]] auto row(std::size_t index) const noexcept -> snapshot_row<Scheme> {
+        return {m_data + m_header.rows_offset + index * kRowSize, arena()};
+    }
+
+    /// @brief Copies every row into `Scheme`s.
+    [[nodiscard]] auto load_all() const -> std::vector<Scheme> {
+        std::vector<Scheme> records{};
+        records.reserve(size());
+        for (std::size_t i = 0; i < size(); ++i) {
+            records.emplace_back(row(i).load());
+        }
+        return records;
+    }
+
+    /// @brief The watermark the snapshot was written with.
+    [[nodiscard]] auto watermark() const noexcept -> std::optional<watermark_t<Scheme>> {
+        if (m_header.has_watermark == 0) {
+            return std::nullopt;
+        }
+        watermark_t<Scheme> value;
+        std::memcpy(&value, m_header.watermark.data(), sizeof(value));
+        return value;
+    }
+
+ private:
+    static constexpr auto kRowSize = details::snapshot_layout<Scheme>().back();
+
+    mapped_snapshot(const std::byte* data, std::size_t size) noexcept : m_data(data), m_size(size) {
+        std::memcpy(&m_header, data, sizeof(m_header));
+    }
+
+    [[nodiscard]] auto valid() const noexcept -> bool {
+        const auto& header = m_header;
+        if (header.magic != details::snapshot_header::kMagic
+            || header.format_version != details::snapshot_header::kFormatVersion || header.row_size != kRowSize
+            || header.schema_hash != details::snapshot_schema_hash<Scheme>()) {
+            return false;
+        }
+        // every section must lie within the file
+        const auto rows_bytes = header.row_count * kRowSize;
+        return header.row_count <= m_size / std::max<std::size_t>(kRowSize, 1) && header.rows_offset <= m_size
+            && rows_bytes <= m_size - header.rows_offset && header.arena_offset <= m_size
+            && header.arena_size <= m_size - header.arena_offset;
+    }
+
+    [[nodiscard]] auto arena() const noexcept -> std::string_view {
+        return {reinterpret_cast<const char*>(m_data + m_header.arena_offset), static_cast<std::size_t>(m_header.arena_size)};
+    }
+
+    void unmap() noexcept {
+        if (m_data != nullptr) {
+            ::munmap(const_cast<std::byte*>(m_data), m_size);
+        }
+    }
+
+    const std::byte* m_data;
+    std::size_t m_size;
+    details::snapshot_header m_header{};
+};
+
+}  // namespace db
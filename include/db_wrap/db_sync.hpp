@@ -0,0 +1,215 @@
+/*
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2024 Vladislav Nepogodin <vnepogodin@cachyos.org>
+ */
+#pragma once
+
+#include <db_wrap/db_deadline.hpp>
+#include <db_wrap/db_utils.hpp>
+#include <db_wrap/details/pfr_utils.hpp>
+#include <db_wrap/details/sql_impl.hpp>
+#include <db_wrap/details/static_string.hpp>
+
+#include <algorithm>    // for find
+#include <concepts>     // for convertible_to
+#include <cstdint>      // for int64_t
+#include <iterator>     // for distance
+#include <optional>     // for optional
+#include <string_view>  // for string_view
+#include <type_traits>  // for remove_cvref_t, is_invocable_v
+#include <utility>      // for move
+
+#include <pqxx/pqxx>
+
+namespace db {
+
+namespace details {
+
+/// @brief Concept that checks if a type names the column tracking when its
+///        rows last changed with a static member `kWatermarkField`, e.g. an
+///        `updated_at` timestamp or a sequence number set on every write.
+template <typename T>
+concept HasWatermarkField = requires {
+    { T::kWatermarkField } -> std::convertible_to<std::string_view>;
+};
+
+/// @brief The index of the watermark field of `Scheme` among its fields.
+template <HasWatermarkField Scheme>
+consteval auto watermark_field_idx() noexcept -> std::size_t {
+    constexpr auto struct_fields = utils::get_struct_names<Scheme>();
+    // NOTE: apparently ranges::find cannot handle array of std::common_type_t at compile time
+    return static_cast<std::size_t>(std::distance(struct_fields.begin(),
+        std::find(struct_fields.begin(), struct_fields.end(), std::string_view{Scheme::kWatermarkField})));
+}
+
+/// Transaction IDs further apart than this cannot be ordered through their
+/// 32-bit form.
+inline constexpr std::int64_t kXidHorizon = std::int64_t{1} << 31;
+
+template <typename Scheme>
+struct watermark_type {
+    /// A 64-bit transaction ID, which unlike the 32-bit `xmin` system column
+    /// never wraps around.
+    using type = std::int64_t;
+};
+
+template <HasWatermarkField Scheme>
+struct watermark_type<Scheme> {
+    static_assert(details::watermark_field_idx<Scheme>() < utils::get_fields_count<Scheme>(),
+        "watermark field is not a field of the scheme");
+    using type = std::remove_cvref_t<decltype(utils::details::flat_field_ref<details::watermark_field_idx<Scheme>()>(
+        std::declval<Scheme&>()))>;
+};
+
+/// @brief Constructs the query fetching the rows of `Scheme` changed since
+///        the watermark `$1`, or every row if `Delta` is false.
+///
+/// @example
+/// static_assert(db::details::construct_sync_query<Price, true>()
+///     == "SELECT * FROM prices WHERE updated_at >= $1 ORDER BY updated_at;");
+/// static_assert(db::details::construct_sync_query<Country, true>()
+///     == "SELECT * FROM countries WHERE age(xmin) <= age(($1 % 4294967296)::text::xid);");
+template <sql::details::HasName Scheme, bool Delta>
+consteval auto construct_sync_query() noexcept {
+    constexpr auto kDbName = []() {
+        constexpr std::string_view db_name_str = Scheme::kName;
+        static_string<db_name_str.size()> res{};
+        res += db_name_str;
+        return res;
+    }();
+
+    constexpr auto kStatementBegin = static_string("SELECT * FROM ") + kDbName;
+    if constexpr (HasWatermarkField<Scheme>) {
+        constexpr auto kColumn = []() {
+            constexpr std::string_view column_str = Scheme::kWatermarkField;
+            static_string<column_str.size()> res{};
+            res += column_str;
+            return res;
+        }();
+        constexpr auto kOrderBy = static_string(" ORDER BY ") + kColumn + static_string(";");
+        if constexpr (Delta) {
+            return kStatementBegin + static_string(" WHERE ") + kColumn + static_string(" >= $1") + kOrderBy;
+        } else {
+            return kStatementBegin + kOrderBy;
+        }
+    } else if constexpr (Delta) {
+        // age() orders 32-bit transaction IDs modulo 2^32, so wraparound is harmless
+        return kStatementBegin + static_string(" WHERE age(xmin) <= age(($1 % 4294967296)::text::xid);");
+    } else {
+        return kStatementBegin + static_string(";");
+    }
+}
+
+/// @brief Hands a fetched row to the container of `db::sync_since`.
+template <typename Scheme, typename Container>
+void apply_synced(Container& dest, Scheme&& record) {
+    if constexpr (std::is_invocable_v<Container&, Scheme&&>) {
+        dest(std::move(record));
+    } else {
+        auto id = record.id;
+        dest.insert_or_assign(std::move(id), std::move(record));
+    }
+}
+
+}  // namespace details
+
+/// @brief The type of the watermark of `Scheme` in `db::sync_since`: the
+///        type of its watermark field, or the `xmin` transaction ID.
+template <sql::details::HasSchemeAndId Scheme>
+using watermark_t = typename details::watermark_type<Scheme>::type;
+
+/// @brief Fetches the rows of `Scheme` that changed since `watermark` and
+///        applies them to `dest`.
+///
+/// If `Scheme` names a watermark column with `kWatermarkField`, e.g. an
+/// `updated_at` timestamp or a sequence bumped on every write, the rows
+/// whose column is at least `watermark` are fetched, and the largest value
+/// fetched is the new watermark. Rows at exactly the watermark are fetched
+/// again, so that rows written at the same instant by a later transaction
+/// are not missed. The column should be indexed. A transaction that sets
+/// an older value and commits after a sync is missed, so the column should
+/// be set at commit time or the watermark taken with some lag.
+///
+/// Without such a column, the `xmin` system column, the transaction that
+/// last wrote the row, is used. The new watermark is the oldest transaction
+/// still running when the rows were read, as a 64-bit transaction ID, so
+/// that transactions in flight during a sync are fetched by the next one.
+/// `xmin` holds only the low 32 bits, which wrap around, so rows are
+/// compared with the watermark by their `age()`, which is wraparound safe
+/// as long as the watermark is less than 2^31 transactions old; an older
+/// watermark fetches every row again. Rows frozen by `VACUUM FREEZE` since
+/// the last sync are missed. `xmin` cannot be indexed, so each sync scans
+/// the table, but only the changed rows are sent.
+///
+/// Deleted rows are not seen either way: use soft deletes or a
+/// `db::change_feed` where deletions matter.
+///
+/// @tparam Scheme The type representing the table.
+/// @param conn The pqxx::connection object representing the database connection.
+/// @param watermark The watermark returned by the previous sync, or
+///                  `std::nullopt` to fetch every row.
+/// @param dest A map keyed by ID, into which rows are `insert_or_assign`ed,
+///             or a callable taking each row.
+/// @return The watermark to pass to the next sync; `watermark` if no row
+///         changed.
+/// @throws db::deadline_exceeded if the deadline passed before the rows were read.
+///
+/// @example
+/// struct Price {
+///   static constexpr std::string_view kName = "prices";
+///   static constexpr std::string_view kWatermarkField = "revision";
+///   std::int64_t id;
+///   std::int64_t amount;
+///   std::int64_t revision;
+/// };
+///
+/// std::unordered_map<std::int64_t, Price> prices{};
+/// std::optional<db::watermark_t<Price>> watermark{};
+/// while (running) {
+///   watermark = db::sync_since<Price>(conn, watermark, prices);
+///   std::this_thread::sleep_for(std::chrono::minutes{1});
+/// }
+template <sql::details::HasSchemeAndId Scheme, typename Container>
+auto sync_since(pqxx::connection& conn, const std::optional<watermark_t<Scheme>>& watermark, Container&& dest)
+    -> std::optional<watermark_t<Scheme>> {
+    constexpr auto kFullQuery  = details::construct_sync_query<Scheme, false>();
+    constexpr auto kDeltaQuery = details::construct_sync_query<Scheme, true>();
+
+    std::optional<watermark_t<Scheme>> next = watermark;
+    pqxx::result result{};
+    try {
+        // both statements must see the same snapshot for the xmin watermark
+        pqxx::transaction<pqxx::isolation_level::repeatable_read> txn{conn};
+        if (const auto deadline = details::current_deadline()) {
+            details::limit_statement(txn, *deadline, kDeltaQuery);
+        }
+
+        if constexpr (details::HasWatermarkField<Scheme>) {
+            result = watermark ? txn.exec_params(kDeltaQuery.data(), *watermark) : txn.exec(kFullQuery.data());
+        } else {
+            constexpr std::string_view kSnapshotQuery = "SELECT pg_snapshot_xmin(pg_current_snapshot())::text::bigint;";
+            next = txn.query_value<watermark_t<Scheme>>(kSnapshotQuery.data());
+            // too old a watermark cannot be compared with xmin any more
+            const bool full = !watermark || *next < *watermark || *next - *watermark >= details::kXidHorizon;
+            result          = full ? txn.exec(kFullQuery.data()) : txn.exec_params(kDeltaQuery.data(), *watermark);
+        }
+        txn.commit();
+    } catch (const pqxx::sql_error& ex) {
+        if (details::current_deadline() && details::is_query_canceled(ex)) {
+            throw deadline_exceeded{kDeltaQuery};
+        }
+        throw;
+    }
+
+    for (auto&& record : utils::extract_all_rows<Scheme>(std::move(result))) {
+        if constexpr (details::HasWatermarkField<Scheme>) {
+            // rows are ordered by the watermark column
+            next = utils::details::flat_field_ref<details::watermark_field_idx<Scheme>()>(record);
+        }
+        details::apply_synced(dest, std::move(record));
+    }
+    return next;
+}
+
+}  // namespace db
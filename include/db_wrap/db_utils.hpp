@@ -5,10 +5,19 @@
  */
 #pragma once
 
+#include <db_wrap/alloc_accounting.hpp>
+#include <db_wrap/db_deadline.hpp>
+#include <db_wrap/db_error.hpp>
+#include <db_wrap/details/scheme_layout.hpp>
+#include <db_wrap/details/pfr_utils.hpp>
+#include <db_wrap/details/query_metrics.hpp>
+#include <db_wrap/details/query_monitor.hpp>
 #include <db_wrap/details/sql_impl.hpp>
+#include <db_wrap/details/statement_registry.hpp>
 #include <db_wrap/details/unpack_fields_impl.hpp>
 
 #include <algorithm>    // for transform
+#include <chrono>       // for steady_clock, system_clock
 #include <optional>     // for optional
 #include <ranges>       // for ranges::*
 #include <string_view>  // for string_view
@@ -25,15 +34,17 @@ namespace db::utils {
 ///
 /// This function utilizes Boost.PFR to iterate over the fields of the
 /// user-defined type `T` and extract the corresponding values from the
-/// `pqxx::row`.
+/// `pqxx::row`. Members of nested aggregates are read from prefixed
+/// columns (see `utils::NestedField`).
 ///
 /// @tparam T The type to convert the row to.
 /// @param row The pqxx::row to convert.
 /// @return An object of type `T` filled with the data from the row.
+/// @throws pqxx::conversion_error if a column cannot be converted to its field.
 template <typename T>
-constexpr T from_row(pqxx::row&& row) noexcept {
+constexpr T from_row(pqxx::row&& row) {
     T obj{};
-    boost::pfr::for_each_field_with_name(obj, [&](std::string_view field_name, auto& field) {
+    utils::for_each_flat_field(obj, [&](std::string_view field_name, auto& field) {
         field = row[pqxx::zview(field_name)].as<std::decay_t<decltype(field)>>();
     });
     return obj;
@@ -52,8 +63,8 @@ constexpr T from_row(pqxx::row&& row) noexcept {
 template <typename T>
 constexpr T from_columns(pqxx::row&& row) {
     T obj{};
-    boost::pfr::for_each_field(obj, [&](auto& field, std::size_t index) {
-        field = row[index].as<std::decay_t<decltype(field)>>();
+    utils::for_each_flat_field(obj, [&row, index = pqxx::row::size_type{}](std::string_view, auto& field) mutable {
+        field = row[index++].as<std::decay_t<decltype(field)>>();
     });
     return obj;
 }
@@ -63,20 +74,125 @@ constexpr T from_columns(pqxx::row&& row) {
 ///
 /// This function iterates through all rows in the `pqxx::result` and uses
 /// the `from_row` function to convert each row to an object of type `T`.
-/// The converted objects are stored in a vector.
+/// The converted objects are stored in a vector. If the layout of `T` was
+/// verified with `db::verify_schemes` and the columns of the result are in
+/// field order, `from_columns` is used instead.
 ///
 /// @tparam T The type to convert each row to.
 /// @param result The pqxx::result containing the rows.
 /// @return A vector of objects of type `T` representing the extracted rows.
+/// @throws pqxx::conversion_error if a column cannot be converted to its field.
 template <typename T>
-constexpr auto extract_all_rows(pqxx::result&& result) noexcept -> std::vector<T> {
+constexpr auto extract_all_rows(pqxx::result&& result) -> std::vector<T> {
+    const db::details::alloc_scope<T> accounting{db::details::alloc_phase::rows, static_cast<std::size_t>(result.size())};
+
     std::vector<T> rows{};
     rows.reserve(static_cast<std::size_t>(result.size()));
+    if (db::details::decodes_by_position<T>(result)) {
+        std::ranges::transform(result, std::back_inserter(rows),
+            [](auto&& row) { return utils::from_columns<T>(std::move(row)); });
+        return rows;
+    }
     std::ranges::transform(result, std::back_inserter(rows),
         [](auto&& row) { return utils::from_row<T>(std::move(row)); });
     return rows;
 }
 
+/// @brief Executes a query in its own transaction, as a prepared statement
+///        if it was registered.
+///
+/// If the query was registered in the `db::details::statement_registry`
+/// (see `db::register_schemes`), it is executed as a named prepared
+/// statement, which skips parsing and planning on the server. A connection
+/// on which the statement does not exist yet, e.g. after a reconnect,
+/// prepares it on first use and retries. Any other query is executed with
+/// `exec_params`. While a `db::deadline_scope` is active on the calling
+/// thread, the statement is limited to the time left with a transaction
+/// local `statement_timeout`.
+///
+/// @tparam Args The types of the query parameters.
+/// @param conn The pqxx::connection object representing the database connection.
+/// @param query The SQL query to execute.
+/// @param args The parameters for the SQL query.
+/// @return The result of the query. The transaction is already committed.
+/// @throws db::deadline_exceeded if the deadline passed before the query finished.
+template <typename... Args>
+auto exec_statement(pqxx::connection& conn, std::string_view query, Args&&... args) -> pqxx::result {
+    const auto deadline = db::details::current_deadline();
+    auto begin          = [&](pqxx::work& txn) {
+        if (deadline) {
+            db::details::limit_statement(txn, *deadline, query);
+        }
+    };
+
+    const auto* statement = db::details::statement_registry::instance().find(query);
+    try {
+        if (statement == nullptr) {
+            pqxx::work txn(conn);
+            begin(txn);
+            pqxx::result result = txn.exec_params(query.data(), std::forward<Args>(args)...);
+            txn.commit();
+            return result;
+        }
+
+        try {
+            pqxx::work txn(conn);
+            begin(txn);
+            pqxx::result result = txn.exec_prepared(statement->name, args...);
+            txn.commit();
+            return result;
+        } catch (const pqxx::invalid_sql_statement_name&) {
+            // connection was not warmed up, prepare the statement and run it again
+            conn.prepare(statement->name, statement->query);
+        }
+        pqxx::work txn(conn);
+        begin(txn);
+        pqxx::result result = txn.exec_prepared(statement->name, std::forward<Args>(args)...);
+        txn.commit();
+        return result;
+    } catch (const pqxx::sql_error& ex) {
+        if (deadline && db::details::is_query_canceled(ex)) {
+            throw db::deadline_exceeded{query};
+        }
+        throw;
+    }
+}
+
+/// @brief Executes a query in its own transaction and returns the result.
+///
+/// The query is run by `utils::exec_statement`. While a slow query log is
+/// installed (see `db::slow_query_log`), the query is timed and reported to
+/// it if it took longer than the log's threshold. While query metrics are
+/// enabled (see `db::enable_query_metrics`), its latency and result size are
+/// recorded in `db::details::query_metrics`.
+///
+/// @tparam Args The types of the query parameters.
+/// @param conn The pqxx::connection object representing the database connection.
+/// @param query The SQL query to execute.
+/// @param args The parameters for the SQL query.
+/// @return The result of the query. The transaction is already committed.
+template <typename... Args>
+auto exec_in_transaction(pqxx::connection& conn, std::string_view query, Args&&... args) -> pqxx::result {
+    auto& metrics = db::details::query_metrics::instance();
+    auto listener = db::details::query_monitor::instance().listener();
+    if (listener == nullptr && !metrics.enabled()) [[likely]] {
+        return utils::exec_statement(conn, query, std::forward<Args>(args)...);
+    }
+
+    const auto started_at = std::chrono::system_clock::now();
+    const auto start      = std::chrono::steady_clock::now();
+    // NOTE: the arguments are passed on as lvalues, so they can still be reported afterwards
+    pqxx::result result = utils::exec_statement(conn, query, args...);
+    const auto elapsed  = std::chrono::steady_clock::now() - start;
+    if (metrics.enabled()) {
+        metrics.record(query, elapsed, result);
+    }
+    if (listener != nullptr && elapsed >= listener->threshold()) {
+        listener->on_slow_query(db::details::make_slow_query(query, elapsed, started_at, args...));
+    }
+    return result;
+}
+
 /// @brief Retrieves a single row from the database and converts it to the
 ///        specified type.
 ///
@@ -114,14 +230,16 @@ constexpr auto extract_all_rows(pqxx::result&& result) noexcept -> std::vector<T
 /// }
 template <typename T, typename... Args>
 auto one_row_as(pqxx::connection& conn, std::string_view query, Args&&... args) -> std::optional<T> {
-    pqxx::work txn(conn);
-    pqxx::result result = txn.exec_params(query.data(), std::forward<Args>(args)...);
+    const db::details::alloc_scope<T> accounting{db::details::alloc_phase::call};
+    pqxx::result result = utils::exec_in_transaction(conn, query, std::forward<Args>(args)...);
 
     if (result.empty()) {
         return std::nullopt;
     }
-    // end our transaction and return
-    txn.commit();
+    const db::details::alloc_scope<T> row_accounting{db::details::alloc_phase::rows, 1};
+    if (db::details::decodes_by_position<T>(result)) {
+        return utils::from_columns<T>(result[0]);
+    }
     return utils::from_row<T>(result[0]);
 }
 
@@ -167,14 +285,12 @@ auto one_row_as(pqxx::connection& conn, std::string_view query, Args&&... args)
 /// }
 template <typename T, typename... Args>
 auto as_set_of(pqxx::connection& conn, std::string_view query, Args&&... args) -> std::optional<std::vector<T>> {
-    pqxx::work txn(conn);
-    pqxx::result result = txn.exec_params(query.data(), std::forward<Args>(args)...);
+    const db::details::alloc_scope<T> accounting{db::details::alloc_phase::call};
+    pqxx::result result = utils::exec_in_transaction(conn, query, std::forward<Args>(args)...);
 
     if (result.empty()) {
         return std::nullopt;
     }
-    // end our transaction and return
-    txn.commit();
     return utils::extract_all_rows<T>(std::move(result));
 }
 
@@ -199,11 +315,7 @@ auto as_set_of(pqxx::connection& conn, std::string_view query, Args&&... args) -
 /// std::cout << "Deleted " << deleted_rows << " rows." << std::endl;
 template <typename... Args>
 auto exec_affected(pqxx::connection& conn, std::string_view query, Args&&... args) -> std::size_t {
-    pqxx::work txn(conn);
-    pqxx::result result = txn.exec_params(query.data(), std::forward<Args>(args)...);
-
-    // end our transaction and return
-    txn.commit();
+    pqxx::result result = utils::exec_in_transaction(conn, query, std::forward<Args>(args)...);
     return static_cast<std::size_t>(result.affected_rows());
 }
 
@@ -246,4 +358,50 @@ auto exec_affected(pqxx::connection& conn, std::string_view query, const Scheme&
     return db::utils::unpack_fields(std::move(unroll_func), record);
 }
 
+/// @brief Like `utils::one_row_as`, but returns failures as a `db::error`
+///        instead of throwing them.
+///
+/// Meant for hot paths where failures are routine, e.g. constraint
+/// violations: the exception thrown by libpqxx is caught right where it is
+/// thrown, and the SQLSTATE is classified into `db::error::kind`.
+///
+/// @return The row as with `utils::one_row_as`, or the error.
+///
+/// @example
+/// auto user = db::utils::try_one_row_as<User>(conn, "SELECT * FROM users WHERE id = $1", 1);
+/// if (!user) {
+///   log_error(user.error().message);
+/// } else if (*user) {
+///   std::cout << "User Name: " << (*user)->name << std::endl;
+/// }
+template <typename T, typename... Args>
+auto try_one_row_as(pqxx::connection& conn, std::string_view query, Args&&... args)
+    -> expected<std::optional<T>, db::error> {
+    return db::details::capture_error([&] { return utils::one_row_as<T>(conn, query, std::forward<Args>(args)...); });
+}
+
+/// @brief Like `utils::as_set_of`, but returns failures as a `db::error`
+///        instead of throwing them (see `utils::try_one_row_as`).
+template <typename T, typename... Args>
+auto try_as_set_of(pqxx::connection& conn, std::string_view query, Args&&... args)
+    -> expected<std::optional<std::vector<T>>, db::error> {
+    return db::details::capture_error([&] { return utils::as_set_of<T>(conn, query, std::forward<Args>(args)...); });
+}
+
+/// @brief Like `utils::exec_affected`, but returns failures as a `db::error`
+///        instead of throwing them (see `utils::try_one_row_as`).
+template <typename... Args>
+auto try_exec_affected(pqxx::connection& conn, std::string_view query, Args&&... args)
+    -> expected<std::size_t, db::error> {
+    return db::details::capture_error([&] { return utils::exec_affected(conn, query, std::forward<Args>(args)...); });
+}
+
+/// @brief Like `utils::exec_affected` with a record, but returns failures as
+///        a `db::error` instead of throwing them (see `utils::try_one_row_as`).
+template <sql::details::HasName Scheme>
+auto try_exec_affected(pqxx::connection& conn, std::string_view query, const Scheme& record)
+    -> expected<std::size_t, db::error> {
+    return db::details::capture_error([&] { return utils::exec_affected<Scheme>(conn, query, record); });
+}
+
 }  // namespace db::utils
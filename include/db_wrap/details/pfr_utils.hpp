@@ -7,41 +7,190 @@
 
 #include <db_wrap/details/static_string.hpp>
 
-#include <algorithm>    // for find
+#include <algorithm>    // for find, ranges::copy
+#include <array>        // for array
 #include <iterator>     // for distance
-#include <type_traits>  // for remove_cvref_t
+#include <ranges>       // for ranges::range
+#include <string>       // for string
+#include <string_view>  // for string_view
+#include <type_traits>  // for remove_cvref_t, is_aggregate_v
+#include <utility>      // for index_sequence, pair
+#include <vector>       // for vector
 
 #include <boost/pfr/core.hpp>
 #include <boost/pfr/core_name.hpp>
 
+#include <pqxx/pqxx>
+
 namespace db::utils {
 
-/// @brief Retrieves the names of the members of a structure as a
-///        `boost::pfr::flat_names_array`.
+/// @brief Concept satisfied by field types that are flattened into columns.
 ///
-/// This function uses Boost.PFR to extract the names of the members
-/// of the given structure type `T` and returns them as a
-/// `boost::pfr::flat_names_array`.
+/// A nested aggregate, such as `Address addr`, has no column of its own;
+/// each of its members maps to a column named after the member, prefixed by
+/// the name of the field holding it and an underscore (`addr_city`). The
+/// flattening is recursive. Ranges such as `std::array`, and aggregates
+/// libpqxx can convert, i.e. with a `pqxx::string_traits` specialization,
+/// are columns of their own and are not flattened. That specialization must
+/// be declared before the aggregate is used in a scheme.
+template <typename T>
+concept NestedField = std::is_class_v<T> && std::is_aggregate_v<T> && !std::ranges::range<T>
+    && !requires { pqxx::string_traits<T>::from_string(std::string_view{}); };
+
+namespace details {
+
+template <typename T>
+consteval auto flat_fields_count() noexcept -> std::size_t;
+
+/// @brief The number of columns a field of type `T` maps to.
+template <typename T>
+consteval auto flat_field_width() noexcept -> std::size_t {
+    if constexpr (NestedField<T>) {
+        return details::flat_fields_count<T>();
+    } else {
+        return 1;
+    }
+}
+
+template <typename T>
+consteval auto flat_fields_count() noexcept -> std::size_t {
+    return []<std::size_t... I>(std::index_sequence<I...>) {
+        return (std::size_t{} + ... + details::flat_field_width<std::remove_cvref_t<boost::pfr::tuple_element_t<I, T>>>());
+    }(std::make_index_sequence<boost::pfr::tuple_size_v<T>>{});
+}
+
+template <typename T>
+constexpr void collect_flat_names(std::vector<std::string>& dest, std::string_view prefix) {
+    constexpr auto names = boost::pfr::names_as_array<T>();
+    [&]<std::size_t... I>(std::index_sequence<I...>) {
+        ([&] {
+            using field_t = std::remove_cvref_t<boost::pfr::tuple_element_t<I, T>>;
+            std::string name{prefix};
+            name += names[I];
+            if constexpr (NestedField<field_t>) {
+                name += '_';
+                details::collect_flat_names<field_t>(dest, name);
+            } else {
+                dest.emplace_back(std::move(name));
+            }
+        }(), ...);
+    }(std::make_index_sequence<boost::pfr::tuple_size_v<T>>{});
+}
+
+/// All flattened names of `T`, concatenated.
+template <typename T>
+inline constexpr auto kFlatNamesText = [] {
+    constexpr auto kSize = [] {
+        std::vector<std::string> names{};
+        details::collect_flat_names<T>(names, {});
+        std::size_t size{};
+        for (auto&& name : names) {
+            size += name.size();
+        }
+        return size;
+    }();
+
+    std::array<char, kSize> text{};
+    std::vector<std::string> names{};
+    details::collect_flat_names<T>(names, {});
+    std::size_t pos{};
+    for (auto&& name : names) {
+        std::ranges::copy(name, text.begin() + static_cast<std::ptrdiff_t>(pos));
+        pos += name.size();
+    }
+    return text;
+}();
+
+template <typename T>
+inline constexpr auto kFlatNames = [] {
+    std::array<std::string_view, details::flat_fields_count<T>()> result{};
+    std::vector<std::string> names{};
+    details::collect_flat_names<T>(names, {});
+    std::size_t pos{};
+    for (std::size_t i = 0; i < names.size(); ++i) {
+        result[i] = std::string_view{kFlatNamesText<T>.data() + pos, names[i].size()};
+        pos += names[i].size();
+    }
+    return result;
+}();
+
+/// @brief Finds the top-level field holding the flattened field `idx`.
+/// @return The index of the top-level field and `idx` relative to it.
+template <typename T, std::size_t idx>
+consteval auto locate_flat_field() noexcept -> std::pair<std::size_t, std::size_t> {
+    std::size_t begin{};
+    std::pair<std::size_t, std::size_t> result{};
+    [&]<std::size_t... I>(std::index_sequence<I...>) {
+        ([&] {
+            constexpr auto count = details::flat_field_width<std::remove_cvref_t<boost::pfr::tuple_element_t<I, T>>>();
+            if (idx >= begin && idx < begin + count) {
+                result = {I, idx - begin};
+            }
+            begin += count;
+        }(), ...);
+    }(std::make_index_sequence<boost::pfr::tuple_size_v<T>>{});
+    return result;
+}
+
+/// @brief Reference to the flattened field `idx` of `val`.
+template <std::size_t idx, typename T>
+constexpr auto flat_field_ref(T& val) noexcept -> auto& {
+    using struct_t          = std::remove_cvref_t<T>;
+    constexpr auto location = details::locate_flat_field<struct_t, idx>();
+    using field_t           = std::remove_cvref_t<boost::pfr::tuple_element_t<location.first, struct_t>>;
+    if constexpr (NestedField<field_t>) {
+        return details::flat_field_ref<location.second>(boost::pfr::get<location.first>(val));
+    } else {
+        return boost::pfr::get<location.first>(val);
+    }
+}
+
+}  // namespace details
+
+/// @brief Retrieves the column names of the members of a structure.
+///
+/// The names are those of the members of the given structure type `T`,
+/// with nested aggregates flattened into prefixed names (see
+/// `NestedField`). For structures without nested aggregates, these are
+/// exactly the member names reported by Boost.PFR.
 ///
 /// @tparam T The structure type.
-/// @return A `boost::pfr::flat_names_array` containing the member names.
+/// @return A `std::array` of `std::string_view` containing the column names.
 template <typename T>
 consteval auto get_struct_names() noexcept {
-    return boost::pfr::names_as_array<std::remove_cvref_t<T>>();
+    return details::kFlatNames<std::remove_cvref_t<T>>;
 }
 
 /// @brief Retrieves the number of fields in a structure at compile time.
 ///
 /// This function uses Boost.PFR to determine the number of fields in the
-/// structure type `T` at compile time. It's useful for scenarios where
-/// the number of fields needs to be known during compilation, such as
-/// generating SQL queries or performing static assertions.
+/// structure type `T` at compile time, counting the members of nested
+/// aggregates instead of the aggregates themselves. It's useful for
+/// scenarios where the number of fields needs to be known during
+/// compilation, such as generating SQL queries or performing static
+/// assertions.
 ///
 /// @tparam T The structure type.
 /// @return The number of fields in the structure.
 template <typename T>
 consteval auto get_fields_count() noexcept -> std::size_t {
-    return boost::pfr::tuple_size_v<std::remove_cvref_t<T>>;
+    return details::flat_fields_count<std::remove_cvref_t<T>>();
+}
+
+/// @brief Calls `func(name, field)` for every flattened field of a structure.
+///
+/// The counterpart of `boost::pfr::for_each_field_with_name` that descends
+/// into nested aggregates. The traversal is unrolled at compile time.
+///
+/// @param val The structure object.
+/// @param func A callable taking `(std::string_view name, auto& field)`.
+template <typename T, typename F>
+constexpr void for_each_flat_field(T& val, F&& func) {
+    using struct_t        = std::remove_cvref_t<T>;
+    constexpr auto kNames = utils::get_struct_names<struct_t>();
+    [&]<std::size_t... I>(std::index_sequence<I...>) {
+        (func(kNames[I], details::flat_field_ref<I>(val)), ...);
+    }(std::make_index_sequence<kNames.size()>{});
 }
 
 /// @brief Gets the index of a field in a structure by its name.
@@ -71,7 +220,7 @@ consteval auto get_field_idx_by_name() noexcept -> std::size_t {
 /// @return The value of the field at the given index.
 template <std::size_t idx>
 constexpr auto get_field_by_idx(auto&& val) noexcept {
-    return boost::pfr::get<idx>(val);
+    return details::flat_field_ref<idx>(val);
 }
 
 /// @brief Gets a field from a structure by its name.
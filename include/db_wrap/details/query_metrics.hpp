@@ -0,0 +1,150 @@
+/*
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2024 Vladislav Nepogodin <vnepogodin@cachyos.org>
+ */
+#pragma once
+
+#include <db_wrap/details/statement_registry.hpp>
+
+#include <array>        // for array
+#include <atomic>       // for atomic
+#include <chrono>       // for nanoseconds, microseconds
+#include <cstddef>      // for size_t
+#include <cstdint>      // for uint64_t
+#include <string>       // for string
+#include <string_view>  // for string_view
+
+#include <pqxx/pqxx>
+
+namespace db::details {
+
+/// Upper bounds of the latency histogram buckets, from 0.5ms to 10s.
+inline constexpr std::array<std::chrono::microseconds, 14> kLatencyBuckets{
+    std::chrono::microseconds{500},
+    std::chrono::microseconds{1'000},
+    std::chrono::microseconds{2'500},
+    std::chrono::microseconds{5'000},
+    std::chrono::microseconds{10'000},
+    std::chrono::microseconds{25'000},
+    std::chrono::microseconds{50'000},
+    std::chrono::microseconds{100'000},
+    std::chrono::microseconds{250'000},
+    std::chrono::microseconds{500'000},
+    std::chrono::microseconds{1'000'000},
+    std::chrono::microseconds{2'500'000},
+    std::chrono::microseconds{5'000'000},
+    std::chrono::microseconds{10'000'000},
+};
+
+/// @brief Latency histogram and result volume of a single query.
+struct query_histogram {
+    /// The `query_hash` of the query, `0` while the slot is free.
+    std::atomic<std::uint64_t> key{};
+    /// The query text, published once the slot was claimed.
+    std::atomic<const std::string*> query{};
+    /// Per bucket (not cumulative) counts; the last one is `+Inf`.
+    std::array<std::atomic<std::uint64_t>, kLatencyBuckets.size() + 1> buckets{};
+    std::atomic<std::uint64_t> count{};
+    std::atomic<std::uint64_t> sum_ns{};
+    std::atomic<std::uint64_t> rows{};
+    std::atomic<std::uint64_t> bytes{};
+};
+
+/// @brief Sums the size of every field of a result, i.e. the text decoded.
+inline auto result_bytes(const pqxx::result& result) noexcept -> std::uint64_t {
+    std::uint64_t bytes{};
+    const auto columns = result.columns();
+    for (pqxx::result::size_type row = 0; row < result.size(); ++row) {
+        for (pqxx::row::size_type column = 0; column < columns; ++column) {
+            bytes += static_cast<std::uint64_t>(result[row][column].size());
+        }
+    }
+    return bytes;
+}
+
+/// @brief Process-wide latency histograms of the queries run by `db::utils`.
+///
+/// Recording never takes a lock: queries are assigned a slot of a fixed
+/// open-addressing table by their hash with a single compare-and-swap on
+/// first use, and every counter is a relaxed atomic. Queries beyond the
+/// capacity of the table are counted together under `kOverflowQuery`.
+/// Recording is off until `enable` is called.
+class query_metrics {
+ public:
+    static constexpr std::size_t kCapacity          = 256;
+    static constexpr std::string_view kOverflowQuery = "other";
+
+    /// @brief The process-wide metrics.
+    static auto instance() -> query_metrics& {
+        static query_metrics metrics{};
+        return metrics;
+    }
+
+    query_metrics(const query_metrics&)            = delete;
+    query_metrics& operator=(const query_metrics&) = delete;
+
+    ~query_metrics() {
+        for (auto&& slot : m_slots) {
+            delete slot.query.load(std::memory_order_acquire);
+        }
+    }
+
+    void enable(bool enabled) noexcept { m_enabled.store(enabled, std::memory_order_relaxed); }
+    [[nodiscard]] auto enabled() const noexcept -> bool { return m_enabled.load(std::memory_order_relaxed); }
+
+    /// @brief Records a finished query.
+    void record(std::string_view query, std::chrono::nanoseconds elapsed, const pqxx::result& result) {
+        auto& slot = slot_of(query);
+
+        const auto micros = std::chrono::duration_cast<std::chrono::microseconds>(elapsed);
+        std::size_t bucket{};
+        while (bucket < kLatencyBuckets.size() && micros > kLatencyBuckets[bucket]) {
+            ++bucket;
+        }
+        slot.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+        slot.count.fetch_add(1, std::memory_order_relaxed);
+        slot.sum_ns.fetch_add(static_cast<std::uint64_t>(elapsed.count()), std::memory_order_relaxed);
+        slot.rows.fetch_add(static_cast<std::uint64_t>(result.size()), std::memory_order_relaxed);
+        slot.bytes.fetch_add(details::result_bytes(result), std::memory_order_relaxed);
+    }
+
+    /// @brief Calls `func(query, histogram)` for every query recorded so far.
+    template <typename F>
+    void for_each(F&& func) const {
+        for (auto&& slot : m_slots) {
+            if (const auto* query = slot.query.load(std::memory_order_acquire)) {
+                func(std::string_view{*query}, slot);
+            }
+        }
+        if (m_overflow.count.load(std::memory_order_relaxed) != 0) {
+            func(kOverflowQuery, m_overflow);
+        }
+    }
+
+ private:
+    query_metrics() = default;
+
+    auto slot_of(std::string_view query) -> query_histogram& {
+        // 0 marks a free slot
+        const auto key = details::query_hash(query) | 1U;
+        for (std::size_t probe = 0; probe < kCapacity; ++probe) {
+            auto& slot   = m_slots[(key + probe) % kCapacity];
+            auto current = slot.key.load(std::memory_order_acquire);
+            if (current == 0 && slot.key.compare_exchange_strong(current, key, std::memory_order_acq_rel)) {
+                slot.query.store(new std::string{query}, std::memory_order_release);
+                return slot;
+            }
+            if (current == key) {
+                return slot;
+            }
+        }
+        return m_overflow;
+    }
+
+    std::atomic<bool> m_enabled{false};
+    std::array<query_histogram, kCapacity> m_slots{};
+    query_histogram m_overflow{};
+};
+
+}  // namespace db::details
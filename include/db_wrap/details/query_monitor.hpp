@@ -0,0 +1,136 @@
+/*
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2024 Vladislav Nepogodin <vnepogodin@cachyos.org>
+ */
+#pragma once
+
+#include <atomic>        // for atomic
+#include <chrono>        // for nanoseconds, system_clock
+#include <memory>        // for shared_ptr
+#include <mutex>         // for unique_lock
+#include <optional>      // for optional
+#include <shared_mutex>  // for shared_mutex, shared_lock
+#include <string>        // for string
+#include <string_view>   // for string_view
+#include <type_traits>   // for is_same_v, remove_cvref_t
+#include <utility>       // for move
+#include <vector>        // for vector
+
+#include <pqxx/pqxx>
+
+namespace db {
+
+/// @brief A query that took longer than the slow query threshold.
+struct slow_query {
+    /// The query text.
+    std::string query;
+    /// The C++ types of the parameters, as named by libpqxx.
+    std::vector<std::string> param_types;
+    /// The parameters in their text form, `std::nullopt` for `NULL`.
+    std::vector<std::optional<std::string>> params;
+    /// How long the query took, including the round trip.
+    std::chrono::microseconds duration{};
+    /// When the query was started.
+    std::chrono::system_clock::time_point started_at{};
+    /// Some parameters were passed bundled in a `pqxx::params`, whose
+    /// values cannot be read back; the query cannot be run again.
+    bool opaque_params{};
+};
+
+namespace details {
+
+/// @brief Renders a query parameter the way it is sent to the server.
+/// @return The text form of `arg`, or `std::nullopt` for `NULL`.
+template <typename Arg>
+auto param_text(const Arg& arg) -> std::optional<std::string> {
+    if (pqxx::nullness<std::remove_cvref_t<Arg>>::is_null(arg)) {
+        return std::nullopt;
+    }
+    return pqxx::to_string(arg);
+}
+
+/// @brief Builds the `slow_query` record of a finished query.
+template <typename... Args>
+auto make_slow_query(std::string_view query, std::chrono::nanoseconds elapsed, std::chrono::system_clock::time_point started_at, const Args&... args) -> slow_query {
+    slow_query result{
+        .query       = std::string{query},
+        .param_types = {},
+        .params      = {},
+        .duration    = std::chrono::duration_cast<std::chrono::microseconds>(elapsed),
+        .started_at  = started_at,
+    };
+    result.param_types.reserve(sizeof...(Args));
+    result.params.reserve(sizeof...(Args));
+    ([&] {
+        if constexpr (std::is_same_v<std::remove_cvref_t<Args>, pqxx::params>) {
+            result.param_types.emplace_back("pqxx::params");
+            result.params.emplace_back(std::nullopt);
+            result.opaque_params = true;
+        } else {
+            result.param_types.emplace_back(pqxx::type_name<std::remove_cvref_t<Args>>);
+            result.params.emplace_back(details::param_text(args));
+        }
+    }(), ...);
+    return result;
+}
+
+/// @brief Receives the queries slower than its threshold.
+class slow_query_listener {
+ public:
+    virtual ~slow_query_listener() = default;
+
+    /// @brief Queries taking at least this long are reported.
+    [[nodiscard]] virtual auto threshold() const noexcept -> std::chrono::nanoseconds = 0;
+
+    /// @brief Called on the thread that ran the query; must not block.
+    virtual void on_slow_query(slow_query query) = 0;
+};
+
+/// @brief Process-wide hook observing the queries run by `db::utils`.
+///
+/// Like the statement registry, the hook is skipped entirely while nothing
+/// is installed, so code that never installs a listener pays nothing for it.
+class query_monitor {
+ public:
+    /// @brief The process-wide monitor.
+    static auto instance() -> query_monitor& {
+        static query_monitor monitor{};
+        return monitor;
+    }
+
+    /// @brief Installs `listener`, replacing the previous one.
+    void install(std::shared_ptr<slow_query_listener> listener) {
+        std::unique_lock lock{m_mutex};
+        m_listener = std::move(listener);
+        m_active.store(m_listener != nullptr, std::memory_order_release);
+    }
+
+    /// @brief Removes `listener` if it is the installed one.
+    void uninstall(const slow_query_listener* listener) {
+        std::unique_lock lock{m_mutex};
+        if (m_listener.get() == listener) {
+            m_listener.reset();
+            m_active.store(false, std::memory_order_release);
+        }
+    }
+
+    /// @brief The installed listener, or `nullptr`.
+    [[nodiscard]] auto listener() const -> std::shared_ptr<slow_query_listener> {
+        if (!m_active.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        std::shared_lock lock{m_mutex};
+        return m_listener;
+    }
+
+ private:
+    query_monitor() = default;
+
+    mutable std::shared_mutex m_mutex{};
+    std::atomic<bool> m_active{false};
+    std::shared_ptr<slow_query_listener> m_listener{};
+};
+
+}  // namespace details
+}  // namespace db
@@ -0,0 +1,54 @@
+/*
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2024 Vladislav Nepogodin <vnepogodin@cachyos.org>
+ */
+#pragma once
+
+#include <db_wrap/details/pfr_utils.hpp>
+
+#include <atomic>       // for atomic
+#include <cstddef>      // for size_t
+#include <string_view>  // for string_view
+
+#include <pqxx/pqxx>
+
+namespace db::details {
+
+/// @brief Per-type flag set once the table layout of `T` was verified
+///        against the database (see `db::verify_schemes`).
+template <typename T>
+struct scheme_layout {
+    static inline std::atomic<bool> verified{false};
+};
+
+/// @brief Checks whether rows of a result can be decoded into `T` by position.
+///
+/// Only types whose layout was verified are decoded by position. The column
+/// names of the result are compared with the field names of `T` once per
+/// result, so hand-written queries selecting columns in another order keep
+/// working, while every row after that skips the lookup of its columns by
+/// name.
+///
+/// @tparam T The type the rows are decoded into.
+/// @param result The result to decode.
+/// @return `true` if column `i` of `result` holds field `i` of `T`.
+template <typename T>
+auto decodes_by_position(const pqxx::result& result) -> bool {
+    if (!scheme_layout<T>::verified.load(std::memory_order_relaxed)) {
+        return false;
+    }
+
+    constexpr auto kFieldNames = utils::get_struct_names<T>();
+    if (static_cast<std::size_t>(result.columns()) < kFieldNames.size()) {
+        return false;
+    }
+    for (std::size_t i = 0; i < kFieldNames.size(); ++i) {
+        if (std::string_view{result.column_name(static_cast<pqxx::row::size_type>(i))} != kFieldNames[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+}  // namespace db::details
@@ -17,6 +17,8 @@
 #include <ranges>       // for ranges::*
 #include <string>       // for string
 #include <string_view>  // for string_view
+#include <type_traits>  // for remove_cvref_t
+#include <utility>      // for declval
 #include <vector>       // for vector
 
 namespace db::sql::details {
@@ -52,6 +54,49 @@ concept HasIdField = requires(T t) {
 template <typename T>
 concept HasSchemeAndId = details::HasName<T> && details::HasIdField<T>;
 
+/// @brief Concept that checks if a type opts into optimistic concurrency
+///        with a static member `kVersionField` naming its version column.
+///
+/// Updates of such a type only apply if the version column still holds the
+/// version the record was read with, and increment it.
+///
+/// @example
+/// struct Account {
+///   static constexpr std::string_view kName = "accounts";
+///   static constexpr std::string_view kVersionField = "version";
+///   std::int64_t id;
+///   std::int64_t balance;
+///   std::int64_t version;
+/// };
+template <typename T>
+concept HasVersionField = requires {
+    { T::kVersionField } -> std::convertible_to<std::string_view>;
+};
+
+/// @brief The index of the version field of `Scheme` among its fields, or
+///        the number of fields if there is no such field.
+template <HasVersionField Scheme>
+consteval auto version_field_idx() noexcept -> std::size_t {
+    constexpr auto struct_fields = utils::get_struct_names<Scheme>();
+    // NOTE: apparently ranges::find cannot handle array of std::common_type_t at compile time
+    return static_cast<std::size_t>(std::distance(struct_fields.begin(),
+        std::find(struct_fields.begin(), struct_fields.end(), std::string_view{Scheme::kVersionField})));
+}
+
+/// @brief Helper struct to determine the type of the 'id' field in a type.
+///
+/// @example
+/// struct User { std::int64_t id; std::string name; };
+/// static_assert(std::is_same_v<details::IdFieldType<User>::type, std::int64_t>);
+template <HasIdField T>
+struct IdFieldType {
+    using type = std::remove_cvref_t<decltype(std::declval<T&>().id)>;
+};
+
+/// @brief Shorthand for `IdFieldType<T>::type`.
+template <HasIdField T>
+using id_field_t = typename IdFieldType<T>::type;
+
 /// @brief Appends a formatted field assignment expression to a string.
 ///
 /// This function constructs a string representing a field assignment expression
@@ -84,6 +129,33 @@ constexpr void interpret_name(std::string_view name, std::int32_t& i, std::int32
     ++i;
 }
 
+/// @brief Appends ` AND version = $param_index` to a WHERE clause, for the
+///        version field of `Scheme`.
+template <HasVersionField Scheme>
+constexpr void append_version_check(std::int32_t param_index, auto& dest) noexcept {
+    using namespace std::string_view_literals;
+
+    std::array<char, 10> buf{};
+    utils::itoa_d(param_index, buf.data());
+
+    dest += " AND "sv;
+    dest += Scheme::kVersionField;
+    dest += " = $"sv;
+    dest += buf.data();
+}
+
+/// @brief Appends `version = version + 1`, the assignment incrementing the
+///        version field of `Scheme`, to a SET clause.
+template <HasVersionField Scheme>
+constexpr void append_version_increment(auto& dest) noexcept {
+    using namespace std::string_view_literals;
+
+    dest += Scheme::kVersionField;
+    dest += " = "sv;
+    dest += Scheme::kVersionField;
+    dest += " + 1"sv;
+}
+
 /// @brief Generates an SQL UPDATE query string based on the provided scheme
 ///        and field names.
 ///
@@ -100,6 +172,10 @@ constexpr void interpret_name(std::string_view name, std::int32_t& i, std::int32
 /// @param dest The destination string to which the generated query
 ///             string will be appended.
 ///
+/// If the scheme has a version field (see `HasVersionField`), the version
+/// is incremented and checked against one more parameter, following the
+/// fields.
+///
 /// @example
 /// struct MyScheme {
 ///   static constexpr std::string_view kName = "my_table";
@@ -115,7 +191,7 @@ constexpr void update_query_str(auto&& dest) noexcept {
     using namespace std::string_view_literals;
 
     constexpr auto kStatementBegin = "UPDATE "sv;
-    constexpr auto kStatementEnd   = " WHERE id = $1;"sv;
+    constexpr auto kStatementEnd   = " WHERE id = $1"sv;
 
     constexpr std::int32_t size = sizeof...(Fields);
 
@@ -125,8 +201,16 @@ constexpr void update_query_str(auto&& dest) noexcept {
     dest += Scheme::kName;
     dest += " SET "sv;
     (details::interpret_name(Fields, i, size, dest), ...);
+    if constexpr (HasVersionField<Scheme>) {
+        dest += ", "sv;
+        details::append_version_increment<Scheme>(dest);
+    }
 
     dest += kStatementEnd;
+    if constexpr (HasVersionField<Scheme>) {
+        details::append_version_check<Scheme>(size + 2, dest);
+    }
+    dest += ";"sv;
 }
 
 /// @brief Validates that the provided field names are valid members of
@@ -180,6 +264,10 @@ consteval auto validate_fields(auto&& sql_scheme_struct) noexcept -> bool {
 ///
 /// The generated query string is appended to the provided `dest` string.
 ///
+/// If the scheme has a version field (see `HasVersionField`), the field is
+/// incremented instead of assigned, and its parameter is checked in the
+/// WHERE clause instead.
+///
 /// @tparam Scheme The type representing the database table scheme.
 ///                Must satisfy the `HasName` concept.
 /// @param dest The destination string to which the generated query string
@@ -203,7 +291,7 @@ constexpr void update_query_all_str(auto&& dest) noexcept {
     using namespace std::string_view_literals;
 
     constexpr auto kStatementBegin = "UPDATE "sv;
-    constexpr auto kStatementEnd   = " WHERE id = $1;"sv;
+    constexpr auto kStatementEnd   = " WHERE id = $1"sv;
 
     constexpr auto valid_fields = utils::get_struct_names<std::remove_cvref_t<Scheme>>();
 
@@ -220,15 +308,34 @@ constexpr void update_query_all_str(auto&& dest) noexcept {
     dest += Scheme::kName;
     dest += " SET "sv;
 
+    if constexpr (HasVersionField<Scheme>) {
+        static_assert(details::version_field_idx<Scheme>() < utils::get_fields_count<Scheme>(),
+            "kVersionField names no field of the scheme!");
+    }
+
     // run for each field except ID
+    [[maybe_unused]] std::int32_t version_param{};
     for (auto&& valid_field : valid_fields) {
         if (valid_field == "id"sv) {
             continue;
         }
+        if constexpr (HasVersionField<Scheme>) {
+            if (valid_field == std::string_view{Scheme::kVersionField}) {
+                version_param = i + 2;
+                details::append_version_increment<Scheme>(dest);
+                dest += (i + 1 < names_size) ? ", "sv : ""sv;
+                ++i;
+                continue;
+            }
+        }
         details::interpret_name(valid_field, i, names_size, dest);
     }
 
     dest += kStatementEnd;
+    if constexpr (HasVersionField<Scheme>) {
+        details::append_version_check<Scheme>(version_param, dest);
+    }
+    dest += ";"sv;
 }
 
 /// @brief Generates an SQL INSERT query string to insert all fields
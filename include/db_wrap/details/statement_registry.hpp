@@ -0,0 +1,135 @@
+/*
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2024 Vladislav Nepogodin <vnepogodin@cachyos.org>
+ */
+#pragma once
+
+#include <atomic>         // for atomic
+#include <cstdint>        // for uint64_t
+#include <functional>     // for equal_to, hash
+#include <mutex>          // for unique_lock
+#include <shared_mutex>   // for shared_mutex, shared_lock
+#include <string>         // for string
+#include <string_view>    // for string_view
+#include <unordered_map>  // for unordered_map
+#include <vector>         // for vector
+
+namespace db::details {
+
+/// @brief A query registered to be executed as a named prepared statement.
+struct registered_statement {
+    /// Server-side statement name, derived from the query text.
+    std::string name;
+    /// The query text, null-terminated.
+    std::string query;
+};
+
+/// @brief Computes the 64-bit FNV-1a hash of a query text.
+///
+/// The hash is stable across platforms and processes, which makes it
+/// suitable to identify a query outside of the process that built it.
+///
+/// @param query The query text.
+/// @return The hash of the query.
+constexpr auto query_hash(std::string_view query) noexcept -> std::uint64_t {
+    std::uint64_t hash{0xcbf29ce484222325ULL};
+    for (const char chr : query) {
+        hash ^= static_cast<std::uint8_t>(chr);
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/// @brief Derives a stable prepared statement name from a query text.
+///
+/// The name is `dbw_` followed by the `query_hash` of the query in hex, so
+/// the same query always maps to the same statement on every connection and
+/// in every process.
+///
+/// @param query The query text.
+/// @return The statement name.
+inline auto statement_name(std::string_view query) -> std::string {
+    const auto hash = details::query_hash(query);
+
+    constexpr std::string_view kHexDigits = "0123456789abcdef";
+    std::string name{"dbw_"};
+    for (std::int32_t shift = 60; shift >= 0; shift -= 4) {
+        name += kHexDigits[(hash >> shift) & 0xFU];
+    }
+    return name;
+}
+
+/// @brief Process-wide registry of queries executed as prepared statements.
+///
+/// Queries are registered once, typically at startup, and never removed.
+/// Lookups take a shared lock and are skipped entirely while the registry
+/// is empty or in unnamed mode, so code that never registers anything pays
+/// nothing for it.
+class statement_registry {
+ public:
+    /// @brief The process-wide registry.
+    static auto instance() -> statement_registry& {
+        static statement_registry registry{};
+        return registry;
+    }
+
+    /// @brief Registers a query. Registering the same query again is a no-op.
+    /// @return The registered statement, valid for the lifetime of the process.
+    auto add(std::string_view query) -> const registered_statement& {
+        std::unique_lock lock{m_mutex};
+        auto it = m_statements.find(query);
+        if (it == m_statements.end()) {
+            std::string query_str{query};
+            auto statement = registered_statement{.name = details::statement_name(query), .query = query_str};
+            it             = m_statements.emplace(std::move(query_str), std::move(statement)).first;
+            m_empty.store(false, std::memory_order_release);
+        }
+        return it->second;
+    }
+
+    /// @brief Looks up a registered query.
+    /// @return The registered statement, or `nullptr` if `query` is not
+    ///         registered or registered queries run as unnamed statements.
+    [[nodiscard]] auto find(std::string_view query) const -> const registered_statement* {
+        if (m_empty.load(std::memory_order_acquire) || m_unnamed.load(std::memory_order_relaxed)) {
+            return nullptr;
+        }
+        std::shared_lock lock{m_mutex};
+        const auto it = m_statements.find(query);
+        return it != m_statements.end() ? &it->second : nullptr;
+    }
+
+    /// @brief Sets whether registered queries run as unnamed statements
+    ///        instead of named prepared statements (see `db::statement_mode`).
+    void set_unnamed(bool unnamed) noexcept { m_unnamed.store(unnamed, std::memory_order_relaxed); }
+
+    /// @brief Whether registered queries run as unnamed statements.
+    [[nodiscard]] auto unnamed() const noexcept -> bool { return m_unnamed.load(std::memory_order_relaxed); }
+
+    /// @brief A snapshot of all registered statements.
+    [[nodiscard]] auto statements() const -> std::vector<const registered_statement*> {
+        std::shared_lock lock{m_mutex};
+        std::vector<const registered_statement*> result{};
+        result.reserve(m_statements.size());
+        for (auto&& [query, statement] : m_statements) {
+            result.emplace_back(&statement);
+        }
+        return result;
+    }
+
+ private:
+    struct string_hash {
+        using is_transparent = void;
+        auto operator()(std::string_view str) const noexcept -> std::size_t { return std::hash<std::string_view>{}(str); }
+    };
+
+    statement_registry() = default;
+
+    mutable std::shared_mutex m_mutex{};
+    std::atomic<bool> m_empty{true};
+    std::atomic<bool> m_unnamed{false};
+    std::unordered_map<std::string, registered_statement, string_hash, std::equal_to<>> m_statements{};
+};
+
+}  // namespace db::details
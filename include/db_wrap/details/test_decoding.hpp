@@ -0,0 +1,223 @@
+/*
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2024 Vladislav Nepogodin <vnepogodin@cachyos.org>
+ */
+#pragma once
+
+#include <algorithm>    // for min
+#include <array>        // for array
+#include <cstddef>      // for size_t
+#include <cstdint>      // for uint8_t
+#include <optional>     // for optional
+#include <string>       // for string
+#include <string_view>  // for string_view
+#include <utility>      // for move
+#include <vector>       // for vector
+
+namespace db {
+
+/// @brief The kind of a change delivered by a `db::change_feed`.
+enum class change_kind : std::uint8_t {
+    insert,
+    update,
+    remove,
+    truncate,
+};
+
+namespace details {
+
+/// @brief A column of a row printed by the `test_decoding` output plugin.
+struct decoded_column {
+    std::string name;
+    /// The value as text, `std::nullopt` for SQL NULL.
+    std::optional<std::string> value;
+    /// The value was not written to the WAL because it is TOASTed and did
+    /// not change, so it is unknown.
+    bool unchanged_toast{};
+};
+
+/// @brief One line of `test_decoding` output describing a row change.
+struct decoded_change {
+    /// The schema qualified table, as printed by the plugin.
+    std::string table;
+    change_kind kind{};
+    /// The old key columns, or the whole old row with `REPLICA IDENTITY FULL`.
+    std::vector<decoded_column> old_tuple;
+    /// The new row of an insert or update; the key of a delete without
+    /// `REPLICA IDENTITY FULL` is printed here too.
+    std::vector<decoded_column> new_tuple;
+};
+
+/// @brief What a line of `test_decoding` output is.
+enum class decoded_line : std::uint8_t {
+    begin,
+    commit,
+    change,
+    /// Anything else, e.g. a logical decoding message.
+    other,
+};
+
+/// @brief Parser of the text lines written by the `test_decoding` plugin,
+///        e.g. `table public.users: UPDATE: id[bigint]:1 name[text]:'it''s'`.
+class test_decoding_parser {
+ public:
+    /// @brief Parses `line` into `change` if it describes a row change.
+    static auto parse(std::string_view line, decoded_change& change) -> decoded_line {
+        using namespace std::string_view_literals;
+
+        if (line.starts_with("BEGIN"sv)) {
+            return decoded_line::begin;
+        }
+        if (line.starts_with("COMMIT"sv)) {
+            return decoded_line::commit;
+        }
+        constexpr auto kTablePrefix = "table "sv;
+        if (!line.starts_with(kTablePrefix)) {
+            return decoded_line::other;
+        }
+        line.remove_prefix(kTablePrefix.size());
+
+        // values may contain the action markers too, so the action must
+        // follow the table name right away
+        const auto name_end = test_decoding_parser::table_name_end(line);
+        const auto rest     = line.substr(name_end);
+
+        struct action {
+            std::string_view text;
+            change_kind kind;
+        };
+        constexpr std::array kActions{
+            action{": INSERT:"sv, change_kind::insert},
+            action{": UPDATE:"sv, change_kind::update},
+            action{": DELETE:"sv, change_kind::remove},
+            action{": TRUNCATE:"sv, change_kind::truncate},
+        };
+        for (auto&& [text, kind] : kActions) {
+            if (!rest.starts_with(text)) {
+                continue;
+            }
+            change.table = std::string{line.substr(0, name_end)};
+            change.kind  = kind;
+            change.old_tuple.clear();
+            change.new_tuple.clear();
+            if (kind != change_kind::truncate) {
+                test_decoding_parser::parse_tuples(rest.substr(text.size()), change);
+            }
+            return decoded_line::change;
+        }
+        return decoded_line::other;
+    }
+
+ private:
+    /// Finds the end of the schema qualified table name at the front of
+    /// `line`, whose quoted parts may contain anything, `:` included.
+    static auto table_name_end(std::string_view line) noexcept -> std::size_t {
+        bool quoted{};
+        std::size_t pos{};
+        for (; pos < line.size(); ++pos) {
+            // a doubled quote inside a quoted part toggles twice
+            if (line[pos] == '"') {
+                quoted = !quoted;
+            } else if (line[pos] == ':' && !quoted) {
+                break;
+            }
+        }
+        return pos;
+    }
+
+    static void parse_tuples(std::string_view text, decoded_change& change) {
+        using namespace std::string_view_literals;
+
+        auto* target = &change.new_tuple;
+        while (true) {
+            text = test_decoding_parser::skip_spaces(text);
+            if (text.empty() || text.starts_with("(no-tuple-data)"sv)) {
+                return;
+            }
+            if (text.starts_with("old-key:"sv)) {
+                target = &change.old_tuple;
+                text.remove_prefix("old-key:"sv.size());
+                continue;
+            }
+            if (text.starts_with("new-tuple:"sv)) {
+                target = &change.new_tuple;
+                text.remove_prefix("new-tuple:"sv.size());
+                continue;
+            }
+
+            decoded_column column{};
+            if (!test_decoding_parser::parse_column(text, column)) {
+                return;
+            }
+            target->emplace_back(std::move(column));
+        }
+    }
+
+    /// Parses `name[type]:value` off the front of `text`.
+    static auto parse_column(std::string_view& text, decoded_column& column) -> bool {
+        using namespace std::string_view_literals;
+
+        if (text.starts_with('"')) {
+            column.name = test_decoding_parser::take_quoted(text, '"');
+        } else {
+            const auto end = text.find('[');
+            if (end == std::string_view::npos) {
+                return false;
+            }
+            column.name = std::string{text.substr(0, end)};
+            text.remove_prefix(end);
+        }
+
+        // the type may contain spaces and brackets itself, e.g. `integer[]`
+        const auto type_end = text.find("]:"sv);
+        if (!text.starts_with('[') || type_end == std::string_view::npos) {
+            return false;
+        }
+        text.remove_prefix(type_end + 2);
+
+        if (text.starts_with('\'')) {
+            column.value = test_decoding_parser::take_quoted(text, '\'');
+            return true;
+        }
+        const auto end   = std::min(text.find(' '), text.size());
+        const auto token = text.substr(0, end);
+        text.remove_prefix(end);
+        if (token == "null"sv) {
+            column.value.reset();
+        } else if (token == "unchanged-toast-datum"sv) {
+            column.unchanged_toast = true;
+        } else {
+            column.value = std::string{token};
+        }
+        return true;
+    }
+
+    /// Takes a string quoted with `quote`, where doubled quotes escape one.
+    static auto take_quoted(std::string_view& text, char quote) -> std::string {
+        std::string result{};
+        std::size_t pos = 1;
+        while (pos < text.size()) {
+            if (text[pos] == quote) {
+                if (pos + 1 < text.size() && text[pos + 1] == quote) {
+                    result += quote;
+                    pos += 2;
+                    continue;
+                }
+                ++pos;
+                break;
+            }
+            result += text[pos++];
+        }
+        text.remove_prefix(pos);
+        return result;
+    }
+
+    static auto skip_spaces(std::string_view text) noexcept -> std::string_view {
+        const auto start = text.find_first_not_of(' ');
+        return start == std::string_view::npos ? std::string_view{} : text.substr(start);
+    }
+};
+
+}  // namespace details
+}  // namespace db
@@ -0,0 +1,475 @@
+/*
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2024 Vladislav Nepogodin <vnepogodin@cachyos.org>
+ */
+#pragma once
+
+#include <array>         // for array
+#include <charconv>      // for from_chars
+#include <cstdint>       // for uint8_t, uint32_t
+#include <optional>      // for optional
+#include <string>        // for string
+#include <string_view>   // for string_view
+#include <system_error>  // for errc
+#include <type_traits>   // for is_arithmetic_v, is_same_v
+#include <utility>       // for move
+
+#include <pqxx/pqxx>
+
+namespace db {
+
+/// @brief Kind of a JSON value.
+enum class json_kind : std::uint8_t {
+    invalid,
+    null,
+    boolean,
+    number,
+    string,
+    array,
+    object,
+};
+
+namespace details {
+
+inline constexpr std::size_t kJsonNpos = std::string_view::npos;
+
+constexpr auto json_skip_ws(std::string_view text, std::size_t pos) noexcept -> std::size_t {
+    while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\n' || text[pos] == '\r')) {
+        ++pos;
+    }
+    return pos;
+}
+
+/// @brief Returns the position past the string starting with the quote at `pos`.
+constexpr auto json_skip_string(std::string_view text, std::size_t pos) noexcept -> std::size_t {
+    for (++pos; pos < text.size(); ++pos) {
+        if (text[pos] == '\\') {
+            ++pos;
+        } else if (text[pos] == '"') {
+            return pos + 1;
+        }
+    }
+    return kJsonNpos;
+}
+
+/// @brief Returns the position past the value starting at `pos`, without parsing it.
+constexpr auto json_skip_value(std::string_view text, std::size_t pos) noexcept -> std::size_t {
+    if (pos >= text.size()) {
+        return kJsonNpos;
+    }
+    if (text[pos] == '"') {
+        return details::json_skip_string(text, pos);
+    }
+    if (text[pos] == '{' || text[pos] == '[') {
+        std::size_t depth{};
+        while (pos < text.size()) {
+            const char chr = text[pos];
+            if (chr == '"') {
+                pos = details::json_skip_string(text, pos);
+                if (pos == kJsonNpos) {
+                    return kJsonNpos;
+                }
+                continue;
+            }
+            if (chr == '{' || chr == '[') {
+                ++depth;
+            } else if ((chr == '}' || chr == ']') && --depth == 0) {
+                return pos + 1;
+            }
+            ++pos;
+        }
+        return kJsonNpos;
+    }
+
+    const auto start = pos;
+    while (pos < text.size() && text[pos] != ',' && text[pos] != '}' && text[pos] != ']' && text[pos] != ' '
+        && text[pos] != '\t' && text[pos] != '\n' && text[pos] != '\r') {
+        ++pos;
+    }
+    return pos == start ? kJsonNpos : pos;
+}
+
+constexpr auto json_hex_digit(char chr) noexcept -> std::uint32_t {
+    if (chr >= '0' && chr <= '9') {
+        return static_cast<std::uint32_t>(chr - '0');
+    }
+    if (chr >= 'a' && chr <= 'f') {
+        return static_cast<std::uint32_t>(chr - 'a' + 10);
+    }
+    if (chr >= 'A' && chr <= 'F') {
+        return static_cast<std::uint32_t>(chr - 'A' + 10);
+    }
+    return 0x10;
+}
+
+/// @brief Decodes the body of a JSON string (without quotes).
+/// @return The decoded UTF-8 string, or `std::nullopt` on a malformed escape.
+constexpr auto json_unescape(std::string_view body) -> std::optional<std::string> {
+    std::string result{};
+    result.reserve(body.size());
+
+    auto read_hex4 = [&body](std::size_t pos) -> std::optional<std::uint32_t> {
+        if (pos + 4 > body.size()) {
+            return std::nullopt;
+        }
+        std::uint32_t code{};
+        for (std::size_t i = pos; i < pos + 4; ++i) {
+            const auto digit = details::json_hex_digit(body[i]);
+            if (digit > 0xF) {
+                return std::nullopt;
+            }
+            code = (code << 4U) | digit;
+        }
+        return code;
+    };
+
+    for (std::size_t pos = 0; pos < body.size(); ++pos) {
+        if (body[pos] != '\\') {
+            result += body[pos];
+            continue;
+        }
+        if (++pos == body.size()) {
+            return std::nullopt;
+        }
+        switch (body[pos]) {
+        case '"': result += '"'; break;
+        case '\\': result += '\\'; break;
+        case '/': result += '/'; break;
+        case 'b': result += '\b'; break;
+        case 'f': result += '\f'; break;
+        case 'n': result += '\n'; break;
+        case 'r': result += '\r'; break;
+        case 't': result += '\t'; break;
+        case 'u': {
+            auto code = read_hex4(pos + 1);
+            if (!code) {
+                return std::nullopt;
+            }
+            pos += 4;
+            if (*code >= 0xD800 && *code <= 0xDBFF) {
+                // surrogate pair
+                if (pos + 2 >= body.size() || body[pos + 1] != '\\' || body[pos + 2] != 'u') {
+                    return std::nullopt;
+                }
+                const auto low = read_hex4(pos + 3);
+                if (!low || *low < 0xDC00 || *low > 0xDFFF) {
+                    return std::nullopt;
+                }
+                pos += 6;
+                code = 0x10000 + ((*code - 0xD800) << 10U) + (*low - 0xDC00);
+            }
+            if (*code < 0x80) {
+                result += static_cast<char>(*code);
+            } else if (*code < 0x800) {
+                result += static_cast<char>(0xC0 | (*code >> 6U));
+                result += static_cast<char>(0x80 | (*code & 0x3FU));
+            } else if (*code < 0x10000) {
+                result += static_cast<char>(0xE0 | (*code >> 12U));
+                result += static_cast<char>(0x80 | ((*code >> 6U) & 0x3FU));
+                result += static_cast<char>(0x80 | (*code & 0x3FU));
+            } else {
+                result += static_cast<char>(0xF0 | (*code >> 18U));
+                result += static_cast<char>(0x80 | ((*code >> 12U) & 0x3FU));
+                result += static_cast<char>(0x80 | ((*code >> 6U) & 0x3FU));
+                result += static_cast<char>(0x80 | (*code & 0x3FU));
+            }
+            break;
+        }
+        default:
+            return std::nullopt;
+        }
+    }
+    return result;
+}
+
+/// @brief Appends `text` to `dest` as a quoted JSON string.
+constexpr void json_escape(std::string& dest, std::string_view text) {
+    constexpr std::string_view kHexDigits = "0123456789abcdef";
+
+    dest += '"';
+    for (const char chr : text) {
+        switch (chr) {
+        case '"': dest += "\\\""; break;
+        case '\\': dest += "\\\\"; break;
+        case '\b': dest += "\\b"; break;
+        case '\f': dest += "\\f"; break;
+        case '\n': dest += "\\n"; break;
+        case '\r': dest += "\\r"; break;
+        case '\t': dest += "\\t"; break;
+        default:
+            if (static_cast<std::uint8_t>(chr) < 0x20) {
+                dest += "\\u00";
+                dest += kHexDigits[static_cast<std::uint8_t>(chr) >> 4U];
+                dest += kHexDigits[static_cast<std::uint8_t>(chr) & 0xFU];
+            } else {
+                dest += chr;
+            }
+        }
+    }
+    dest += '"';
+}
+
+}  // namespace details
+
+/// @brief Non-owning view of a JSON value inside a serialized document.
+///
+/// Nothing is parsed up front. `find` and `at` scan the text only up to the
+/// requested member, skipping over every other value without decoding it,
+/// so reading a single key out of a large document touches only the bytes
+/// in front of it.
+///
+/// @example
+/// constexpr db::json_view doc{R"({"type": "click", "pos": {"x": 1, "y": 2}})"};
+/// static_assert(doc.find("pos")->find("y")->raw() == "2");
+class json_view {
+ public:
+    constexpr json_view() noexcept = default;
+
+    /// @brief Views a serialized JSON value. Surrounding whitespace is ignored.
+    constexpr explicit json_view(std::string_view text) noexcept {
+        const auto begin = details::json_skip_ws(text, 0);
+        auto end         = text.size();
+        while (end > begin && (text[end - 1] == ' ' || text[end - 1] == '\t' || text[end - 1] == '\n' || text[end - 1] == '\r')) {
+            --end;
+        }
+        m_text = text.substr(begin, end - begin);
+    }
+
+    /// @brief The serialized value, e.g. to hand it to a full JSON parser without copying.
+    [[nodiscard]] constexpr auto raw() const noexcept -> std::string_view { return m_text; }
+
+    /// @brief The kind of the value, judged by its first character.
+    [[nodiscard]] constexpr auto kind() const noexcept -> json_kind {
+        if (m_text.empty()) {
+            return json_kind::invalid;
+        }
+        switch (m_text.front()) {
+        case '{': return json_kind::object;
+        case '[': return json_kind::array;
+        case '"': return json_kind::string;
+        case 't':
+        case 'f': return json_kind::boolean;
+        case 'n': return json_kind::null;
+        default:
+            return (m_text.front() == '-' || (m_text.front() >= '0' && m_text.front() <= '9')) ? json_kind::number
+                                                                                             : json_kind::invalid;
+        }
+    }
+
+    /// @brief Looks up a member of an object.
+    /// @param key The unescaped member name.
+    /// @return The value of the first member named `key`, or `std::nullopt`
+    ///         if there is none or the value is not an object.
+    [[nodiscard]] constexpr auto find(std::string_view key) const -> std::optional<json_view> {
+        if (kind() != json_kind::object) {
+            return std::nullopt;
+        }
+        std::size_t pos = details::json_skip_ws(m_text, 1);
+        while (pos < m_text.size() && m_text[pos] == '"') {
+            const auto key_end = details::json_skip_string(m_text, pos);
+            if (key_end == details::kJsonNpos) {
+                return std::nullopt;
+            }
+            const auto member = m_text.substr(pos + 1, key_end - pos - 2);
+
+            pos = details::json_skip_ws(m_text, key_end);
+            if (pos >= m_text.size() || m_text[pos] != ':') {
+                return std::nullopt;
+            }
+            const auto value_begin = details::json_skip_ws(m_text, pos + 1);
+            const auto value_end   = details::json_skip_value(m_text, value_begin);
+            if (value_end == details::kJsonNpos) {
+                return std::nullopt;
+            }
+            if (json_view::key_equals(member, key)) {
+                return json_view{m_text.substr(value_begin, value_end - value_begin)};
+            }
+
+            pos = details::json_skip_ws(m_text, value_end);
+            if (pos >= m_text.size() || m_text[pos] != ',') {
+                return std::nullopt;
+            }
+            pos = details::json_skip_ws(m_text, pos + 1);
+        }
+        return std::nullopt;
+    }
+
+    /// @brief Looks up an element of an array.
+    /// @return The element at `index`, or `std::nullopt` if there is none
+    ///         or the value is not an array.
+    [[nodiscard]] constexpr auto at(std::size_t index) const -> std::optional<json_view> {
+        if (kind() != json_kind::array) {
+            return std::nullopt;
+        }
+        std::size_t pos = details::json_skip_ws(m_text, 1);
+        for (std::size_t i = 0; pos < m_text.size() && m_text[pos] != ']'; ++i) {
+            const auto value_end = details::json_skip_value(m_text, pos);
+            if (value_end == details::kJsonNpos) {
+                return std::nullopt;
+            }
+            if (i == index) {
+                return json_view{m_text.substr(pos, value_end - pos)};
+            }
+            pos = details::json_skip_ws(m_text, value_end);
+            if (pos >= m_text.size() || m_text[pos] != ',') {
+                return std::nullopt;
+            }
+            pos = details::json_skip_ws(m_text, pos + 1);
+        }
+        return std::nullopt;
+    }
+
+    /// @brief Decodes a string value.
+    /// @return The unescaped string, or `std::nullopt` if the value is not a string.
+    [[nodiscard]] constexpr auto as_string() const -> std::optional<std::string> {
+        if (kind() != json_kind::string || m_text.size() < 2 || m_text.back() != '"') {
+            return std::nullopt;
+        }
+        return details::json_unescape(m_text.substr(1, m_text.size() - 2));
+    }
+
+    /// @brief Decodes a number or boolean value.
+    /// @tparam T An arithmetic type; `bool` accepts `true` and `false`.
+    /// @return The value, or `std::nullopt` if it is of another kind or does not fit `T`.
+    template <typename T>
+        requires std::is_arithmetic_v<T>
+    [[nodiscard]] auto as() const noexcept -> std::optional<T> {
+        if constexpr (std::is_same_v<T, bool>) {
+            if (m_text == "true") {
+                return true;
+            }
+            if (m_text == "false") {
+                return false;
+            }
+            return std::nullopt;
+        } else {
+            T value{};
+            const auto [ptr, ec] = std::from_chars(m_text.data(), m_text.data() + m_text.size(), value);
+            if (ec != std::errc{} || ptr != m_text.data() + m_text.size()) {
+                return std::nullopt;
+            }
+            return value;
+        }
+    }
+
+    constexpr bool operator==(const json_view&) const = default;
+
+ private:
+    static constexpr auto key_equals(std::string_view member, std::string_view key) -> bool {
+        if (member.find('\\') == std::string_view::npos) {
+            return member == key;
+        }
+        return details::json_unescape(member) == key;
+    }
+
+    std::string_view m_text{};
+};
+
+/// @brief Field type holding a `json`/`jsonb` column as serialized text.
+///
+/// Decoding a row only copies the text; the document is scanned lazily by
+/// `find` and `at` when a member is accessed, and `raw` hands the text to a
+/// full JSON parser without copying it. As a query parameter, the text is
+/// sent as is, so documents serialized elsewhere are written without being
+/// parsed or re-encoded.
+///
+/// @example
+/// struct Event {
+///   static constexpr std::string_view kName = "events";
+///
+///   std::int64_t id;
+///   db::json payload;
+/// };
+///
+/// auto event = db::find_by_id<Event>(conn, 1);
+/// auto user  = event->payload.find("user_id")->as<std::int64_t>();
+class json {
+ public:
+    /// @brief The JSON `null` document.
+    json() : m_text("null") {}
+
+    /// @brief Takes ownership of a serialized JSON document. The text is not validated.
+    explicit json(std::string text) noexcept : m_text(std::move(text)) {}
+
+    /// @brief The serialized document.
+    [[nodiscard]] auto raw() const noexcept -> std::string_view { return m_text; }
+
+    /// @brief A view of the whole document.
+    [[nodiscard]] auto view() const noexcept -> json_view { return json_view{m_text}; }
+
+    /// @brief See `json_view::kind`.
+    [[nodiscard]] auto kind() const noexcept -> json_kind { return view().kind(); }
+
+    /// @brief See `json_view::find`. The result refers to this object.
+    [[nodiscard]] auto find(std::string_view key) const -> std::optional<json_view> { return view().find(key); }
+
+    /// @brief See `json_view::at`. The result refers to this object.
+    [[nodiscard]] auto at(std::size_t index) const -> std::optional<json_view> { return view().at(index); }
+
+    bool operator==(const json&) const = default;
+
+ private:
+    std::string m_text;
+};
+
+template <typename T>
+struct pg_type_names;
+
+template <>
+struct pg_type_names<json> {
+    static constexpr std::array<std::string_view, 2> kNames{"json", "jsonb"};
+};
+
+}  // namespace db
+
+namespace pqxx {
+
+template <>
+inline const std::string_view type_name<db::json>{"db::json"};
+
+template <>
+struct nullness<db::json> : no_null<db::json> {};
+
+template <>
+struct string_traits<db::json> {
+    static constexpr bool converts_to_string{true};
+    static constexpr bool converts_from_string{true};
+
+    static auto from_string(std::string_view text) -> db::json { return db::json{std::string{text}}; }
+
+    // the text is owned by a std::string, so it is null-terminated and can be sent without a copy
+    static auto to_buf(char* /*begin*/, char* /*end*/, const db::json& value) -> zview {
+        return zview{value.raw().data(), value.raw().size()};
+    }
+
+    static auto into_buf(char* begin, char* end, const db::json& value) -> char* {
+        return string_traits<std::string_view>::into_buf(begin, end, value.raw());
+    }
+
+    static auto size_buffer(const db::json& value) noexcept -> std::size_t { return value.raw().size() + 1; }
+};
+
+template <>
+inline const std::string_view type_name<db::json_view>{"db::json_view"};
+
+template <>
+struct nullness<db::json_view> : no_null<db::json_view> {};
+
+template <>
+struct string_traits<db::json_view> {
+    static constexpr bool converts_to_string{true};
+    static constexpr bool converts_from_string{false};
+
+    static auto to_buf(char* begin, char* end, const db::json_view& value) -> zview {
+        return string_traits<std::string_view>::to_buf(begin, end, value.raw());
+    }
+
+    static auto into_buf(char* begin, char* end, const db::json_view& value) -> char* {
+        return string_traits<std::string_view>::into_buf(begin, end, value.raw());
+    }
+
+    static auto size_buffer(const db::json_view& value) noexcept -> std::size_t { return value.raw().size() + 1; }
+};
+
+}  // namespace pqxx
@@ -1,10 +1,35 @@
 #include "doctest_compatibility.h"
 
+#include <db_wrap/alloc_accounting.hpp>
+#include <db_wrap/db_api.hpp>
+#include <db_wrap/db_arrow.hpp>
+#include <db_wrap/chrono_type.hpp>
+#include <db_wrap/db_change_feed.hpp>
+#include <db_wrap/db_deadline.hpp>
+#include <db_wrap/db_error.hpp>
+#include <db_wrap/db_export.hpp>
+#include <db_wrap/db_metrics.hpp>
+#include <db_wrap/db_mirror.hpp>
+#include <db_wrap/db_prepared.hpp>
+#include <db_wrap/db_queue.hpp>
+#include <db_wrap/db_retry.hpp>
+#include <db_wrap/db_sharded.hpp>
+#include <db_wrap/db_snapshot.hpp>
+#include <db_wrap/db_sync.hpp>
+#include <db_wrap/json_type.hpp>
 #include <db_wrap/sql_utils.hpp>
+#include <db_wrap/uuid_type.hpp>
+#include <db_wrap/details/statement_registry.hpp>
 #include <db_wrap/details/static_string.hpp>
 #include <db_wrap/details/string_utils.hpp>
 #include <db_wrap/details/pfr_utils.hpp>
 
+#include <array>
+#include <charconv>
+#include <cmath>
+#include <filesystem>
+#include <map>
+#include <ranges>
 #include <string_view>
 
 using namespace std::string_view_literals;
@@ -20,6 +45,84 @@ struct TestUserScheme {
   std::string password;
 };
 
+struct TestGeo { double lat, lon; };
+struct TestAddress { std::string city; TestGeo geo; };
+
+struct TestCustomerScheme {
+  static constexpr std::string_view kName = "__test.customers";
+
+  std::int64_t id;
+  TestAddress addr;
+  std::array<char, 4> code;
+};
+
+// a single `point` column, converted by libpqxx instead of being flattened
+struct TestPoint { double x, y; };
+
+namespace pqxx {
+template <>
+struct nullness<TestPoint> : no_null<TestPoint> {};
+
+template <>
+inline const std::string_view type_name<TestPoint>{"TestPoint"};
+
+template <>
+struct string_traits<TestPoint> {
+    static constexpr bool converts_to_string{true};
+    static constexpr bool converts_from_string{true};
+
+    static auto from_string(std::string_view text) -> TestPoint {
+        TestPoint point{};
+        const auto comma = text.find(',');
+        std::from_chars(text.data() + 1, text.data() + comma, point.x);
+        std::from_chars(text.data() + comma + 1, text.data() + text.size() - 1, point.y);
+        return point;
+    }
+
+    static auto to_buf(char* begin, char* end, const TestPoint& value) -> zview {
+        const char* text_end = into_buf(begin, end, value);
+        return zview{begin, static_cast<std::size_t>(text_end - begin - 1)};
+    }
+
+    static auto into_buf(char* begin, char* end, const TestPoint& value) -> char* {
+        *begin++ = '(';
+        begin    = std::to_chars(begin, end, value.x).ptr;
+        *begin++ = ',';
+        begin    = std::to_chars(begin, end, value.y).ptr;
+        *begin++ = ')';
+        *begin++ = '\0';
+        return begin;
+    }
+
+    static auto size_buffer(const TestPoint& /*value*/) noexcept -> std::size_t { return 64; }
+};
+}  // namespace pqxx
+
+struct TestPlaceScheme {
+  static constexpr std::string_view kName = "__test.places";
+
+  std::int64_t id;
+  TestPoint pos;
+};
+
+struct TestAccountScheme {
+  static constexpr std::string_view kName = "__test.accounts";
+  static constexpr std::string_view kVersionField = "revision";
+
+  std::int64_t id;
+  std::int64_t revision;
+  std::int64_t balance;
+};
+
+struct TestPriceScheme {
+  static constexpr std::string_view kName = "__test.prices";
+  static constexpr std::string_view kWatermarkField = "revision";
+
+  std::int64_t id;
+  std::int64_t amount;
+  std::int64_t revision;
+};
+
 TEST_CASE("static_string")
 {
   SECTION("empty string")
@@ -116,6 +219,29 @@ TEST_CASE("get struct names")
     static_assert(struct_names[4] == "eight"sv);
     static_assert(struct_names[5] == "nine"sv);
   }
+  SECTION("nested")
+  {
+    constexpr auto struct_names = utils::get_struct_names<TestCustomerScheme>();
+    static_assert(struct_names.size() == 5);
+    static_assert(utils::get_fields_count<TestCustomerScheme>() == struct_names.size());
+    static_assert(struct_names[0] == "id"sv);
+    static_assert(struct_names[1] == "addr_city"sv);
+    static_assert(struct_names[2] == "addr_geo_lat"sv);
+    static_assert(struct_names[3] == "addr_geo_lon"sv);
+    static_assert(struct_names[4] == "code"sv);
+  }
+  SECTION("converted by pqxx")
+  {
+    constexpr auto struct_names = utils::get_struct_names<TestPlaceScheme>();
+    static_assert(!utils::NestedField<TestPoint>);
+    static_assert(struct_names.size() == 2);
+    static_assert(struct_names[1] == "pos"sv);
+    static_assert(sql::utils::create_insert_all_query<TestPlaceScheme>() == "INSERT INTO __test.places (id, pos) VALUES ($1, $2);"sv);
+
+    const auto point = pqxx::from_string<TestPoint>("(1.5,-2)"sv);
+    REQUIRE_EQ(point.x, 1.5);
+    REQUIRE_EQ(point.y, -2.0);
+  }
 }
 
 TEST_CASE("validate struct names")
@@ -154,6 +280,17 @@ TEST_CASE("get field by name")
     static_assert(utils::get_field_by_name<"eight">(input) == "eight"sv);
     static_assert(utils::get_field_by_name<"nine">(input) == "nine"sv);
   }
+  SECTION("nested")
+  {
+    struct geo { double lat, lon; };
+    struct nested { int32_t one; geo pos; int64_t two; };
+    static constexpr nested input{ 1, { 2.5, 3.5 }, 4 };
+    static_assert(utils::get_field_by_name<"one">(input) == 1);
+    static_assert(utils::get_field_by_name<"pos_lat">(input) == 2.5);
+    static_assert(utils::get_field_by_name<"pos_lon">(input) == 3.5);
+    static_assert(utils::get_field_by_name<"two">(input) == 4);
+    static_assert(utils::get_field_by_idx<2>(input) == 3.5);
+  }
 }
 
 TEST_CASE("get fields count")
@@ -207,6 +344,22 @@ TEST_CASE("static sql insert all")
     constexpr auto kInsertQuery = sql::utils::create_insert_all_query<TestUserScheme>();
     static_assert(kInsertQuery == "INSERT INTO __test.users (id, name, email, display_name, password) VALUES ($1, $2, $3, $4, $5);"sv);
   }
+  SECTION("nested fields")
+  {
+    static_assert(sql::utils::create_insert_all_query<TestCustomerScheme>() == "INSERT INTO __test.customers (id, addr_city, addr_geo_lat, addr_geo_lon, code) VALUES ($1, $2, $3, $4, $5);"sv);
+    static_assert(sql::utils::create_update_all_query<TestCustomerScheme>() == "UPDATE __test.customers SET addr_city = $2, addr_geo_lat = $3, addr_geo_lon = $4, code = $5 WHERE id = $1;"sv);
+    static_assert(sql::utils::create_update_query<TestCustomerScheme, "addr_city">() == "UPDATE __test.customers SET addr_city = $2 WHERE id = $1;"sv);
+    static_assert(sql::details::validate_fields<"addr_geo_lat">(TestCustomerScheme{}));
+    static_assert(!sql::details::validate_fields<"addr">(TestCustomerScheme{}));
+  }
+  SECTION("version field")
+  {
+    static_assert(sql::details::HasVersionField<TestAccountScheme>);
+    static_assert(!sql::details::HasVersionField<TestUserScheme>);
+    static_assert(sql::details::version_field_idx<TestAccountScheme>() == 1);
+    static_assert(sql::utils::create_update_all_query<TestAccountScheme>() == "UPDATE __test.accounts SET revision = revision + 1, balance = $3 WHERE id = $1 AND revision = $2;"sv);
+    static_assert(sql::utils::create_update_query<TestAccountScheme, "balance">() == "UPDATE __test.accounts SET balance = $2, revision = revision + 1 WHERE id = $1 AND revision = $3;"sv);
+  }
 }
 
 TEST_CASE("static sql query")
@@ -233,3 +386,619 @@ TEST_CASE("static sql query")
         static_assert(sql::utils::construct_delete_query_from_condition<TestUserScheme, "name = $1 AND age = $2 OR paid = $3 AND wallet <> $4">() == "DELETE FROM __test.users WHERE name = $1 AND age = $2 OR paid = $3 AND wallet <> $4;"sv);
     }
 }
+
+TEST_CASE("hash shard")
+{
+  SECTION("integral ids")
+  {
+    // placement of rows must never change between builds
+    static_assert(db::hash_shard{}(1, 8) == 5);
+    static_assert(db::hash_shard{}(2, 8) == 2);
+    static_assert(db::hash_shard{}(3, 8) == 0);
+    static_assert(db::hash_shard{}(std::int64_t{4}, 8) == 4);
+    static_assert(db::hash_shard{}(std::int32_t{1}, 8) == db::hash_shard{}(std::uint64_t{1}, 8));
+    static_assert(db::hash_shard{}(42, 1) == 0);
+  }
+  SECTION("textual ids")
+  {
+    static_assert(db::hash_shard{}("abc"sv, 8) == 3);
+    static_assert(db::hash_shard{}("abc", 8) == db::hash_shard{}(std::string_view{"abc"}, 8));
+
+    constexpr auto uuid = db::uuids::convert_to_uuid("877dae4c-0a31-499d-9f81-521532024f53"sv);
+    static_assert(db::hash_shard{}(uuid, 8) == 3);
+    static_assert(db::hash_shard{}(uuid, 8) == db::hash_shard{}(db::uuids::convert_from_uuid(uuid), 8));
+  }
+}
+
+TEST_CASE("statement name")
+{
+  using db::details::statement_name;
+
+  // stable across processes and connections
+  REQUIRE_EQ(statement_name(""), "dbw_cbf29ce484222325");
+  REQUIRE_EQ(statement_name("a"), "dbw_af63dc4c8601ec8c");
+  REQUIRE_EQ(statement_name("SELECT 1"), statement_name("SELECT 1"));
+  REQUIRE_NE(statement_name("SELECT 1"), statement_name("SELECT 2"));
+}
+
+TEST_CASE("statement mode")
+{
+  auto& registry = db::details::statement_registry::instance();
+  db::register_statement("SELECT 42");
+  REQUIRE_EQ(db::current_statement_mode(), db::statement_mode::named);
+  REQUIRE_NE(registry.find("SELECT 42"), nullptr);
+
+  // registered queries fall back to unnamed statements
+  db::set_statement_mode(db::statement_mode::unnamed);
+  REQUIRE_EQ(registry.find("SELECT 42"), nullptr);
+  REQUIRE_EQ(registry.statements().size(), 1);
+
+  db::set_statement_mode(db::statement_mode::named);
+  REQUIRE_NE(registry.find("SELECT 42"), nullptr);
+}
+
+TEST_CASE("json view")
+{
+  constexpr db::json_view doc{R"( {"type": "click", "tags": ["a", "b,]"], "pos": {"x": 1, "y": -2.5}, "n\u00e9": null} )"};
+  static_assert(doc.kind() == db::json_kind::object);
+  static_assert(doc.raw().front() == '{' && doc.raw().back() == '}');
+
+  static_assert(doc.find("type")->raw() == R"("click")");
+  static_assert(doc.find("pos")->find("y")->raw() == "-2.5");
+  static_assert(doc.find("tags")->at(1)->raw() == R"("b,]")");
+  static_assert(!doc.find("tags")->at(2).has_value());
+  static_assert(doc.find("n\xc3\xa9")->kind() == db::json_kind::null);
+  static_assert(!doc.find("missing").has_value());
+  static_assert(!doc.find("type")->find("x").has_value());
+
+  REQUIRE_EQ(doc.find("type")->as_string(), "click");
+  REQUIRE_EQ(db::json_view{R"("a\"b\u00e9\ud83d\ude00")"}.as_string(), "a\"b\xc3\xa9\xf0\x9f\x98\x80");
+  REQUIRE_EQ(doc.find("pos")->find("x")->as<int>(), 1);
+  REQUIRE_EQ(doc.find("pos")->find("y")->as<double>(), -2.5);
+  REQUIRE_EQ(doc.find("type")->as<int>(), std::nullopt);
+  REQUIRE_EQ(db::json_view{"true"}.as<bool>(), true);
+
+  // escaping round-trips through the view
+  std::string escaped{};
+  db::details::json_escape(escaped, "a\"b\\c\n\x01\xc3\xa9");
+  REQUIRE_EQ(escaped, R"("a\"b\\c\n\u0001)" "\xc3\xa9\"");
+  REQUIRE_EQ(db::json_view{escaped}.as_string(), "a\"b\\c\n\x01\xc3\xa9");
+}
+
+TEST_CASE("chrono text")
+{
+  using namespace std::chrono;
+  using db::details::parse_pg_interval;
+  using db::details::parse_pg_timestamp;
+
+  constexpr auto kNewYear = sys_days{2024y / January / 1};
+  static_assert(parse_pg_timestamp("2024-01-01") == db::timestamp{kNewYear});
+  static_assert(parse_pg_timestamp("2024-01-01 00:00:00+00") == db::timestamp{kNewYear});
+  static_assert(parse_pg_timestamp("2024-01-01 03:04:05.25+01") == kNewYear + 2h + 4min + 5s + 250ms);
+  static_assert(parse_pg_timestamp("2023-12-31 23:30:00-05:30") == kNewYear + 5h);
+  static_assert(parse_pg_timestamp("0001-01-01 BC") == db::timestamp{sys_days{year{0} / January / 1}});
+  static_assert(parse_pg_timestamp("infinity") == db::timestamp::max());
+  static_assert(!parse_pg_timestamp("2024-02-30").has_value());
+  static_assert(!parse_pg_timestamp("Mon Jan 01 00:00:00 2024").has_value());
+
+  static_assert(parse_pg_interval("00:00:01.5") == 1500ms);
+  static_assert(parse_pg_interval("3 days 100:00:00") == days{3} + 100h);
+  static_assert(parse_pg_interval("-1 days +02:03:00") == -days{1} + 2h + 3min);
+  static_assert(parse_pg_interval("-00:00:00.000001") == -1us);
+  static_assert(!parse_pg_interval("1 mon").has_value());
+
+  constexpr auto format = [](db::timestamp value) {
+    std::array<char, db::details::kPgTimestampSize> buf{};
+    char* end = db::details::format_pg_timestamp(buf.data(), value);
+    return std::string(buf.data(), end);
+  };
+  REQUIRE_EQ(format(kNewYear + 2h + 4min + 5s + 250ms), "2024-01-01 02:04:05.250000+00");
+  REQUIRE_EQ(format(sys_days{year{-43} / March / 15}), "0044-03-15 00:00:00.000000+00 BC");
+  REQUIRE_EQ(parse_pg_timestamp(format(sys_days{year{-43} / March / 15})), db::timestamp{sys_days{year{-43} / March / 15}});
+}
+
+TEST_CASE("alloc accounting")
+{
+  // called through a volatile pointer, so the allocation cannot be elided
+  void* (*volatile allocate)(std::size_t) = ::operator new;
+  void (*volatile deallocate)(void*) = ::operator delete;
+
+  const auto before = db::thread_alloc_counters();
+  deallocate(allocate(24));
+  const auto after = db::thread_alloc_counters();
+  REQUIRE_EQ(after.allocations - before.allocations, 1);
+  REQUIRE_EQ(after.bytes - before.bytes, 24);
+
+  db::reset_alloc_stats();
+  {
+    const db::details::alloc_scope<TestUserScheme> scope{db::details::alloc_phase::rows, 2};
+    deallocate(allocate(16));
+    deallocate(allocate(48));
+  }
+  {
+    const db::details::alloc_scope<TestUserScheme> scope{db::details::alloc_phase::call};
+  }
+  const auto stats = db::alloc_stats_of<TestUserScheme>();
+  REQUIRE_EQ(stats.scheme, TestUserScheme::kName);
+  REQUIRE_EQ(stats.rows, 2);
+  REQUIRE_EQ(stats.row_allocations, 2);
+  REQUIRE_EQ(stats.row_bytes, 64);
+  REQUIRE_EQ(stats.allocations_per_row(), 1.0);
+  REQUIRE_EQ(stats.calls, 1);
+  REQUIRE_EQ(stats.call_allocations, 0);
+
+  const auto report = db::alloc_report();
+  REQUIRE(std::ranges::any_of(report, [](auto&& entry) { return entry.scheme == TestUserScheme::kName && entry.rows == 2; }));
+}
+
+TEST_CASE("dequeue query")
+{
+  static_assert(db::queue<TestUserScheme>::kDequeueQuery
+      == "SELECT * FROM __test.users ORDER BY id LIMIT $1 FOR UPDATE SKIP LOCKED;"sv);
+  static_assert(db::queue<TestUserScheme, "email IS NOT NULL">::kDequeueQuery
+      == "SELECT * FROM __test.users WHERE email IS NOT NULL ORDER BY id LIMIT $1 FOR UPDATE SKIP LOCKED;"sv);
+}
+
+TEST_CASE("deadline scope")
+{
+  using namespace std::chrono_literals;
+  REQUIRE_FALSE(db::details::current_deadline().has_value());
+  {
+    const db::deadline_scope outer{10s};
+    REQUIRE(db::details::current_deadline().has_value());
+    REQUIRE_GT(outer.remaining(), 9s);
+    {
+      // an inner scope cannot extend the deadline
+      const db::deadline_scope inner{1h};
+      REQUIRE_EQ(inner.deadline(), outer.deadline());
+    }
+    {
+      const db::deadline_scope inner{1s};
+      REQUIRE_LT(inner.deadline(), outer.deadline());
+      REQUIRE_EQ(db::details::current_deadline(), inner.deadline());
+    }
+    REQUIRE_EQ(db::details::current_deadline(), outer.deadline());
+    {
+      const db::deadline_scope passed{db::deadline_clock::now() - 1s};
+      REQUIRE_EQ(passed.remaining(), db::deadline_clock::duration::zero());
+    }
+  }
+  REQUIRE_FALSE(db::details::current_deadline().has_value());
+}
+
+TEST_CASE("retry backoff")
+{
+  using namespace std::chrono_literals;
+
+  SECTION("budget")
+  {
+    db::retry_budget budget{0.5, 2};
+    REQUIRE(budget.try_withdraw());
+    REQUIRE(budget.try_withdraw());
+    REQUIRE_FALSE(budget.try_withdraw());
+    // two transactions earn one retry
+    budget.deposit();
+    REQUIRE_FALSE(budget.try_withdraw());
+    budget.deposit();
+    REQUIRE(budget.try_withdraw());
+    // never more than max_tokens
+    for (int i = 0; i < 10; ++i) {
+      budget.deposit();
+    }
+    REQUIRE(budget.try_withdraw());
+    REQUIRE(budget.try_withdraw());
+    REQUIRE_FALSE(budget.try_withdraw());
+  }
+  SECTION("full jitter")
+  {
+    const db::retry_policy policy{.max_attempts = 10, .base_delay = 4ms, .max_delay = 20ms};
+    for (int i = 0; i < 100; ++i) {
+      REQUIRE_LE(db::details::retry_backoff(policy, 0), 4ms);
+      REQUIRE_LE(db::details::retry_backoff(policy, 1), 8ms);
+      REQUIRE_LE(db::details::retry_backoff(policy, 8), 20ms);
+    }
+  }
+}
+
+TEST_CASE("prometheus exposition")
+{
+  using namespace std::chrono_literals;
+
+  db::connection_pool pool{"postgresql://localhost/unused", 4};
+  db::query_cache cache{pool, 1024};
+  auto& metrics = db::details::query_metrics::instance();
+  metrics.record("SELECT \"quoted\"\nFROM t", 700us, pqxx::result{});
+  metrics.record("SELECT \"quoted\"\nFROM t", 3s, pqxx::result{});
+
+  db::metrics_exporter exporter{};
+  exporter.add_pool("primary", pool);
+  exporter.add_cache("hot", cache);
+  const auto text = exporter.render();
+
+  // every line is a comment or `name{labels} value`, and every sample belongs to a declared family
+  std::map<std::string, std::string> families{};
+  std::map<std::string, double> samples{};
+  for (auto&& line_range : std::views::split(std::string_view{text}, '\n')) {
+    const std::string_view line{line_range.begin(), line_range.end()};
+    if (line.empty()) {
+      continue;
+    }
+    if (line.starts_with("# TYPE ")) {
+      const auto rest = line.substr(7);
+      families.emplace(std::string{rest.substr(0, rest.find(' '))}, std::string{rest.substr(rest.find(' ') + 1)});
+      continue;
+    }
+    if (line.starts_with("# HELP ")) {
+      continue;
+    }
+    const auto value_pos = line.rfind(' ');
+    REQUIRE(value_pos != std::string_view::npos);
+    const auto series = line.substr(0, value_pos);
+    const auto name = series.substr(0, series.find('{'));
+    double value{};
+    const auto value_text = line.substr(value_pos + 1);
+    REQUIRE(std::from_chars(value_text.data(), value_text.data() + value_text.size(), value).ec == std::errc{});
+
+    auto family = std::string{name};
+    for (auto suffix : {"_bucket", "_sum", "_count"}) {
+      if (family.ends_with(suffix) && !families.contains(family)) {
+        family.resize(family.size() - std::string_view{suffix}.size());
+      }
+    }
+    REQUIRE(families.contains(family));
+    samples.emplace(std::string{series}, value);
+  }
+
+  REQUIRE_EQ(families["db_wrap_pool_connections_max"], "gauge");
+  REQUIRE_EQ(families["db_wrap_query_duration_seconds"], "histogram");
+  REQUIRE_EQ(samples[R"(db_wrap_pool_connections_max{pool="primary"})"], 4);
+  REQUIRE_EQ(samples[R"(db_wrap_pool_connections_checked_out{pool="primary"})"], 0);
+
+  // label values are escaped, buckets are cumulative
+  constexpr std::string_view kQueryLabel = R"(query="SELECT \"quoted\"\nFROM t")";
+  auto series = [&](std::string_view name, std::string_view extra = {}) {
+    std::string result{name};
+    result += '{';
+    result += kQueryLabel;
+    result += extra;
+    result += '}';
+    return samples.at(result);
+  };
+  REQUIRE_EQ(series("db_wrap_query_duration_seconds_bucket", R"(,le="0.0005")"), 0);
+  REQUIRE_EQ(series("db_wrap_query_duration_seconds_bucket", R"(,le="0.001")"), 1);
+  REQUIRE_EQ(series("db_wrap_query_duration_seconds_bucket", R"(,le="2.5")"), 1);
+  REQUIRE_EQ(series("db_wrap_query_duration_seconds_bucket", R"(,le="5")"), 2);
+  REQUIRE_EQ(series("db_wrap_query_duration_seconds_bucket", R"(,le="+Inf")"), 2);
+  REQUIRE_EQ(series("db_wrap_query_duration_seconds_count"), 2);
+  REQUIRE_LT(std::abs(series("db_wrap_query_duration_seconds_sum") - 3.0007), 1e-9);
+}
+
+TEST_CASE("test_decoding parser")
+{
+  using db::details::decoded_line;
+  using db::details::test_decoding_parser;
+
+  db::details::decoded_change change{};
+  REQUIRE_EQ(test_decoding_parser::parse("BEGIN"sv, change), decoded_line::begin);
+  REQUIRE_EQ(test_decoding_parser::parse("COMMIT"sv, change), decoded_line::commit);
+  REQUIRE_EQ(test_decoding_parser::parse("message: transactional: 1 prefix: p, sz: 1 content:x"sv, change), decoded_line::other);
+
+  SECTION("insert")
+  {
+    constexpr auto kLine = R"(table __test.users: INSERT: id[bigint]:7 name[text]:'it''s me' email[character varying]:null display_name[text]:'a b' password[text]:unchanged-toast-datum)"sv;
+    REQUIRE_EQ(test_decoding_parser::parse(kLine, change), decoded_line::change);
+    REQUIRE_EQ(change.table, "__test.users");
+    REQUIRE_EQ(change.kind, db::change_kind::insert);
+    REQUIRE(change.old_tuple.empty());
+    REQUIRE_EQ(change.new_tuple.size(), 5);
+    REQUIRE_EQ(change.new_tuple[1].value, "it's me");
+    REQUIRE_FALSE(change.new_tuple[2].value.has_value());
+    REQUIRE(change.new_tuple[4].unchanged_toast);
+
+    // a NULL cannot be stored in a std::string field
+    REQUIRE_THROWS_AS(db::details::decode_tuple<TestUserScheme>(change.new_tuple), pqxx::conversion_error);
+    change.new_tuple[2].value = "me@example.com";
+
+    std::array<bool, 5> unchanged{};
+    auto user = db::details::decode_tuple<TestUserScheme>(change.new_tuple, unchanged);
+    REQUIRE_EQ(user.id, 7);
+    REQUIRE_EQ(user.name, "it's me");
+    REQUIRE_EQ(user.email, "me@example.com");
+    REQUIRE_EQ(user.display_name, "a b");
+    REQUIRE(user.password.empty());
+    REQUIRE_EQ(unchanged, (std::array<bool, 5>{false, false, false, false, true}));
+
+    // the mirror keeps the values a change did not carry
+    const TestUserScheme previous{.id = 7, .name = "old", .email = "", .display_name = "", .password = "secret"};
+    db::details::keep_unchanged(user, previous, unchanged);
+    REQUIRE_EQ(user.name, "it's me");
+    REQUIRE_EQ(user.password, "secret");
+  }
+  SECTION("update with old row")
+  {
+    constexpr auto kLine = R"(table public."Mixed Case": UPDATE: old-key: id[bigint]:1 "the tags"[text[]]:'{a,b}' new-tuple: id[bigint]:2 "the tags"[text[]]:'{c}')"sv;
+    REQUIRE_EQ(test_decoding_parser::parse(kLine, change), decoded_line::change);
+    REQUIRE_EQ(change.table, R"(public."Mixed Case")");
+    REQUIRE_EQ(change.kind, db::change_kind::update);
+    REQUIRE_EQ(change.old_tuple.size(), 2);
+    REQUIRE_EQ(change.old_tuple[1].name, "the tags");
+    REQUIRE_EQ(change.old_tuple[1].value, "{a,b}");
+    REQUIRE_EQ(change.new_tuple.size(), 2);
+    REQUIRE_EQ(change.new_tuple[0].value, "2");
+  }
+  SECTION("delete and truncate")
+  {
+    REQUIRE_EQ(test_decoding_parser::parse("table public.users: DELETE: id[bigint]:3"sv, change), decoded_line::change);
+    REQUIRE_EQ(change.kind, db::change_kind::remove);
+    REQUIRE_EQ(change.new_tuple.size(), 1);
+    REQUIRE_EQ(test_decoding_parser::parse("table public.users: DELETE: (no-tuple-data)"sv, change), decoded_line::change);
+    REQUIRE(change.new_tuple.empty());
+    REQUIRE_EQ(test_decoding_parser::parse("table public.users: TRUNCATE: (no-flags)"sv, change), decoded_line::change);
+    REQUIRE_EQ(change.kind, db::change_kind::truncate);
+  }
+  SECTION("action markers in values and names")
+  {
+    constexpr auto kLine = R"(table public.notes: UPDATE: id[bigint]:1 body[text]:'see: INSERT: here, not: DELETE:')"sv;
+    REQUIRE_EQ(test_decoding_parser::parse(kLine, change), decoded_line::change);
+    REQUIRE_EQ(change.table, "public.notes");
+    REQUIRE_EQ(change.kind, db::change_kind::update);
+    REQUIRE_EQ(change.new_tuple.size(), 2);
+    REQUIRE_EQ(change.new_tuple[1].value, "see: INSERT: here, not: DELETE:");
+
+    constexpr auto kQuotedName = R"(table public."a: DELETE: ""b""": INSERT: id[bigint]:2)"sv;
+    REQUIRE_EQ(test_decoding_parser::parse(kQuotedName, change), decoded_line::change);
+    REQUIRE_EQ(change.table, R"(public."a: DELETE: ""b""")");
+    REQUIRE_EQ(change.kind, db::change_kind::insert);
+    REQUIRE_EQ(change.new_tuple.size(), 1);
+  }
+}
+
+TEST_CASE("mirror snapshot")
+{
+  using snapshot_t = db::mirror_snapshot<TestUserScheme, db::hash_index<"email">, db::sorted_index<"name">>;
+  const snapshot_t snapshot{{
+      {.id = 1, .name = "carol", .email = "shared@example.com", .display_name = "", .password = ""},
+      {.id = 4, .name = "alice", .email = "alice@example.com", .display_name = "", .password = ""},
+      {.id = 7, .name = "bob", .email = "shared@example.com", .display_name = "", .password = ""},
+      {.id = 9, .name = "bob", .email = "bob@example.com", .display_name = "", .password = ""},
+  }};
+  REQUIRE_EQ(snapshot.size(), 4);
+
+  SECTION("by id")
+  {
+    REQUIRE_EQ(snapshot.find(4)->name, "alice");
+    REQUIRE_EQ(snapshot.find(5), nullptr);
+    REQUIRE_EQ(snapshot.find(10), nullptr);
+  }
+  SECTION("hash index")
+  {
+    const auto shared = snapshot.find<"email">("shared@example.com"sv);
+    REQUIRE_EQ(shared.size(), 2);
+    REQUIRE_EQ(shared[0]->id, 1);
+    REQUIRE_EQ(shared[1]->id, 7);
+    REQUIRE(snapshot.find<"email">(std::string{"nobody@example.com"}).empty());
+  }
+  SECTION("sorted index")
+  {
+    const auto bobs = snapshot.find<"name">("bob"sv);
+    REQUIRE_EQ(bobs.size(), 2);
+    REQUIRE_EQ(bobs[0]->id, 7);
+    REQUIRE_EQ(bobs[1]->id, 9);
+
+    const auto names = snapshot.range<"name">("alice"sv, "bob"sv);
+    REQUIRE_EQ(names.size(), 1);
+    REQUIRE_EQ(names[0]->name, "alice");
+    REQUIRE_EQ(snapshot.range<"name">("b"sv, "z"sv).size(), 3);
+  }
+}
+
+TEST_CASE("sync query")
+{
+  static_assert(db::details::construct_sync_query<TestPriceScheme, false>()
+      == "SELECT * FROM __test.prices ORDER BY revision;"sv);
+  static_assert(db::details::construct_sync_query<TestPriceScheme, true>()
+      == "SELECT * FROM __test.prices WHERE revision >= $1 ORDER BY revision;"sv);
+  static_assert(db::details::construct_sync_query<TestUserScheme, false>() == "SELECT * FROM __test.users;"sv);
+  static_assert(db::details::construct_sync_query<TestUserScheme, true>()
+      == "SELECT * FROM __test.users WHERE age(xmin) <= age(($1 % 4294967296)::text::xid);"sv);
+  static_assert(std::is_same_v<db::watermark_t<TestPriceScheme>, std::int64_t>);
+  static_assert(std::is_same_v<db::watermark_t<TestUserScheme>, std::int64_t>);
+
+  std::map<std::int64_t, TestPriceScheme> prices{{1, {.id = 1, .amount = 10, .revision = 1}}};
+  db::details::apply_synced(prices, TestPriceScheme{.id = 1, .amount = 20, .revision = 2});
+  REQUIRE_EQ(prices.at(1).amount, 20);
+
+  std::size_t calls{};
+  auto count = [&](TestPriceScheme&&) { ++calls; };
+  db::details::apply_synced(count, TestPriceScheme{.id = 2, .amount = 5, .revision = 3});
+  REQUIRE_EQ(calls, 1);
+}
+
+struct TestProfileScheme {
+  static constexpr std::string_view kName = "__test.profiles";
+
+  std::int64_t id;
+  std::optional<std::string> bio;
+  TestGeo home;
+  std::optional<std::int32_t> age;
+};
+
+class TestTicks {
+ public:
+  constexpr auto count() const noexcept -> std::uint64_t { return m_count; }
+
+ private:
+  std::uint64_t m_count{};
+};
+
+struct TestCounterScheme {
+  static constexpr std::string_view kName = "__test.counters";
+
+  std::int64_t id;
+  std::uint64_t ticks;
+};
+
+struct TestTickCounterScheme {
+  static constexpr std::string_view kName = "__test.counters";
+
+  std::int64_t id;
+  TestTicks ticks;
+};
+
+TEST_CASE("mapped snapshot")
+{
+  const auto path = std::filesystem::temp_directory_path() / "db_wrap_unit_snapshot.bin";
+  REQUIRE_FALSE(db::mapped_snapshot<TestProfileScheme>::open(path / "missing").has_value());
+
+  const std::vector<TestProfileScheme> profiles{
+      {.id = 1, .bio = "first", .home = {.lat = 52.5, .lon = 13.4}, .age = 30},
+      {.id = 2, .bio = std::nullopt, .home = {.lat = -1.0, .lon = 2.0}, .age = std::nullopt},
+      {.id = 3, .bio = "", .home = {}, .age = 7},
+  };
+  db::write_snapshot<TestProfileScheme>(path, profiles, 42);
+
+  {
+    auto snapshot = db::mapped_snapshot<TestProfileScheme>::open(path);
+    REQUIRE(snapshot.has_value());
+    REQUIRE_EQ(snapshot->size(), 3);
+    REQUIRE_EQ(snapshot->watermark(), 42);
+
+    // fields are read in place, text as views into the mapping
+    REQUIRE_EQ(snapshot->row(0).get<"bio">(), "first"sv);
+    REQUIRE_FALSE(snapshot->row(1).get<"bio">().has_value());
+    REQUIRE_EQ(snapshot->row(1).get<"home_lon">(), 2.0);
+    REQUIRE_EQ(snapshot->row(2).get<"age">(), 7);
+
+    const auto loaded = snapshot->load_all();
+    REQUIRE_EQ(loaded.size(), 3);
+    REQUIRE_EQ(loaded[0].bio, "first");
+    REQUIRE_EQ(loaded[0].home.lat, 52.5);
+    REQUIRE_FALSE(loaded[1].age.has_value());
+    REQUIRE_EQ(loaded[2].bio, "");
+  }
+
+  // a snapshot of another scheme or a truncated one is rejected
+  REQUIRE_FALSE(db::mapped_snapshot<TestPriceScheme>::open(path).has_value());
+  std::filesystem::resize_file(path, std::filesystem::file_size(path) - 4);
+  REQUIRE_FALSE(db::mapped_snapshot<TestProfileScheme>::open(path).has_value());
+  std::filesystem::remove(path);
+
+  // a field of another type of the same size and signedness changes the hash
+  static_assert(db::details::snapshot_schema_hash<TestCounterScheme>()
+      != db::details::snapshot_schema_hash<TestTickCounterScheme>());
+}
+
+TEST_CASE("arrow export")
+{
+  SECTION("schema")
+  {
+    db::arrow_batch batch{};
+    batch.schema = db::details::make_arrow_schema<TestProfileScheme>();
+    REQUIRE_EQ(std::string_view{batch.schema.format}, "+s"sv);
+    REQUIRE_EQ(batch.schema.n_children, 5);
+    REQUIRE_EQ(std::string_view{batch.schema.children[1]->name}, "bio"sv);
+    REQUIRE_EQ(std::string_view{batch.schema.children[1]->format}, "U"sv);
+    REQUIRE_EQ(batch.schema.children[1]->flags, ARROW_FLAG_NULLABLE);
+    REQUIRE_EQ(std::string_view{batch.schema.children[2]->name}, "home_lat"sv);
+    REQUIRE_EQ(std::string_view{batch.schema.children[2]->format}, "g"sv);
+    REQUIRE_EQ(std::string_view{batch.schema.children[4]->format}, "i"sv);
+
+    // a child moved out is released on its own
+    ArrowSchema child = *batch.schema.children[0];
+    batch.schema.children[0]->release = nullptr;
+    REQUIRE_EQ(std::string_view{child.format}, "l"sv);
+    child.release(&child);
+    REQUIRE_EQ(child.release, nullptr);
+  }
+  SECTION("columns")
+  {
+    db::details::arrow_column<std::optional<std::string>> text{3};
+    text.append("ab"sv, "bio");
+    text.append(std::nullopt, "bio");
+    text.append("cde"sv, "bio");
+    ArrowArray texts{};
+    std::move(text).finish(texts);
+    REQUIRE_EQ(texts.length, 3);
+    REQUIRE_EQ(texts.null_count, 1);
+    REQUIRE_EQ(texts.n_buffers, 3);
+    REQUIRE_EQ(*static_cast<const std::uint8_t*>(texts.buffers[0]), 0b101);
+    const auto* offsets = static_cast<const std::int64_t*>(texts.buffers[1]);
+    REQUIRE_EQ(offsets[3], 5);
+    REQUIRE_EQ((std::string_view{static_cast<const char*>(texts.buffers[2]), 5}), "abcde"sv);
+    texts.release(&texts);
+
+    db::details::arrow_column<std::int64_t> numbers{2};
+    numbers.append("1"sv, "id");
+    numbers.append("-7"sv, "id");
+    REQUIRE_THROWS_AS(numbers.append(std::nullopt, "id"), pqxx::conversion_error);
+    ArrowArray ids{};
+    std::move(numbers).finish(ids);
+    REQUIRE_EQ(ids.null_count, 0);
+    REQUIRE_EQ(ids.buffers[0], nullptr);
+    REQUIRE_EQ(static_cast<const std::int64_t*>(ids.buffers[1])[1], -7);
+    ids.release(&ids);
+  }
+}
+
+TEST_CASE("export writers")
+{
+  SECTION("json")
+  {
+    REQUIRE_EQ(db::details::kJsonKeys<TestProfileScheme>[0], "{\"id\":"sv);
+    REQUIRE_EQ(db::details::kJsonKeys<TestProfileScheme>[2], ",\"home_lat\":"sv);
+
+    std::string out{};
+    db::details::append_json_value<std::optional<std::string>>(out, "a\"b\\c\n\x01"sv);
+    REQUIRE_EQ(out, "\"a\\\"b\\\\c\\n\\u0001\""sv);
+    out.clear();
+    db::details::append_json_value<std::optional<std::int32_t>>(out, std::nullopt);
+    db::details::append_json_value<std::int64_t>(out, "-12"sv);
+    db::details::append_json_value<bool>(out, "t"sv);
+    db::details::append_json_value<double>(out, "NaN"sv);
+    db::details::append_json_value<db::json>(out, "{\"k\": [1]}"sv);
+    REQUIRE_EQ(out, "null-12true\"NaN\"{\"k\": [1]}"sv);
+  }
+  SECTION("csv")
+  {
+    std::string out{};
+    db::details::append_csv_value<std::optional<std::string>>(out, std::nullopt);
+    out += ',';
+    db::details::append_csv_value<std::string>(out, ""sv);
+    out += ',';
+    db::details::append_csv_value<std::string>(out, "plain"sv);
+    out += ',';
+    db::details::append_csv_value<std::string>(out, "a,\"b\"\r\n"sv);
+    out += ',';
+    db::details::append_csv_value<bool>(out, "f"sv);
+    REQUIRE_EQ(out, ",\"\",plain,\"a,\"\"b\"\"\r\n\",false"sv);
+  }
+  SECTION("query")
+  {
+    REQUIRE_EQ(db::details::copy_query("SELECT * FROM t; \n"sv), "SELECT * FROM t"sv);
+    REQUIRE_EQ(db::details::copy_query("SELECT 1"sv), "SELECT 1"sv);
+  }
+}
+
+TEST_CASE("error capture")
+{
+  REQUIRE_EQ(db::details::classify_sqlstate("23505"), db::error_kind::unique_violation);
+  REQUIRE_EQ(db::details::classify_sqlstate("40P01"), db::error_kind::deadlock);
+  REQUIRE_EQ(db::details::classify_sqlstate("08006"), db::error_kind::connection);
+  REQUIRE_EQ(db::details::classify_sqlstate("42601"), db::error_kind::other);
+
+  auto value = db::details::capture_error([] { return 42; });
+  REQUIRE(value.has_value());
+  REQUIRE_EQ(*value, 42);
+
+  auto conversion = db::details::capture_error([]() -> int { throw pqxx::conversion_error{"bad int"}; });
+  REQUIRE_FALSE(conversion.has_value());
+  REQUIRE_EQ(conversion.error().kind, db::error_kind::conversion);
+  REQUIRE_EQ(conversion.value_or(7), 7);
+
+  auto deadline = db::details::capture_error([]() -> int { throw db::deadline_exceeded{"SELECT 1"}; });
+  REQUIRE_EQ(deadline.error().kind, db::error_kind::deadline_exceeded);
+
+  constexpr auto kInsertQuery = db::details::construct_insert_or_skip_query<TestUserScheme>();
+  REQUIRE_EQ(std::string_view{kInsertQuery},
+      "INSERT INTO __test.users (id, name, email, display_name, password) VALUES ($1, $2, $3, $4, $5) ON CONFLICT (id) DO NOTHING;"sv);
+}
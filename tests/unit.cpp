@@ -1,2 +1,5 @@
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include "doctest_compatibility.h"
+
+#define DB_WRAP_ALLOC_HOOKS_IMPLEMENT
+#include <db_wrap/alloc_hooks.hpp>